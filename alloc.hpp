@@ -0,0 +1,93 @@
+#ifndef TTT_ALLOC_HPP_
+#define TTT_ALLOC_HPP_
+
+/// Allocation accounting
+///
+/// With TTT_ALLOC_STATS defined (`make alloc`) the global operator new
+/// and delete are replaced by ones that count, per thread, how many
+/// allocations were made and how many bytes they asked for. Without it
+/// allocations_so_far() is a constant zero and all the bookkeeping
+/// built on it folds away.
+
+#include <cstddef>
+#include <cstdint>
+
+struct alloc_count {
+  std::uint64_t allocations;
+  std::uint64_t bytes;
+
+  alloc_count operator-(const alloc_count& other) const {
+    return alloc_count{allocations - other.allocations, bytes - other.bytes};
+  }
+
+  alloc_count& operator+=(const alloc_count& other) {
+    allocations += other.allocations;
+    bytes += other.bytes;
+    return *this;
+  }
+};
+
+#ifndef TTT_ALLOC_STATS
+
+constexpr bool alloc_stats_enabled = false;
+
+inline alloc_count allocations_so_far() { return alloc_count{0, 0}; }
+
+#else
+
+#include <cstdlib>
+#include <new>
+
+constexpr bool alloc_stats_enabled = true;
+
+namespace alloc_detail {
+
+/// Plain data, so it needs no guard to initialise
+inline alloc_count& counter() {
+  thread_local alloc_count count{0, 0};
+  return count;
+}
+
+inline void* allocate(std::size_t size) {
+  auto& count = counter();
+  count.allocations++;
+  count.bytes += size;
+  void* p = std::malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+}
+
+/// Allocations made by the calling thread since it started
+inline alloc_count allocations_so_far() { return alloc_detail::counter(); }
+
+/// The replacements; ttt is a single translation unit, so defining
+/// them in a header is fine
+void* operator new(std::size_t size) { return alloc_detail::allocate(size); }
+void* operator new[](std::size_t size) { return alloc_detail::allocate(size); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+#endif // TTT_ALLOC_STATS
+
+/// What one test allocated on the thread that ran it
+struct alloc_tally {
+  alloc_count generation{0, 0};   // building the passage
+  std::size_t lines{0};
+  alloc_count test{0, 0};         // from the first frame to the score
+  alloc_count keys{0, 0};         // handling keystrokes
+  std::size_t keystrokes{0};
+
+  /// Keystrokes within a line, past the first one of the test, that
+  /// allocated: the steady state, which should allocate nothing
+  std::size_t steady_keystrokes{0};
+  std::size_t steady_allocating{0};
+  alloc_count steady{0, 0};
+};
+
+#endif // TTT_ALLOC_HPP_
@@ -0,0 +1,81 @@
+#ifndef TTT_GHOST_HPP_
+#define TTT_GHOST_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "passage.hpp"
+#include "rescore.hpp"
+#include "score.hpp"
+#include "session.hpp"
+
+/// How often a running ghost is redrawn
+constexpr int ghost_tick_ms = 33;
+
+/// Replays the keystroke timeline of a recorded session
+///
+/// Timestamps in a log only ever increase, so where the ghost is at any
+/// moment is a binary search, however long the session was.
+class ghost_replay {
+public:
+  explicit ghost_replay(const session_view& session)
+    : keys_(session.keys), num_keys_(session.num_keys),
+      start_(session.num_lines > 0 ? session.indents[0] : 0) {}
+
+  /// Glyph the ghost's cursor is on `elapsed_us` into the test
+  std::uint32_t position(std::uint64_t elapsed_us) const {
+    const auto end = keys_ + num_keys_;
+    const auto next = std::upper_bound(keys_, end, elapsed_us,
+      [](std::uint64_t t, const keystroke& k) { return t < k.time_us; });
+    if (next == keys_) {
+      return start_;
+    }
+
+    /// Keys record the cursor before typing and after erasing
+    const auto& last = *(next - 1);
+    return last.kind == keystroke::backspace ? last.position : last.position + 1;
+  }
+
+  bool finished(std::uint64_t elapsed_us) const {
+    return num_keys_ == 0 || elapsed_us >= keys_[num_keys_ - 1].time_us;
+  }
+
+private:
+  const keystroke* keys_;
+  std::size_t num_keys_;
+  std::uint32_t start_;
+};
+
+/// Rebuild the passage a session was typed on
+inline passage passage_from_session(const session_view& session) {
+  passage result;
+  for (std::size_t n = 0; n < session.num_lines; ++n) {
+    const auto begin = session.line_offsets[n];
+    result.add_line(std::string(session.text + begin, session.line_offsets[n + 1] - begin), session.indents[n]);
+  }
+  result.ascii = session.ascii;
+  return result;
+}
+
+/// The fastest session in `dir`, or null if there is none
+inline std::unique_ptr<mapped_session> load_best_session(const std::string& dir, double& best_wpm) {
+  std::unique_ptr<mapped_session> best;
+  best_wpm = 0;
+
+  for (const auto& path : list_sessions(dir)) {
+    std::unique_ptr<mapped_session> session(new mapped_session(path));
+    if (!session->valid() || session->view().num_keys == 0) {
+      continue;
+    }
+    const auto wpm = score(session->view()).wpm;
+    if (!best || wpm > best_wpm) {
+      best = std::move(session);
+      best_wpm = wpm;
+    }
+  }
+  return best;
+}
+
+#endif // TTT_GHOST_HPP_
@@ -0,0 +1,191 @@
+#ifndef TTT_LAYOUT_HPP_
+#define TTT_LAYOUT_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "passage.hpp"
+#include "score.hpp"
+#include "utf8.hpp"
+
+/// The printable keys of a US-style keyboard, number row to bottom row,
+/// left to right, unshifted and shifted
+struct keyboard_layout {
+  const char* name;
+  const char* lower;
+  const char* upper;
+};
+
+constexpr std::size_t num_layout_keys = 47;
+
+enum layout_id : std::size_t { qwerty, dvorak, colemak, num_layouts };
+
+constexpr keyboard_layout keyboard_layouts[num_layouts] = {
+  {"qwerty",
+   "`1234567890-=" "qwertyuiop[]\\" "asdfghjkl;'" "zxcvbnm,./",
+   "~!@#$%^&*()_+" "QWERTYUIOP{}|" "ASDFGHJKL:\"" "ZXCVBNM<>?"},
+  {"dvorak",
+   "`1234567890[]" "',.pyfgcrl/=\\" "aoeuidhtns-" ";qjkxbmwvz",
+   "~!@#$%^&*(){}" "\"<>PYFGCRL?+|" "AOEUIDHTNS_" ":QJKXBMWVZ"},
+  {"colemak",
+   "`1234567890-=" "qwfpgjluy;[]\\" "arstdhneio'" "zxcvbkm,./",
+   "~!@#$%^&*()_+" "QWFPGJLUY:{}|" "ARSTDHNEIO\"" "ZXCVBKM<>?"},
+};
+
+/// Touch-typing finger of every key, in the same order as the layouts
+enum finger : std::uint8_t {
+  left_pinky, left_ring, left_middle, left_index,
+  right_index, right_middle, right_ring, right_pinky,
+  thumb, num_fingers, no_finger = 0xFF
+};
+
+constexpr const char* key_fingers = "0012334456777" "0123344567777" "01233445677" "0123344567";
+
+inline const char* finger_name(std::size_t f) {
+  static const char* const names[num_fingers] = {
+    "left pinky", "left ring", "left middle", "left index",
+    "right index", "right middle", "right ring", "right pinky", "thumbs",
+  };
+  return f < num_fingers ? names[f] : "";
+}
+
+/// A byte-to-byte lookup table, built at compile time
+struct byte_table {
+  unsigned char to[256];
+
+  constexpr unsigned char operator[](unsigned char c) const { return to[c]; }
+};
+
+/// Turn what the OS sends for a key under layout `from` into what that
+/// key means under layout `to`. Everything else, UTF-8 included, is
+/// left alone.
+constexpr byte_table make_remap(const keyboard_layout& from, const keyboard_layout& to) {
+  byte_table table{};
+  for (unsigned c = 0; c < 256; ++c) {
+    table.to[c] = static_cast<unsigned char>(c);
+  }
+  for (std::size_t k = 0; k < num_layout_keys; ++k) {
+    table.to[static_cast<unsigned char>(from.lower[k])] = static_cast<unsigned char>(to.lower[k]);
+    table.to[static_cast<unsigned char>(from.upper[k])] = static_cast<unsigned char>(to.upper[k]);
+  }
+  return table;
+}
+
+/// Which finger types each character under `layout`
+constexpr byte_table make_fingers(const keyboard_layout& layout) {
+  byte_table table{};
+  for (unsigned c = 0; c < 256; ++c) {
+    table.to[c] = no_finger;
+  }
+  for (std::size_t k = 0; k < num_layout_keys; ++k) {
+    const auto f = static_cast<unsigned char>(key_fingers[k] - '0');
+    table.to[static_cast<unsigned char>(layout.lower[k])] = f;
+    table.to[static_cast<unsigned char>(layout.upper[k])] = f;
+  }
+  table.to[static_cast<unsigned char>(' ')] = thumb;
+  return table;
+}
+
+struct layout_tables {
+  byte_table remap[num_layouts][num_layouts];   // [os layout][typed layout]
+  byte_table fingers[num_layouts];
+};
+
+constexpr layout_tables make_layout_tables() {
+  layout_tables tables{};
+  for (std::size_t from = 0; from < num_layouts; ++from) {
+    for (std::size_t to = 0; to < num_layouts; ++to) {
+      tables.remap[from][to] = make_remap(keyboard_layouts[from], keyboard_layouts[to]);
+    }
+    tables.fingers[from] = make_fingers(keyboard_layouts[from]);
+  }
+  return tables;
+}
+
+constexpr layout_tables layouts = make_layout_tables();
+
+namespace layout_detail {
+
+constexpr std::size_t length(const char* s) {
+  std::size_t n = 0;
+  while (s[n]) {
+    n++;
+  }
+  return n;
+}
+
+/// Every layout must hold the same characters as QWERTY, each once, so
+/// that every remapping is a permutation
+constexpr bool same_keys(const keyboard_layout& layout) {
+  if (length(layout.lower) != num_layout_keys || length(layout.upper) != num_layout_keys) {
+    return false;
+  }
+  for (unsigned c = 0; c < 256; ++c) {
+    if (make_remap(keyboard_layouts[qwerty], layout)[make_remap(layout, keyboard_layouts[qwerty])[c]] != c) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}
+
+static_assert(layout_detail::length(key_fingers) == num_layout_keys, "one finger per key");
+static_assert(layout_detail::same_keys(keyboard_layouts[dvorak]), "dvorak must permute the qwerty keys");
+static_assert(layout_detail::same_keys(keyboard_layouts[colemak]), "colemak must permute the qwerty keys");
+static_assert(layouts.remap[qwerty][dvorak]['q'] == '\'' && layouts.remap[dvorak][qwerty]['o'] == 's',
+              "remapping goes by key position");
+static_assert(layouts.fingers[colemak]['t'] == left_index && layouts.fingers[dvorak]['s'] == right_pinky,
+              "fingers follow the keys");
+
+inline bool parse_layout(const std::string& name, layout_id& out) {
+  for (std::size_t k = 0; k < num_layouts; ++k) {
+    if (name == keyboard_layouts[k].name) {
+      out = static_cast<layout_id>(k);
+      return true;
+    }
+  }
+  return false;
+}
+
+/// How one finger did in a test
+struct finger_result {
+  std::uint32_t keys{0};
+  std::uint32_t mistakes{0};
+  std::uint64_t time_us{0};
+};
+
+/// Per-finger time and mistakes of a finished test. Each keystroke's
+/// interval since the one before is charged to the finger that should
+/// have typed the glyph at its position.
+inline std::vector<finger_result> finger_results(const passage& p, const std::vector<keystroke>& keys,
+                                                 const byte_table& fingers) {
+  /// Finger of every glyph, by its first byte
+  std::vector<std::uint8_t> glyph_fingers;
+  glyph_fingers.reserve(p.text.size());
+  utf8::line line;
+  for (std::size_t n = 0; n < p.num_lines(); ++n) {
+    line.assign(p.line_data(n), p.line_size(n), p.ascii);
+    for (std::size_t g = 0; g < line.size(); ++g) {
+      glyph_fingers.push_back(fingers[static_cast<unsigned char>(line.text()[line.at(g).offset])]);
+    }
+  }
+
+  std::vector<finger_result> result(num_fingers);
+  std::uint64_t previous = 0;
+  for (const auto& key : keys) {
+    const auto f = key.position < glyph_fingers.size() ? glyph_fingers[key.position] : std::uint8_t(no_finger);
+    if (f < num_fingers) {
+      result[f].keys++;
+      result[f].time_us += key.time_us - previous;
+      if (key.kind == keystroke::mistake) {
+        result[f].mistakes++;
+      }
+    }
+    previous = key.time_us;
+  }
+  return result;
+}
+
+#endif // TTT_LAYOUT_HPP_
@@ -0,0 +1,492 @@
+#ifndef TTT_LEADERBOARD_HPP_
+#define TTT_LEADERBOARD_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "unix_socket.hpp"
+
+/// Every message on the leaderboard socket is exactly this size
+///
+/// Like the race socket it is SOCK_SEQPACKET, and a reply to a top-n
+/// query is one packet: a `standing` header followed by its entries.
+struct leaderboard_message {
+  enum : std::uint8_t { submit = 1, query_top = 2, query_rank = 3, standing = 4, entry = 5 };
+
+  std::uint8_t type;
+  std::uint8_t reserved;
+  std::uint16_t accuracy;  // hundredths of a percent
+  std::uint32_t wpm;       // hundredths of a word per minute
+  std::uint32_t rank;      // 1 = fastest; for query_top, how many entries
+  std::uint32_t total;     // results on the board
+  char name[16];
+};
+
+static_assert(sizeof(leaderboard_message) == 32, "leaderboard messages are fixed-size on the wire");
+
+/// Ranks are kept to a tenth of a word per minute, up to this speed;
+/// anything faster shares the top bucket
+constexpr std::size_t leaderboard_buckets = 4000;
+constexpr std::size_t leaderboard_top_max = 100;
+constexpr int leaderboard_snapshot_ms = 1000;
+
+inline std::string default_leaderboard_socket() {
+  const char* runtime = std::getenv("XDG_RUNTIME_DIR");
+  return std::string(runtime && *runtime ? runtime : "/tmp") + "/ttt-leaderboard-" + std::to_string(getuid()) + ".sock";
+}
+
+inline std::size_t leaderboard_bucket(std::uint32_t wpm_hundredths) {
+  return std::min<std::size_t>(wpm_hundredths / 10, leaderboard_buckets - 1);
+}
+
+/// Counts per bucket with O(log n) prefix sums
+class fenwick_tree {
+public:
+  explicit fenwick_tree(std::size_t size) : tree_(size + 1, 0) {}
+
+  void add(std::size_t index, std::uint32_t delta) {
+    for (auto k = index + 1; k < tree_.size(); k += k & (~k + 1)) {
+      tree_[k] += delta;
+    }
+  }
+
+  /// Sum of buckets [0, index]
+  std::uint64_t prefix(std::size_t index) const {
+    std::uint64_t sum = 0;
+    for (auto k = std::min(index + 1, tree_.size() - 1); k > 0; k -= k & (~k + 1)) {
+      sum += tree_[k];
+    }
+    return sum;
+  }
+
+  /// Rebuild from plain counts in O(n)
+  void assign(const std::vector<std::uint32_t>& counts) {
+    std::fill(tree_.begin(), tree_.end(), 0);
+    for (std::size_t k = 1; k < tree_.size(); ++k) {
+      tree_[k] += k - 1 < counts.size() ? counts[k - 1] : 0;
+      const auto parent = k + (k & (~k + 1));
+      if (parent < tree_.size()) {
+        tree_[parent] += tree_[k];
+      }
+    }
+  }
+
+private:
+  std::vector<std::uint64_t> tree_;
+};
+
+/// On-disk snapshot:
+///
+///   char     magic[4] = "TTTL"
+///   uint32_t version, num_buckets, num_top
+///   uint32_t counts[num_buckets]
+///   leaderboard_message top[num_top]
+struct leaderboard_snapshot {
+  std::vector<std::uint32_t> counts;
+  std::vector<leaderboard_message> top;
+};
+
+constexpr char leaderboard_magic[4] = {'T', 'T', 'T', 'L'};
+constexpr std::uint32_t leaderboard_version = 1;
+
+inline bool write_leaderboard_snapshot(const std::string& path, const leaderboard_snapshot& snapshot) {
+  const auto temporary = path + ".tmp";
+  {
+    std::ofstream file(temporary, std::ios::binary);
+    const std::uint32_t header[3] = {leaderboard_version, static_cast<std::uint32_t>(snapshot.counts.size()),
+                                     static_cast<std::uint32_t>(snapshot.top.size())};
+    file.write(leaderboard_magic, sizeof(leaderboard_magic));
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(snapshot.counts.data()), snapshot.counts.size() * sizeof(std::uint32_t));
+    file.write(reinterpret_cast<const char*>(snapshot.top.data()), snapshot.top.size() * sizeof(leaderboard_message));
+    if (!file) {
+      return false;
+    }
+  }
+  return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+inline bool read_leaderboard_snapshot(const std::string& path, leaderboard_snapshot& snapshot) {
+  std::ifstream file(path, std::ios::binary);
+  char magic[4];
+  std::uint32_t header[3];
+  if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, leaderboard_magic, sizeof(magic)) != 0
+      || !file.read(reinterpret_cast<char*>(header), sizeof(header))
+      || header[0] != leaderboard_version || header[1] != leaderboard_buckets || header[2] > leaderboard_top_max) {
+    return false;
+  }
+  snapshot.counts.resize(header[1]);
+  snapshot.top.resize(header[2]);
+  return static_cast<bool>(
+    file.read(reinterpret_cast<char*>(snapshot.counts.data()), snapshot.counts.size() * sizeof(std::uint32_t))
+    && file.read(reinterpret_cast<char*>(snapshot.top.data()), snapshot.top.size() * sizeof(leaderboard_message)));
+}
+
+/// Collects results from every ttt on a host and answers rank queries
+///
+/// Single-threaded epoll loop, like the race server. A submission adds
+/// one to its speed bucket in a Fenwick tree and, if fast enough, joins
+/// a short sorted list of the best results, so submitting and ranking
+/// are both O(log n) in the number of buckets. Once a second, if
+/// anything changed, the counts are copied to a writer thread that puts
+/// them on disk; the loop itself never waits for the disk.
+class leaderboard_server {
+public:
+  leaderboard_server(const std::string& path, const std::string& snapshot_path)
+    : path_(path), snapshot_path_(snapshot_path), counts_(leaderboard_buckets, 0), ranks_(leaderboard_buckets) {}
+
+  ~leaderboard_server() {
+    for (auto fd : clients_) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+    if (writer_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        writer_stopping_ = true;
+      }
+      changed_.notify_all();
+      writer_.join();
+    }
+    if (timer_ >= 0) ::close(timer_);
+    if (epoll_ >= 0) ::close(epoll_);
+    if (listener_ >= 0) {
+      ::close(listener_);
+      ::unlink(path_.c_str());
+    }
+  }
+
+  /// Load the last snapshot and bind the socket. Fails if another
+  /// server is already listening.
+  bool listen() {
+    listener_ = listen_unix(path_, SOCK_SEQPACKET | SOCK_NONBLOCK, 256);
+    if (listener_ < 0) {
+      return false;
+    }
+
+    leaderboard_snapshot snapshot;
+    if (!snapshot_path_.empty() && read_leaderboard_snapshot(snapshot_path_, snapshot)) {
+      counts_ = snapshot.counts;
+      top_ = snapshot.top;
+      ranks_.assign(counts_);
+      for (auto c : counts_) {
+        total_ += c;
+      }
+    }
+
+    epoll_ = epoll_create1(EPOLL_CLOEXEC);
+    timer_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    itimerspec tick{};
+    tick.it_interval.tv_sec = leaderboard_snapshot_ms / 1000;
+    tick.it_interval.tv_nsec = (leaderboard_snapshot_ms % 1000) * 1000 * 1000;
+    tick.it_value = tick.it_interval;
+    timerfd_settime(timer_, 0, &tick, nullptr);
+
+    add(listener_, listener_tag);
+    add(timer_, timer_tag);
+
+    if (!snapshot_path_.empty()) {
+      writer_ = std::thread([this]() { write_snapshots(); });
+    }
+    return true;
+  }
+
+  /// Serve until stop() is called from another thread, then save
+  void run() {
+    epoll_event events[64];
+    while (!stopping_) {
+      const int ready = epoll_wait(epoll_, events, 64, leaderboard_snapshot_ms);
+      for (int e = 0; e < ready; ++e) {
+        const auto tag = events[e].data.u64;
+        if (tag == listener_tag) {
+          accept_all();
+        }
+        else if (tag == timer_tag) {
+          std::uint64_t expirations;
+          if (read(timer_, &expirations, sizeof(expirations)) > 0) {
+            snapshot();
+          }
+        }
+        else {
+          receive(static_cast<std::size_t>(tag));
+        }
+      }
+    }
+    snapshot();
+  }
+
+  void stop() { stopping_ = true; }
+
+private:
+  static constexpr std::uint64_t listener_tag = 1ULL << 32;
+  static constexpr std::uint64_t timer_tag = (1ULL << 32) + 1;
+
+  void add(int fd, std::uint64_t tag) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = tag;
+    epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event);
+  }
+
+  void accept_all() {
+    while (true) {
+      const int fd = ::accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        return;
+      }
+      std::size_t slot = 0;
+      while (slot < clients_.size() && clients_[slot] >= 0) {
+        slot++;
+      }
+      if (slot == clients_.size()) {
+        clients_.push_back(-1);
+      }
+      clients_[slot] = fd;
+      add(fd, slot);
+    }
+  }
+
+  void drop(std::size_t slot) {
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, clients_[slot], nullptr);
+    ::close(clients_[slot]);
+    clients_[slot] = -1;
+  }
+
+  void receive(std::size_t slot) {
+    leaderboard_message batch[16];
+    while (true) {
+      const auto got = ::recv(clients_[slot], batch, sizeof(batch), 0);
+      if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        drop(slot);
+        return;
+      }
+      if (got < 0) {
+        return;
+      }
+      reply_.clear();
+      for (std::size_t k = 0; k < static_cast<std::size_t>(got) / sizeof(leaderboard_message); ++k) {
+        answer(batch[k]);
+      }
+      if (!reply_.empty()) {
+        /// Non-blocking: a client that stops reading loses its replies
+        ::send(clients_[slot], reply_.data(), reply_.size() * sizeof(leaderboard_message), MSG_NOSIGNAL | MSG_DONTWAIT);
+      }
+    }
+  }
+
+  void answer(const leaderboard_message& m) {
+    if (m.type == leaderboard_message::submit) {
+      const auto bucket = leaderboard_bucket(m.wpm);
+      counts_[bucket]++;
+      ranks_.add(bucket, 1);
+      total_++;
+      dirty_ = true;
+
+      if (top_.size() < leaderboard_top_max || m.wpm > top_.back().wpm) {
+        auto entry = m;
+        entry.type = leaderboard_message::entry;
+        entry.name[sizeof(entry.name) - 1] = '\0';
+        const auto at = std::upper_bound(top_.begin(), top_.end(), entry,
+                                         [](const leaderboard_message& a, const leaderboard_message& b) {
+                                           return a.wpm > b.wpm;
+                                         });
+        top_.insert(at, entry);
+        if (top_.size() > leaderboard_top_max) {
+          top_.pop_back();
+        }
+      }
+      reply_.push_back(standing(m.wpm));
+    }
+    else if (m.type == leaderboard_message::query_rank) {
+      reply_.push_back(standing(m.wpm));
+    }
+    else if (m.type == leaderboard_message::query_top) {
+      const auto n = std::min<std::size_t>(m.rank, top_.size());
+      auto header = standing(0);
+      header.rank = static_cast<std::uint32_t>(n);
+      reply_.push_back(header);
+      for (std::size_t k = 0; k < n; ++k) {
+        reply_.push_back(top_[k]);
+        reply_.back().rank = static_cast<std::uint32_t>(k + 1);
+        reply_.back().total = static_cast<std::uint32_t>(total_);
+      }
+    }
+  }
+
+  /// Where a speed would rank: one more than the results in faster
+  /// buckets
+  leaderboard_message standing(std::uint32_t wpm) const {
+    leaderboard_message reply{};
+    reply.type = leaderboard_message::standing;
+    reply.wpm = wpm;
+    reply.rank = static_cast<std::uint32_t>(total_ - ranks_.prefix(leaderboard_bucket(wpm)) + 1);
+    reply.total = static_cast<std::uint32_t>(total_);
+    return reply;
+  }
+
+  /// Hand the current board to the writer thread, replacing any
+  /// snapshot it has not got round to yet
+  void snapshot() {
+    if (!dirty_ || snapshot_path_.empty()) {
+      return;
+    }
+    dirty_ = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.counts = counts_;
+      pending_.top = top_;
+      has_pending_ = true;
+    }
+    changed_.notify_all();
+  }
+
+  void write_snapshots() {
+    leaderboard_snapshot writing;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this]() { return has_pending_ || writer_stopping_; });
+        if (!has_pending_) {
+          return;
+        }
+        std::swap(writing, pending_);
+        has_pending_ = false;
+      }
+      write_leaderboard_snapshot(snapshot_path_, writing);
+    }
+  }
+
+  std::string path_;
+  std::string snapshot_path_;
+  int listener_{-1};
+  int epoll_{-1};
+  int timer_{-1};
+  std::atomic<bool> stopping_{false};
+  std::vector<int> clients_;
+  std::vector<leaderboard_message> reply_;
+
+  std::vector<std::uint32_t> counts_;
+  fenwick_tree ranks_;
+  std::vector<leaderboard_message> top_;
+  std::uint64_t total_{0};
+  bool dirty_{false};
+
+  std::thread writer_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  leaderboard_snapshot pending_;
+  bool has_pending_{false};
+  bool writer_stopping_{false};
+};
+
+/// One connection to the leaderboard server. Every call is one round
+/// trip and fails, returning false, after `timeout_ms`.
+class leaderboard_client {
+public:
+  ~leaderboard_client() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  bool connect(const std::string& path) {
+    sockaddr_un address;
+    if (!make_unix_address(path, address)) {
+      return false;
+    }
+    fd_ = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd_ < 0 || ::connect(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+      if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+      }
+      return false;
+    }
+    return true;
+  }
+
+  /// Add a result; `standing` comes back with its rank among all
+  bool submit(double wpm, double accuracy, const std::string& name, leaderboard_message& standing) {
+    leaderboard_message m{};
+    m.type = leaderboard_message::submit;
+    m.wpm = static_cast<std::uint32_t>(std::max(0.0, wpm) * 100 + 0.5);
+    m.accuracy = static_cast<std::uint16_t>(std::min(std::max(accuracy, 0.0), 100.0) * 100 + 0.5);
+    std::strncpy(m.name, name.c_str(), sizeof(m.name) - 1);
+    std::vector<leaderboard_message> reply;
+    if (!exchange(m, reply, 1)) {
+      return false;
+    }
+    standing = reply[0];
+    return true;
+  }
+
+  /// Where `wpm` would rank, without adding it
+  bool rank(double wpm, leaderboard_message& standing) {
+    leaderboard_message m{};
+    m.type = leaderboard_message::query_rank;
+    m.wpm = static_cast<std::uint32_t>(std::max(0.0, wpm) * 100 + 0.5);
+    std::vector<leaderboard_message> reply;
+    if (!exchange(m, reply, 1)) {
+      return false;
+    }
+    standing = reply[0];
+    return true;
+  }
+
+  /// The best `n` results, fastest first
+  bool top(std::size_t n, std::vector<leaderboard_message>& entries, std::uint32_t& total) {
+    leaderboard_message m{};
+    m.type = leaderboard_message::query_top;
+    m.rank = static_cast<std::uint32_t>(std::min(n, leaderboard_top_max));
+    std::vector<leaderboard_message> reply;
+    if (!exchange(m, reply, 1 + leaderboard_top_max)) {
+      return false;
+    }
+    total = reply[0].total;
+    entries.assign(reply.begin() + 1, reply.end());
+    return true;
+  }
+
+private:
+  bool exchange(const leaderboard_message& m, std::vector<leaderboard_message>& reply, std::size_t most,
+                int timeout_ms = 1000) {
+    if (fd_ < 0 || ::send(fd_, &m, sizeof(m), MSG_NOSIGNAL) != sizeof(m)) {
+      return false;
+    }
+    pollfd pfd{fd_, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+      return false;
+    }
+    reply.resize(most);
+    const auto got = ::recv(fd_, reply.data(), most * sizeof(leaderboard_message), 0);
+    if (got < static_cast<ssize_t>(sizeof(leaderboard_message)) || reply[0].type != leaderboard_message::standing) {
+      return false;
+    }
+    reply.resize(static_cast<std::size_t>(got) / sizeof(leaderboard_message));
+    return true;
+  }
+
+  int fd_{-1};
+};
+
+#endif // TTT_LEADERBOARD_HPP_
@@ -1,176 +1,1054 @@
 #include <array>
 #include <atomic>
+#include <cctype>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <random>
-#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "termcolor.hpp"
+#include "alloc.hpp"
+#include "ghost.hpp"
+#include "layout.hpp"
+#include "leaderboard.hpp"
+#include "metrics.hpp"
+#include "output.hpp"
+#include "passage.hpp"
+#include "race.hpp"
+#include "rescore.hpp"
+#include "review.hpp"
+#include "sampling.hpp"
+#include "score.hpp"
+#include "screen.hpp"
+#include "session.hpp"
+#include "terminal.hpp"
+#include "text_source.hpp"
+#include "trace.hpp"
+#include "utf8.hpp"
+#include "vt.hpp"
+#include "words.hpp"
 
+#include <poll.h>
 #include <unistd.h>
 #include <termios.h>
 #include <sys/ioctl.h>
 
+/// Read one byte from the terminal
+/// The caller keeps the terminal in raw mode, see raw_terminal
 char getch() {
   char buf = 0;
-  struct termios old = {0};
-  if (tcgetattr(0, &old) < 0)
-    perror("tcsetattr()");
-  old.c_lflag &= ~ICANON;
-  old.c_lflag &= ~ECHO;
-  old.c_cc[VMIN] = 1;
-  old.c_cc[VTIME] = 0;
-  if (tcsetattr(0, TCSANOW, &old) < 0)
-    perror("tcsetattr ICANON");
   if (read(0, &buf, 1) < 0)
     perror ("read()");
-  old.c_lflag |= ICANON;
-  old.c_lflag |= ECHO;
-  if (tcsetattr(0, TCSADRAIN, &old) < 0)
-    perror ("tcsetattr ~ICANON");
+  TTT_TRACE_INSTANT("getch", static_cast<unsigned char>(buf));
   return (buf);
 }
 
+/// One keystroke, assembled from as many bytes as its UTF-8 sequence needs
+struct key {
+  char bytes[4];
+  std::size_t size;
+};
+
+/// The first byte goes through `remap`, which turns keys typed on one
+/// layout into the same keys on another; UTF-8 lead bytes map to
+/// themselves, so the rest of a sequence needs no lookup
+key read_key(const byte_table& remap) {
+  key result{};
+  result.bytes[0] = static_cast<char>(remap[static_cast<unsigned char>(getch())]);
+  result.size = 1;
+
+  const auto length = utf8::sequence_length(static_cast<unsigned char>(result.bytes[0]));
+  while (result.size < length) {
+    result.bytes[result.size] = getch();
+    if (!utf8::is_continuation(static_cast<unsigned char>(result.bytes[result.size]))) {
+      /// Malformed sequence, drop it
+      result.size = 0;
+      break;
+    }
+    result.size++;
+  }
+
+  return result;
+}
+
 void move_up(int N) {
-  printf("\033[%dA", N);
+  std::cout << "\033[" << N << "A";
 }
 
 void move_down(int N) {
-  printf("\033[%dB", N);
+  std::cout << "\033[" << N << "B";
 }
 
 void move_right(int N) {
-  printf("\033[%dC", N);
+  std::cout << "\033[" << N << "C";
 }
 
 void move_left(int N) {
-  printf("\033[%dD", N);
+  std::cout << "\033[" << N << "D";
 }
 
 void clear_line() {
-  printf("\33[2K\r");
+  std::cout << "\33[2K\r";
+}
+
+/// Write a whole frame to the terminal in one go
+void write_frame(const char* data, std::size_t size) {
+  if (size == 0) {
+    return;
+  }
+  TTT_TRACE_SCOPE("write");
+  TTT_TRACE_INSTANT("frame bytes", size);
+  write_terminal(data, size);
+}
+
+void write_frame(const std::string& frame) {
+  write_frame(frame.data(), frame.size());
+}
+
+/// Whether a key can be echoed before it is scored: a printable ASCII
+/// byte landing on a one-column glyph, so that the cursor ends up where
+/// the scored glyph would leave it whether the key is right or wrong
+bool echoable(const utf8::line& line, std::size_t i, const char* bytes, std::size_t size) {
+  if (size != 1 || bytes[0] < 0x20 || bytes[0] > 0x7e || i >= line.size()) {
+    return false;
+  }
+  const auto g = line.at(i);
+  return g.width == 1 && !(g.size == 1 && line.text()[g.offset] == '\n');
 }
 
-template <std::size_t NUM_LINES_IN_TEST, std::size_t NUM_WORDS_PER_LINE_IN_TEST>
-auto generate_lines(std::vector<std::string>& words, std::uniform_int_distribution<std::size_t>& distr, std::mt19937& gen,
-  unsigned short rows, unsigned short cols) {
-  std::array<std::string, NUM_LINES_IN_TEST> array_of_lines{};
+/// Fill `array_of_lines` with a new test, reusing its buffers
+template <std::size_t NUM_LINES_IN_TEST, std::size_t NUM_WORDS_PER_LINE_IN_TEST, typename Words>
+void generate_lines(Words& words, word_table& table, unsigned short cols, passage& array_of_lines) {
+  array_of_lines.clear();
+  array_of_lines.table = &table;
 
   for (std::size_t i = 0; i < NUM_LINES_IN_TEST; ++i) {
-    std::string line{""};
+    std::size_t line_width{0};
     for (std::size_t j = 0; j < NUM_WORDS_PER_LINE_IN_TEST; ++j) {
-      auto word = words[distr(gen)];
+      /// Skip what could never fit on a line, such as a URL in a
+      /// corpus, rather than leave the line empty
+      const auto word = words.next();
+      if (word.size == 0 || word.width + 1 >= cols) {
+        continue;
+      }
 
       /// Check terminal size (cols)
       /// and break early if overflowing
-      if (line.size() + word.size() >= cols) {
+      if (line_width + word.width >= cols) {
         break;
       }
 
-      line += word;
+      /// Only the word's id is kept; the text is spelled out from the
+      /// table when it is shown. Each word but the last of the test is
+      /// followed by a space.
+      array_of_lines.word_ids.push_back(table.intern(word.data, word.size, word.width));
+      array_of_lines.ascii = array_of_lines.ascii && utf8::is_ascii(word.data, word.size);
+      line_width += word.width + 1;
+    }
+
+    /// Leave out a line when every word drawn for it was skipped
+    if (array_of_lines.word_ids.size() > array_of_lines.line_words.back()) {
+      array_of_lines.line_words.push_back(static_cast<std::uint32_t>(array_of_lines.word_ids.size()));
+    }
+  }
+}
+
+/// Print glyph i of a line, showing newlines as a visible marker
+bool is_newline(const utf8::line& line, std::size_t i) {
+  const auto g = line.at(i);
+  return g.size == 1 && line.text()[g.offset] == '\n';
+}
+
+void print_glyph(const utf8::line& line, std::size_t i) {
+  if (is_newline(line, i)) {
+    std::cout << "\u21b5";
+  }
+  else {
+    line.print(std::cout, i);
+  }
+}
+
+/// Cut a line into runs of glyphs sharing a style, drawing a typed
+/// newline as the return symbol
+void line_spans(const utf8::line& line, const std::vector<std::uint8_t>& styles, std::vector<styled_span>& spans) {
+  static const char newline_symbol[] = "\u21b5";
+  spans.clear();
+  std::size_t x = 0;
+  while (x < line.size()) {
+    if (is_newline(line, x)) {
+      spans.push_back(styled_span{styles[x], newline_symbol, sizeof(newline_symbol) - 1});
+      x++;
+      continue;
+    }
+    auto end = x + 1;
+    while (end < line.size() && styles[end] == styles[x] && !is_newline(line, end)) {
+      end++;
+    }
+    const auto first = line.at(x);
+    const auto last = line.at(end - 1);
+    spans.push_back(styled_span{styles[x], line.text().data() + first.offset, last.offset + last.size - first.offset});
+    x = end;
+  }
+}
+
+/// Lay per-glyph styles out again over new lines of the same text
+void resplit_styles(std::vector<std::vector<std::uint8_t>>& styles, const std::vector<utf8::line>& lines) {
+  std::vector<std::uint8_t> all;
+  for (const auto& line : styles) {
+    all.insert(all.end(), line.begin(), line.end());
+  }
+  styles.resize(lines.size());
+  std::size_t k = 0;
+  for (std::size_t n = 0; n < lines.size(); ++n) {
+    styles[n].assign(lines[n].size(), style_pending);
+    for (std::size_t x = 0; x < lines[n].size() && k < all.size(); ++x, ++k) {
+      styles[n][x] = all[k];
+    }
+  }
+}
+
+/// Draws the test in place below the prompt with relative cursor motion
+///
+/// While the test runs std::cout fills a frame_buffer, which present()
+/// writes out. The ghost and the panel are drawn only then too, so
+/// several moves between two frames cost one redraw.
+class inline_view {
+public:
+  inline_view(const render_backend& theme, unsigned fps) : theme_(theme), frames_(fps) {}
+
+  /// Keep `rows` free below the passage for panel()
+  void reserve_panel(std::size_t rows) {
+    panel_rows_ = rows;
+  }
+
+  /// Echo keys the moment they arrive, see speculate()
+  void speculative_echo(bool enabled) {
+    speculative_ = enabled;
+  }
+
+  /// Write key i of the line as typed, unstyled, ahead of its frame.
+  /// typed() then draws it scored as usual, and the frame steps back
+  /// over the echoed keys first so it lands on the same cells.
+  void speculate(const utf8::line& line, std::size_t i, const char* bytes, std::size_t size) {
+    if (!speculative_ || !in_sync_ || !echoable(line, i, bytes, size)) {
+      return;
+    }
+    frames_.keyed();
+    write_frame(bytes, size);
+    frames_.echoed(size);
+    ahead_++;
+    speculated_ = true;
+  }
+
+  /// Begin a test. A view can run one test after another, and keeps
+  /// its buffers from the last.
+  void start(const passage& array_of_lines) {
+    buffer_.clear();
+    saved_ = std::cout.rdbuf(&buffer_);
+    in_sync_ = false;
+    speculated_ = false;
+    ahead_ = 0;
+    panel_.clear();
+    panel_dirty_ = false;
+    ghost_n_ = ghost_shown_n_ = hidden;
+    frames_.reset();
+    assign_lines(array_of_lines);
+    std::size_t bytes = 0;
+    std::size_t glyphs = 0;
+    std::size_t longest = 0;
+    for (std::size_t n = 0; n < N_; ++n) {
+      styles_[n].assign(lines_[n].size(), style_pending);
+      bytes += lines_[n].text().size();
+      glyphs += lines_[n].size();
+      longest = std::max(longest, lines_[n].size());
+    }
+    n_ = 0;
+
+    /// A line with every glyph in its own style, and a keystroke log
+    /// as long as the loop's, so typing does not grow either; nor does
+    /// a frame that restyles every glyph of the passage
+    spans_.reserve(longest);
+    frames_.reserve(3 * glyphs);
+    std::size_t longest_sgr = 0;
+    for (const auto& sgr : theme_.sgr) {
+      longest_sgr = std::max(longest_sgr, sgr.size());
+    }
+    buffer_.reserve(bytes + glyphs * (longest_sgr + theme_.reset.size()) + 256);
+
+    /// Assume cursor is already in the right place
+    draw_passage(array_of_lines.indent(0));
+    frames_.mark(urgency::feedback);
+  }
+
+  /// The passage has been laid out again for a new terminal size;
+  /// the cursor is now on glyph i of line n
+  void reflow(const passage& array_of_lines, std::size_t n, std::size_t i, unsigned short, unsigned short) {
+    /// Clear from the first line down. A terminal that rewraps old
+    /// output on resize may leave some of it above.
+    if (n_ > 0) {
+      move_up(n_);
+    }
+    std::cout << "\r\033[J";
+
+    assign_lines(array_of_lines);
+    resplit_styles(styles_, lines_);
+    n_ = n;
+    ghost_shown_n_ = hidden;
+    panel_dirty_ = true;
+    in_sync_ = false;
+
+    draw_passage(i);
+    frames_.mark(urgency::feedback);
+  }
+
+  void typed(const utf8::line& line, std::size_t i, bool correct) {
+    TTT_TRACE_SCOPE("render");
+    styles_[n_][i] = correct ? style_correct : style_error;
+    std::cout << theme_.sgr[styles_[n_][i]];
+    print_glyph(line, i);
+    std::cout << theme_.reset;
+    if (ghost_shown_n_ == n_ && ghost_shown_x_ == i) {
+      /// Typed over the ghost; present() puts it back
+      ghost_shown_n_ = hidden;
+    }
+    if (speculated_) {
+      speculated_ = false;
+    }
+    else {
+      frames_.keyed();
+      in_sync_ = false;
+    }
+    frames_.mark(urgency::feedback);
+  }
+
+  void erased(const utf8::line& line, std::size_t i) {
+    TTT_TRACE_SCOPE("render");
+    styles_[n_][i] = style_pending;
+
+    /// Redraw the whole line, then step back to the cursor
+    std::cout << "\r";
+    draw_line(n_);
+
+    const auto distance = line.width(i, line.size());
+    if (distance > 0) {
+      move_left(distance);
+    }
+    if (ghost_shown_n_ == n_) {
+      ghost_shown_n_ = hidden;
+    }
+    frames_.keyed();
+    in_sync_ = false;
+    frames_.mark(urgency::feedback);
+  }
+
+  /// Move the ghost's cursor to glyph x of line n; n past the last
+  /// line hides it
+  void ghost(std::size_t n, std::size_t x) {
+    ghost_n_ = n;
+    ghost_x_ = x;
+    frames_.mark(urgency::status);
+  }
+
+  /// `line` is null once the last line has been typed
+  void next_line(const utf8::line* line, std::size_t indent) {
+    n_ += 1;
+
+    /// Go to start of next line
+    std::cout << "\n\r";
+    if (line && indent > 0) {
+      move_right(line->width(0, indent));
+    }
+    in_sync_ = false;
+    frames_.mark(urgency::feedback);
+  }
+
+  /// Draw `rows` in the space reserved below the passage at the next
+  /// frame, leaving the cursor where it is
+  void panel(const std::vector<std::string>& rows) {
+    if (panel_rows_ == 0) {
+      return;
+    }
+    panel_ = rows;
+    panel_dirty_ = true;
+    frames_.mark(urgency::status);
+  }
+
+  int frame_due_ms() const {
+    return frames_.due_in_ms();
+  }
+
+  /// Send everything drawn since the last frame
+  void present() {
+    draw_overlays();
+    if (ahead_ > 0) {
+      /// Back to where the frame starts, before the echoed keys
+      char back[frame_buffer::headroom];
+      const auto length = std::snprintf(back, sizeof(back), "\033[%zuD", ahead_);
+      buffer_.prepend(back, static_cast<std::size_t>(length));
+      ahead_ = 0;
+    }
+    write_frame(buffer_.data(), buffer_.size());
+    frames_.presented(buffer_.size());
+    buffer_.clear();
+    in_sync_ = true;
+  }
+
+  void finish() {
+    draw_overlays();
+
+    /// Step over the panel so it stays on screen
+    for (std::size_t r = 0; r < panel_rows_; ++r) {
+      std::cout << "\n";
+    }
+    std::cout << "\r\n";
+    present();
+    std::cout.rdbuf(saved_);
+  }
+
+  const frame_stats& frames() const {
+    return frames_.stats();
+  }
+
+private:
+  static constexpr std::size_t hidden = static_cast<std::size_t>(-1);
+
+  void assign_lines(const passage& array_of_lines) {
+    N_ = array_of_lines.num_lines();
+    lines_.resize(N_);
+    styles_.resize(N_);
+    for (std::size_t n = 0; n < N_; ++n) {
+      array_of_lines.line_text(n, line_text_);
+      lines_[n].assign(line_text_, array_of_lines.ascii);
+    }
+  }
+
+  /// Print every line and the panel's blank rows from the cursor down,
+  /// then put the cursor on glyph i of line n_
+  void draw_passage(std::size_t i) {
+    for (std::size_t n = 0; n < N_; ++n) {
+      draw_line(n);
+      std::cout << "\n";
+    }
+    for (std::size_t r = 0; r < panel_rows_; ++r) {
+      std::cout << "\n";
+    }
+
+    move_up(N_ + panel_rows_ - n_);
+    std::cout << "\r";
+    if (n_ < N_ && i > 0) {
+      move_right(lines_[n_].width(0, i));
+    }
+  }
 
-      if (j + 1 < NUM_WORDS_PER_LINE_IN_TEST) {
-        /// Not the last line
-        line += " ";
+  /// Bring the ghost and the panel up to date
+  void draw_overlays() {
+    TTT_TRACE_SCOPE("render");
+    if (ghost_shown_n_ != ghost_n_ || ghost_shown_x_ != ghost_x_) {
+      if (ghost_shown_n_ < N_) {
+        draw_at(ghost_shown_n_, ghost_shown_x_, styles_[ghost_shown_n_][ghost_shown_x_]);
       }
-      else if (j + 1 == NUM_WORDS_PER_LINE_IN_TEST) {
-        /// Last word in line
-        if (i + 1 < NUM_LINES_IN_TEST) {
-          line += " ";
-        }
+      if (ghost_n_ < N_) {
+        draw_at(ghost_n_, ghost_x_, style_ghost);
       }
+      ghost_shown_n_ = ghost_n_;
+      ghost_shown_x_ = ghost_x_;
+    }
+    if (panel_dirty_) {
+      draw_panel();
+      panel_dirty_ = false;
     }
+  }
+
+  /// Redraw one glyph anywhere in the passage, leaving the cursor put
+  void draw_at(std::size_t n, std::size_t x, std::size_t style) {
+    std::cout << "\0337";
+    if (n < n_) {
+      move_up(n_ - n);
+    }
+    else if (n > n_) {
+      move_down(n - n_);
+    }
+    std::cout << "\r";
+    const auto column = lines_[n].width(0, x);
+    if (column > 0) {
+      move_right(column);
+    }
+    std::cout << theme_.sgr[style];
+    print_glyph(lines_[n], x);
+    std::cout << theme_.reset << "\0338";
+  }
 
-    array_of_lines[i] = line;
+  /// Line n in its current styles, from the cursor on
+  void draw_line(std::size_t n) {
+    line_spans(lines_[n], styles_[n], spans_);
+    scratch_.clear();
+    append_spans(scratch_, theme_, spans_.data(), spans_.size());
+    std::cout << scratch_;
   }
 
-  return array_of_lines;
-}
+  void draw_panel() {
+    std::cout << "\0337";
+    if (n_ < N_) {
+      move_down(N_ - n_);
+    }
+    for (std::size_t r = 0; r < panel_rows_; ++r) {
+      if (r > 0) {
+        move_down(1);
+      }
+      clear_line();
+      if (r < panel_.size()) {
+        scratch_.clear();
+        append_styled(scratch_, theme_, style_pending, panel_[r].data(), panel_[r].size());
+        std::cout << scratch_;
+      }
+    }
+    std::cout << "\0338";
+  }
+
+  const render_backend& theme_;
+  frame_scheduler frames_;
+  frame_buffer buffer_;
+  std::streambuf* saved_{nullptr};
+
+  /// The terminal's cursor is where the next key goes as long as every
+  /// key since the last frame was echoed; `ahead_` of them were
+  bool speculative_{false};
+  bool in_sync_{true};
+  bool speculated_{false};
+  std::size_t ahead_{0};
+
+  std::size_t panel_rows_{0};
+  std::vector<std::string> panel_;
+  bool panel_dirty_{false};
+  std::size_t N_{0};
+  std::size_t n_{0};
+
+  std::string line_text_;
+  std::vector<utf8::line> lines_;
+  std::vector<std::vector<std::uint8_t>> styles_;
+  std::vector<styled_span> spans_;
+  std::string scratch_;
+  std::size_t ghost_n_{hidden};
+  std::size_t ghost_x_{0};
+  std::size_t ghost_shown_n_{hidden};
+  std::size_t ghost_shown_x_{0};
+};
 
-template <std::size_t NUM_LINES_IN_TEST, std::size_t NUM_WORDS_PER_LINE_IN_TEST, std::size_t N>
-auto update_lines(std::array<std::string, N>& array_of_lines, std::vector<std::string>& words, std::uniform_int_distribution<std::size_t>& distr, std::mt19937& gen) {
-  std::array<std::string, N> result{};
+/// Draws the test on the alternate screen from a cell grid, emitting
+/// only what changed since the previous frame
+///
+/// Changes only update the model; the grid is composed and diffed once
+/// per frame, when present() is called.
+class fullscreen_view {
+public:
+  fullscreen_view(const render_backend& theme, unsigned short rows, unsigned short cols, unsigned fps)
+    : theme_(theme), rows_(rows), cols_(cols), frames_(fps) {}
 
-  for (std::size_t i = 0; i < NUM_LINES_IN_TEST - 1; ++i) {
-    result[i] = array_of_lines[i + 1];
+  /// Keep `rows` free above the status line for panel()
+  void reserve_panel(std::size_t rows) {
+    panel_rows_ = rows;
   }
 
-  /// Generate one new line
-  auto new_line = generate_lines<1, NUM_WORDS_PER_LINE_IN_TEST>(words, distr, gen);
+  /// Echo keys the moment they arrive, see speculate()
+  void speculative_echo(bool enabled) {
+    speculative_ = enabled;
+  }
+
+  /// Write key i of the line as typed, unstyled, ahead of its frame.
+  /// The screen records it as shown, so the frame's diff corrects just
+  /// that cell.
+  void speculate(const utf8::line& line, std::size_t i, const char* bytes, std::size_t size) {
+    if (!speculative_ || !in_sync_ || !echoable(line, i, bytes, size)) {
+      return;
+    }
+    echo_.clear();
+    if (!screen_.echo(echo_, bytes, size, style_plain, theme_)) {
+      return;
+    }
+    frames_.keyed();
+    write_frame(echo_);
+    frames_.echoed(echo_.size());
+    speculated_ = true;
+  }
 
-  result[N - 1] = new_line[0];
+  /// The terminal's size for the next start()
+  void resize(unsigned short rows, unsigned short cols) {
+    rows_ = rows;
+    cols_ = cols;
+  }
 
-  return result;
-}
+  /// Begin a test. A view can run one test after another, and keeps
+  /// its buffers from the last.
+  void start(const passage& array_of_lines) {
+    speculated_ = false;
+    first_visible_ = 0;
+    panel_.clear();
+    ghost_n_ = static_cast<std::size_t>(-1);
+    frames_.reset();
+    const auto N = array_of_lines.num_lines();
+    lines_.resize(N);
+    styles_.resize(N);
+    std::size_t glyphs = 0;
+    for (std::size_t n = 0; n < N; ++n) {
+      array_of_lines.line_text(n, line_text_);
+      lines_[n].assign(line_text_, array_of_lines.ascii);
+      styles_[n].assign(lines_[n].size(), style_pending);
+      glyphs += lines_[n].size();
+    }
+    frames_.reserve(3 * glyphs);
+    n_ = 0;
+    i_ = array_of_lines.indent(0);
+    in_sync_ = false;
 
-std::size_t count_words(const std::string& str) {
-  std::size_t result{0};
+    enter_alternate_screen();
+    screen_.resize(rows_, cols_);
+    frames_.mark(urgency::feedback);
+  }
 
-  char prev = ' ';
+  /// The passage has been laid out again for a new terminal size;
+  /// the cursor is now on glyph i of line n
+  void reflow(const passage& array_of_lines, std::size_t n, std::size_t i, unsigned short rows, unsigned short cols) {
+    const auto N = array_of_lines.num_lines();
+    lines_.resize(N);
+    for (std::size_t k = 0; k < N; ++k) {
+      array_of_lines.line_text(k, line_text_);
+      lines_[k].assign(line_text_, array_of_lines.ascii);
+    }
+    resplit_styles(styles_, lines_);
+    n_ = n;
+    i_ = i;
+    first_visible_ = 0;
+    in_sync_ = false;
 
-  auto size = str.size();
+    /// Whatever the terminal made of the old frame, draw every cell
+    rows_ = rows;
+    cols_ = cols;
+    screen_.resize(rows_, cols_);
+    screen_.invalidate();
+    frames_.mark(urgency::feedback);
+  }
 
-  for(std::size_t i = 0; i < size; ++i) {
-    if(i + 1 < size && str[i] != ' ' && prev == ' ') {
-      result++;
+  void typed(const utf8::line&, std::size_t i, bool correct) {
+    styles_[n_][i] = correct ? style_correct : style_error;
+    i_ = i + 1;
+    if (speculated_) {
+      speculated_ = false;
     }
-    prev = str[i];
+    else {
+      frames_.keyed();
+      in_sync_ = false;
+    }
+    frames_.mark(urgency::feedback);
   }
 
-  return result;
+  void erased(const utf8::line&, std::size_t i) {
+    styles_[n_][i] = style_pending;
+    i_ = i;
+    frames_.keyed();
+    in_sync_ = false;
+    frames_.mark(urgency::feedback);
+  }
+
+  void next_line(const utf8::line* line, std::size_t indent) {
+    n_ += 1;
+    i_ = indent;
+    in_sync_ = false;
+    if (line) {
+      frames_.mark(urgency::feedback);
+    }
+  }
+
+  void panel(const std::vector<std::string>& rows) {
+    panel_ = rows;
+    frames_.mark(urgency::status);
+  }
+
+  void ghost(std::size_t n, std::size_t x) {
+    ghost_n_ = n;
+    ghost_x_ = x;
+    frames_.mark(urgency::status);
+  }
+
+  int frame_due_ms() const {
+    return frames_.due_in_ms();
+  }
+
+  /// Send everything that changed since the last frame
+  void present() {
+    render();
+    write_frame(frame_);
+    frames_.presented(frame_.size());
+    in_sync_ = true;
+  }
+
+  void finish() {
+    /// The alternate screen is about to go, so a frame still pending
+    /// is dropped
+    leave_alternate_screen();
+  }
+
+  const frame_stats& frames() const {
+    return frames_.stats();
+  }
+
+private:
+  /// First row of the passage; row 0 is left as a margin and the
+  /// last row holds the status line
+  static constexpr std::size_t top_margin = 1;
+
+  void render() {
+    TTT_TRACE_SCOPE("render");
+    screen_.clear();
+
+    /// Passage rows, below the margin and above the panel and status line
+    const std::size_t reserved = top_margin + panel_rows_ + 1;
+    const std::size_t visible = rows_ > reserved ? rows_ - reserved : 1;
+
+    /// Scroll so the current line is always on screen
+    if (n_ < first_visible_) {
+      first_visible_ = n_;
+    }
+    else if (n_ >= first_visible_ + visible) {
+      first_visible_ = n_ - visible + 1;
+    }
+
+    std::size_t cursor_row = top_margin;
+    std::size_t cursor_col = 0;
+
+    for (std::size_t v = 0; v < visible && first_visible_ + v < lines_.size(); ++v) {
+      const auto n = first_visible_ + v;
+      const auto& line = lines_[n];
+      const auto row = top_margin + v;
+      std::size_t col = 0;
+
+      for (std::size_t x = 0; x < line.size(); ++x) {
+        if (n == n_ && x == i_) {
+          cursor_row = row;
+          cursor_col = col;
+        }
+        const auto g = line.at(x);
+        const auto style = (n == ghost_n_ && x == ghost_x_) ? static_cast<std::uint8_t>(style_ghost) : styles_[n][x];
+        if (is_newline(line, x)) {
+          screen_.put(row, col, "\u21b5", 3, 1, style);
+        }
+        else {
+          screen_.put(row, col, line.text().data() + g.offset, g.size, g.width, style);
+        }
+        col += g.width;
+      }
+    }
+
+    /// The panel goes if the terminal has shrunk too far for it
+    for (std::size_t r = 0; r < panel_rows_ && r < panel_.size() && reserved < rows_; ++r) {
+      screen_.put_text(rows_ - 1 - panel_rows_ + r, 1, panel_[r], style_pending);
+    }
+
+    const auto status = " line " + std::to_string(std::min(n_ + 1, lines_.size())) + "/" + std::to_string(lines_.size());
+    screen_.put_text(rows_ - 1, 0, status, style_pending);
+
+    screen_.set_cursor(cursor_row, cursor_col);
+
+    frame_.clear();
+    screen_.flush(frame_, theme_);
+  }
+
+  const render_backend& theme_;
+  std::size_t rows_;
+  std::size_t cols_;
+  frame_scheduler frames_;
+  screen screen_;
+  std::string frame_;
+  std::string echo_;
+
+  /// The terminal's cursor is where the next key goes as long as every
+  /// key since the last frame was echoed
+  bool speculative_{false};
+  bool in_sync_{true};
+  bool speculated_{false};
+
+  std::string line_text_;
+  std::vector<utf8::line> lines_;
+  std::vector<std::vector<std::uint8_t>> styles_;
+  std::size_t n_{0};
+  std::size_t i_{0};
+  std::size_t first_visible_{0};
+
+  std::size_t panel_rows_{0};
+  std::vector<std::string> panel_;
+
+  std::size_t ghost_n_{static_cast<std::size_t>(-1)};
+  std::size_t ghost_x_{0};
+};
+
+/// Things that run alongside the typing loop. They are serviced only
+/// while the loop waits for a key, so none of them can delay one.
+struct loop_extras {
+  const byte_table* remap{&layouts.remap[qwerty][qwerty]};
+  alloc_tally* allocations{nullptr};
+  race_client* race{nullptr};
+  const ghost_replay* ghost{nullptr};
+  std::size_t panel_width{0};
+  std::size_t panel_rows{0};
+};
+
+/// The sooner of two poll timeouts, where -1 means never
+inline int sooner(int a, int b) {
+  if (a < 0) {
+    return b;
+  }
+  return b < 0 ? a : std::min(a, b);
 }
 
-template <std::size_t NUM_LINES_IN_TEST, std::size_t NUM_WORDS_PER_LINE_IN_TEST, std::size_t N>
-void loop_array_of_lines(std::array<std::string, N>& array_of_lines, 
-                         std::vector<std::string>& words, 
-                         std::uniform_int_distribution<std::size_t>& distr, 
-                         std::mt19937& gen) {
-  std::chrono::high_resolution_clock::time_point start;
+/// Block until a key is ready to read, servicing the extras and
+/// presenting frames meanwhile. Returns false instead if the terminal
+/// was resized.
+///
+/// `tick` redraws whatever moves on its own and returns how many
+/// milliseconds until it wants to run again, or -1 for never. A frame
+/// that is not due yet waits for a key too: if one arrives first, its
+/// echo joins the same frame.
+template <typename View, typename Tick>
+bool wait_for_key(loop_extras& extras, View& view, Tick tick) {
+  while (true) {
+    auto timeout = tick();
+    if (view.frame_due_ms() == 0) {
+      view.present();
+    }
+    timeout = sooner(timeout, view.frame_due_ms());
+
+    struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0}, {resize_fd(), POLLIN, 0},
+                            {extras.race ? extras.race->fd() : -1, POLLIN, 0}};
+    if (extras.race) {
+      timeout = sooner(timeout, extras.race->timeout_ms());
+    }
+    int ready;
+    {
+      TTT_TRACE_SCOPE("wait");
+      ready = poll(fds, 3, timeout);
+    }
+    if (ready < 0 && errno != EINTR) {
+      return true;
+    }
+
+    if (fds[1].revents && take_resize()) {
+      return false;
+    }
+
+    if (extras.race) {
+      if (fds[2].revents & (POLLHUP | POLLERR)) {
+        /// The server went away; carry on alone
+        extras.race = nullptr;
+      }
+      else {
+        if ((fds[2].revents & POLLIN) && extras.race->receive()) {
+          view.panel(extras.race->bars(extras.panel_width, extras.panel_rows));
+        }
+        extras.race->flush();
+      }
+    }
 
-  /// Print lines first
-  /// Assume cursor is already in the right place
-  for (std::size_t i = 0; i < N; ++i) {
-    std::cout << termcolor::grey << termcolor::bold << array_of_lines[i] << termcolor::reset << std::endl;
+    if (fds[0].revents) {
+      return true;
+    }
   }
+}
+
+template <typename View>
+score_result loop_array_of_lines(passage& array_of_lines, std::vector<keystroke>& keystrokes, View& view,
+                         loop_extras& extras, scoring method) {
+  std::chrono::high_resolution_clock::time_point start;
+
+  auto N = array_of_lines.num_lines();
+  const auto ascii = array_of_lines.ascii;
 
-  /// Move up N lines to reset cursor
-  move_up(N);
+  /// Prose is laid out again whenever the terminal is resized
+  const bool reflowable = array_of_lines.reflowable();
 
-  /// Go to start of first line
-  std::cout << "\r" << std::flush;
+  view.start(array_of_lines);
+  local_metrics().started();
 
   /// Run test loop
-  std::size_t i = 0;
   std::size_t n = 0; // current line
-  auto line = array_of_lines[n];
+  std::string line_text;
+  utf8::line line;
+  array_of_lines.line_text(n, line_text);
+  line.assign(line_text, ascii);
+  std::size_t i = array_of_lines.indent(n); // current glyph in line
+  std::size_t line_base = 0; // glyphs in all lines before the current one
+
+  keystrokes.clear();
+  auto record = [&](std::uint8_t kind) {
+    TTT_TRACE_INSTANT("classify", kind);
+    const auto now = std::chrono::high_resolution_clock::now();
+    keystroke k{};
+    k.time_us = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now - start).count());
+    k.position = static_cast<std::uint32_t>(line_base + i);
+    k.kind = kind;
+    keystrokes.push_back(k);
+    local_metrics().keyed(kind == keystroke::mistake, k.position, k.time_us);
+  };
+
+  /// Tell the other racers how far we are, in glyphs and the usual
+  /// five-glyphs-per-word speed
+  const auto total_glyphs = static_cast<std::uint32_t>(array_of_lines.glyphs());
+
+  /// Room for every glyph typed, fixed and typed again, so that typing
+  /// does not grow the log
+  keystrokes.reserve(3 * std::size_t(total_glyphs));
+
+  auto report = [&]() {
+    if (!extras.race) {
+      return;
+    }
+    const auto position = static_cast<std::uint32_t>(line_base + i);
+    const auto minutes = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count() / 60;
+    const auto wpm = minutes > 0 ? std::min(position / 5.0 / minutes, 65535.0) : 0.0;
+    extras.race->update(position, total_glyphs, static_cast<std::uint16_t>(wpm));
+  };
+  if (extras.race) {
+    extras.race->update(0, total_glyphs, 0);
+    extras.race->flush();
+  }
+
+  /// First global glyph of every line, to place the ghost's cursor and
+  /// to carry positions across a reflow
+  std::vector<std::uint32_t> line_starts;
+  auto index_lines = [&]() {
+    line_starts.assign(N + 1, 0);
+    for (std::size_t k = 0; k < N; ++k) {
+      line_starts[k + 1] = line_starts[k] + static_cast<std::uint32_t>(array_of_lines.line_glyphs(k));
+    }
+  };
+  index_lines();
+  auto line_of = [&](std::size_t position) {
+    return static_cast<std::size_t>(std::upper_bound(line_starts.begin(), line_starts.end() - 1, position)
+                                    - line_starts.begin()) - 1;
+  };
 
-  std::size_t total_num_mistakes{0};
+  /// Once the test starts the ghost moves on its own, so it is drawn
+  /// from a timer while we wait for keys rather than on keystrokes
+  std::uint32_t ghost_shown = 0;
+  auto move_ghost = [&](std::uint32_t position) {
+    ghost_shown = position;
+    const auto next = std::upper_bound(line_starts.begin(), line_starts.end(), position);
+    const auto ghost_line = static_cast<std::size_t>(next - line_starts.begin()) - 1;
+    if (ghost_line >= N) {
+      view.ghost(N, 0);
+    }
+    else {
+      view.ghost(ghost_line, std::max<std::size_t>(position - line_starts[ghost_line], array_of_lines.indent(ghost_line)));
+    }
+  };
+  auto tick = [&]() {
+    if (!extras.ghost || keystrokes.empty()) {
+      return -1;
+    }
+    const auto elapsed = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::high_resolution_clock::now() - start).count());
+    const auto position = extras.ghost->position(elapsed);
+    if (position != ghost_shown) {
+      move_ghost(position);
+    }
+    return extras.ghost->finished(elapsed) ? -1 : ghost_tick_ms;
+  };
+  if (extras.ghost) {
+    move_ghost(extras.ghost->position(0));
+  }
+
+  /// The terminal was resized: lay prose out for the new width, and
+  /// carry the cursor over by its place in the text
+  auto resize = [&]() {
+    TTT_TRACE_SCOPE("reflow");
+    unsigned short rows, cols;
+    window_size(rows, cols);
+    if (rows == 0 || cols == 0) {
+      return;
+    }
 
-  /// each index in the set in each line has a mistake
-  std::array<std::set<std::size_t>, N> error_indices{}; 
+    const auto position = line_base + i;
+    if (reflowable) {
+      array_of_lines.reflow(cols);
+      N = array_of_lines.num_lines();
+      index_lines();
+    }
+
+    n = line_of(position);
+    line_base = line_starts[n];
+    i = position - line_base;
+    array_of_lines.line_text(n, line_text);
+    line.assign(line_text, ascii);
+
+    extras.panel_width = cols > 2 ? cols - 2 : 1;
+    view.reflow(array_of_lines, n, i, rows, cols);
+    if (extras.ghost) {
+      move_ghost(ghost_shown);
+    }
+    if (extras.race) {
+      view.panel(extras.race->bars(extras.panel_width, extras.panel_rows));
+    }
+  };
+
+  /// Allocations are charged to the keystroke that came before them,
+  /// which covers presenting its frame while waiting for the next one.
+  /// A keystroke is steady state unless it was the first, ended a line
+  /// or came with a resize.
+  auto allocations = allocations_so_far();
+  bool steady_key = false;
+  bool keyed = false;
+  auto account = [&]() {
+    const auto now = allocations_so_far();
+    const auto spent = now - allocations;
+    allocations = now;
+    if (extras.allocations && keyed) {
+      auto& tally = *extras.allocations;
+      tally.keys += spent;
+      tally.keystrokes++;
+      if (steady_key) {
+        tally.steady += spent;
+        tally.steady_keystrokes++;
+        tally.steady_allocating += spent.allocations > 0;
+      }
+    }
+    keyed = false;
+    steady_key = false;
+  };
 
   while(true) {
+    account();
+
     if (n >= N) {
-      std::cout << "\r\n";
+      if (extras.race) {
+        extras.race->flush();
+        view.panel(extras.race->bars(extras.panel_width, extras.panel_rows));
+      }
+      view.finish();
       // Report stats here
-      auto end = std::chrono::high_resolution_clock::now();
-      auto seconds = std::chrono::duration_cast<std::chrono::seconds>(end - start).count();
-      auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+      array_of_lines.materialize();
+      session_view session{array_of_lines.text.data(), array_of_lines.line_offsets.data(),
+                           array_of_lines.indents.data(), N, ascii,
+                           keystrokes.data(), keystrokes.size()};
+      const auto result = score(session, method);
+      const auto accuracy = result.accuracy;
+      const auto wpm = result.wpm;
+      local_metrics().finished(wpm, accuracy);
 
-      std::size_t num_chars{0};
-      std::size_t num_words{0};
-      for (std::size_t i = 0; i < N; ++i) {
-        num_words += count_words(array_of_lines[i]);
-        num_chars += array_of_lines[i].size();
+      if (method == scoring::standard) {
+        std::cout << int(wpm) << " wpm (" << int(result.gross_wpm) << " gross) with "
+                  << std::setprecision(2) << std::fixed
+                  << accuracy << "% accuracy (" << result.raw_accuracy << "% raw), "
+                  << int(result.speed_variation * 100 + 0.5) << "% speed variation"
+                  << std::endl;
+        return result;
       }
 
-      auto accuracy = 100.0 - (float(total_num_mistakes) / num_chars * 100.0);
-      auto wpm = (float(num_words) / milliseconds) * 60 * 1000.0;
-
       std::cout << int(wpm) 
                 << " wpm with "
                 << std::setprecision(2) 
@@ -178,67 +1056,45 @@ void loop_array_of_lines(std::array<std::string, N>& array_of_lines,
                 << accuracy << "%"
                 << " accuracy" 
                 << std::endl;
-      break;
+      return result;
     }
 
-    char current = getch();
-
-    if (current == 127) {
-      /// Go to start of line
-      std::cout << "\r"; 
-
-      std::size_t current_pos;
-      if (i > 1) {
-        current_pos = i - 1;
-      } else {
-        current_pos = 0;
-      }
-
-      auto it = error_indices[n].find(current_pos);
-      if (it != error_indices[n].end()) {
-        error_indices[n].erase(it);
-      }
+    if (!wait_for_key(extras, view, tick)) {
+      resize();
+      continue;
+    }
+    auto current = read_key(*extras.remap);
+    TTT_TRACE_SCOPE("keystroke");
 
-      for (std::size_t x = 0; x < line.size(); ++x) {
+    if (current.size == 0) {
+      /// Malformed input
+      continue;
+    }
 
-        auto error_char = error_indices[n].find(x) != error_indices[n].end();
+    if (!ascii && i > 0 && utf8::is_zero_width(current.bytes, current.size)) {
+      /// Combining mark following its base letter, which was already scored
+      continue;
+    }
 
-        if (error_char) {
-          std::cout << termcolor::red << termcolor::bold << line[x] << termcolor::reset << std::flush;
-        }
-        else {
-          if (x > current_pos) {
-            std::cout << termcolor::grey << termcolor::bold << line[x] << termcolor::reset << std::flush;
-          }
-          else {
-            if (current_pos > 0) {
-              std::cout << termcolor::yellow << termcolor::bold << line[x] << termcolor::reset << std::flush;
-            } else {
-              std::cout << termcolor::grey << termcolor::bold << line[x] << termcolor::reset << std::flush;
-            }
-          }
-        }
+    if (current.size == 1 && current.bytes[0] == 127) {
+      if (i <= array_of_lines.indent(n)) {
+        /// Nothing to erase on this line
+        continue;
       }
 
-      move_left(line.size() - current_pos + 1);
-
-      if (i > 1) {
-        i -= 1;
-      } else {
-        i = 0;
-      }
+      i -= 1;
+      record(keystroke::backspace);
 
-      if (error_indices[n].find(i - 1) != error_indices[n].end()) {
-        std::cout << termcolor::red << termcolor::bold << line[i - 1] << termcolor::reset << std::flush;
-      } else {
-        std::cout << termcolor::yellow << termcolor::bold << line[i - 1] << termcolor::reset << std::flush;
-      }
+      view.erased(line, i);
+      report();
+      keyed = true;
+      steady_key = keystrokes.size() > 1;
       continue;
     }
 
-    if (i > 0 && line[i - 1] == ' ') {
+    if (i > 0 && line.is_space(i - 1) && !line.is_space(i)) {
       /// Previous character was a space
-      if (current == ' ') {
+      if (current.size == 1 && current.bytes[0] == ' ') {
         /// User types additional spaces
 
         /// Ignore it
@@ -246,72 +1102,1230 @@ void loop_array_of_lines(std::array<std::string, N>& array_of_lines,
       }
     }
 
-    if (n == 0 && i == 0) {
+    if (current.size == 1 && current.bytes[0] == '\r') {
+      /// Enter may arrive as CR depending on terminal settings
+      current.bytes[0] = '\n';
+    }
+
+    if (keystrokes.empty()) {
       /// First characted typed by user
       /// Start time measurement here
       start = std::chrono::high_resolution_clock::now();
     }
-    char expected = line[i++];
-    if (expected == current) {
-      std::cout << termcolor::yellow << termcolor::bold << current << termcolor::reset << std::flush;
+
+    view.speculate(line, i, current.bytes, current.size);
+
+    if (line.matches(i, current.bytes, current.size)) {
+      record(keystroke::correct);
+      view.typed(line, i, true);
     }
     else {
-      std::cout << termcolor::red << termcolor::bold << expected << termcolor::reset << std::flush;
-      total_num_mistakes += 1;
-      error_indices[n].insert(i - 1);
+      record(keystroke::mistake);
+      view.typed(line, i, false);
     }
+    i++;
+    keyed = true;
+    steady_key = keystrokes.size() > 1 && i < line.size();
 
     if (i >= line.size()) {
       /// Last character in line has been printed
-
-      /// Go to start of next line
-      std::cout << "\n\r" << std::flush;
+      line_base += line.size();
       n += 1;
       i = 0;
 
       /// Update line string
       if (n == N) {
         /// No more lines
+        view.next_line(nullptr, 0);
       }
       else {
-        line = array_of_lines[n];
+        array_of_lines.line_text(n, line_text);
+        line.assign(line_text, ascii);
+
+        /// Skip indentation
+        i = array_of_lines.indent(n);
+        view.next_line(&line, i);
       }
     }
+    report();
   }
 }
 
-int main() {
+void print_usage() {
+  std::cout << "usage: ttt [--quotes <file>] [--code <file>] [--record <dir>]\n"
+            << "           [--source <uniform|weighted|sequential|markov>] [--corpus <file>]\n"
+            << "           [--markov-order <1|2>] [--seed <n>] [--no-repeat <n>]\n"
+            << "           [--letters <set>] [--require <letters>] [--length <min>-<max>]\n"
+            << "           [--review <file> [--review-ratio <r>]]\n"
+            << "           [--layout <qwerty|dvorak|colemak>] [--os-layout <layout>] [--finger-stats]\n"
+            << "           [--leaderboard [--leaderboard-socket <path>]] [--check-allocations]\n"
+            << "           [--color <none|16|256|truecolor>] [--probe-terminal] [--fullscreen]\n"
+            << "           [--fps <n>] [--speculative-echo] [--frame-stats] [--render-bench [<ms>]]\n"
+            << "           [--scoring <classic|standard>] [--word-stats] [--session]\n"
+            << "           [--metrics-socket <path>] [--metrics-file <file>]\n"
+            << "           [--race [--race-socket <path>] [--race-bots <n>]] [--ghost <dir>]\n"
+            << "       ttt --race-server [--race-socket <path>]\n"
+            << "       ttt --rescore <dir> [--threads <n>] [--scoring <classic|standard>]\n"
+            << "       ttt --check-sampling [<draws>] [--seed <n>]\n"
+            << "       ttt --serve-leaderboard [--leaderboard-socket <path>] [--leaderboard-snapshot <file>]\n"
+            << "       ttt --leaderboard-top [<n>] [--leaderboard-socket <path>]\n"
+            << "       ttt --check-leaderboard [<submissions>] [--threads <n>]\n"
+            << "  --quotes <file>  type a random quote (one quote per line)\n"
+            << "  --code <file>    type a random snippet of source code\n"
+            << "  --source <kind>  where words come from: uniform or weighted picks from\n"
+            << "                   popular.txt, sequential reads --corpus in order,\n"
+            << "                   markov chains words the way --corpus does\n"
+            << "  --corpus <file>  running text for the sequential and markov sources\n"
+            << "  --markov-order <n>  words of context for the markov source, 1 or 2\n"
+            << "                   (default 2); the model is cached as <file>.markov<n>\n"
+            << "  --seed <n>       pick the same words every time\n"
+            << "  --no-repeat <n>  never repeat any of the last n words, at most 64\n"
+            << "  --letters <set>  only use words made of these letters, e.g. asdfghjkl\n"
+            << "                   for the home row\n"
+            << "  --require <letters>  only use words that contain all of these letters\n"
+            << "  --length <min>-<max>  only use words this many glyphs long; 4-7, 5 or 8-\n"
+            << "                   (the last three filter popular.txt for the uniform and\n"
+            << "                   weighted sources)\n"
+            << "  --review <file>  keep mistyped words in <file> and bring them back for\n"
+            << "                   review on a spaced-repetition schedule\n"
+            << "  --review-ratio <r>  share of the words that are due reviews (default 0.25)\n"
+            << "  --session        after each test, offer the next one or the same text again,\n"
+            << "                   without restarting\n"
+            << "  --metrics-socket <path>  serve keystroke, speed, render and echo latency\n"
+            << "                   metrics on a Unix socket, as Prometheus text or JSON;\n"
+            << "                   curl --unix-socket <path> http://localhost/metrics\n"
+            << "                   (or /metrics.json)\n"
+            << "  --metrics-file <file>  rewrite the metrics into <file> every second, as\n"
+            << "                   JSON if it ends in .json and Prometheus text otherwise\n"
+            << "  --record <dir>   save the finished test as a session log in <dir>\n"
+            << "  --color <depth>  override the detected colour depth\n"
+            << "  --probe-terminal ask the terminal whether it supports truecolor\n"
+            << "  --fullscreen     draw the test on the alternate screen\n"
+            << "  --fps <n>        at most n screen updates a second, 0 for no cap (default 120);\n"
+            << "                   keystrokes in between are sent together, which saves\n"
+            << "                   packets over slow links\n"
+            << "  --speculative-echo  show each key as soon as it is typed, without waiting\n"
+            << "                   for the next frame, and colour it in that frame\n"
+            << "  --frame-stats    print how many frames and bytes the test took, and how\n"
+            << "                   long keys took to reach the screen\n"
+            << "  --render-bench [<ms>]  type the test by script, a key every ms milliseconds\n"
+            << "                   (default 10), on an emulated 24x80 screen; report the\n"
+            << "                   bytes, escape sequences and changed cells of each frame\n"
+            << "                   and check the final screen\n"
+            << "  --word-stats     list the slowest and the mistyped words after the test\n"
+            << "  --layout <name>  the layout you type in: qwerty, dvorak or colemak\n"
+            << "  --os-layout <name>  the layout the system is set to, if different; keys\n"
+            << "                   are translated by their place on the keyboard\n"
+            << "                   (default qwerty)\n"
+            << "  --finger-stats   show each finger's speed and mistakes after the test\n"
+            << "  --race           race everyone else running --race on this host\n"
+            << "  --race-socket <path>  Unix socket of the race server\n"
+            << "  --race-bots <n>  add n simulated opponents to the race\n"
+            << "  --race-server    run a standalone race server\n"
+            << "  --ghost <dir>    race a replay of the fastest session log in <dir>\n"
+            << "  --rescore <dir>  re-score every session log in <dir> and print totals\n"
+            << "  --threads <n>    worker threads for --rescore (default: all cores)\n"
+            << "  --scoring <rules>  classic counts the passage's words and every mistake;\n"
+            << "                   standard counts five glyphs a word, net of mistakes left\n"
+            << "                   in, and also shows gross speed, raw accuracy and how\n"
+            << "                   much speed varied second to second (default classic)\n"
+            << "  --check-sampling test the word sampler for uniformity (default 10M draws)\n"
+            << "  --check-allocations  fail if typing within a line allocated memory; needs\n"
+            << "                   a build with allocation accounting (make alloc), which\n"
+            << "                   also prints allocations after every test\n"
+            << "  --leaderboard    submit the result to the leaderboard server and show its rank\n"
+            << "  --serve-leaderboard  run the leaderboard server\n"
+            << "  --leaderboard-socket <path>  Unix socket of the leaderboard server\n"
+            << "  --leaderboard-snapshot <file>  where the server keeps the board between\n"
+            << "                   runs (default leaderboard.snapshot)\n"
+            << "  --leaderboard-top [<n>]  print the n best results (default 10)\n"
+            << "  --check-leaderboard  submit results from --threads clients to a private\n"
+            << "                   server and check its ranks (default 100k submissions)\n";
+}
 
-  struct winsize w;
-  ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+enum class next_test { next, retry, quit };
 
-  const auto rows = w.ws_col;
-  const auto cols = w.ws_col;
+/// Ask what follows a test in a session: one key, no Enter needed.
+/// The end of input quits.
+next_test ask_next_test() {
+  std::cout << "[n]ext, [r]etry or [q]uit? " << std::flush;
+  raw_terminal raw;
+  while (true) {
+    switch (getch()) {
+      case 'n': case ' ': case '\n':
+        std::cout << "\r\033[2K" << std::flush;
+        return next_test::next;
+      case 'r':
+        std::cout << "\r\033[2K" << std::flush;
+        return next_test::retry;
+      case 'q': case '\033': case 0:
+        std::cout << "\r\n" << std::flush;
+        return next_test::quit;
+      default:
+        break;
+    }
+  }
+}
+
+std::int64_t unix_seconds() {
+  return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/// Grade every word of a finished test for the review queue: clean is
+/// perfect, each mistake costs a grade, and any mistake is a fail
+void review_words(review_queue& reviews, const passage& array_of_lines,
+                  const std::vector<keystroke>& keystrokes, const word_table& table) {
+  const auto now = unix_seconds();
+  for (const auto& r : word_results(array_of_lines, keystrokes)) {
+    if (table.size(r.id) == 0) {
+      continue;
+    }
+    const unsigned quality = r.mistakes == 0 ? 5 : r.mistakes < 3 ? 3 - r.mistakes : 0;
+    reviews.grade(table.word(r.id), quality, now);
+  }
+  if (!reviews.save()) {
+    std::cerr << "ttt: cannot save the review queue" << std::endl;
+  }
+}
+
+void print_allocations(const alloc_tally& tally) {
+  auto per = [](const alloc_count& count, std::size_t n) {
+    std::ostringstream out;
+    out << count.allocations << " allocations (" << count.bytes << " bytes)";
+    if (n > 0) {
+      out << ", " << std::setprecision(2) << std::fixed << double(count.allocations) / n << " per";
+    }
+    return out.str();
+  };
+  if (tally.lines > 0) {
+    std::cout << "generating " << tally.lines << " lines: " << per(tally.generation, tally.lines) << " line\n";
+  }
+  std::cout << "test: " << per(tally.test, 0) << "\n"
+            << "keystrokes: " << per(tally.keys, tally.keystrokes) << " keystroke\n"
+            << "steady state: " << tally.steady_allocating << " of " << tally.steady_keystrokes
+            << " keystrokes allocated, " << per(tally.steady, 0) << std::endl;
+}
+
+/// Speed and mistakes finger by finger, left hand first
+void print_finger_stats(const passage& array_of_lines, const std::vector<keystroke>& keystrokes,
+                        const byte_table& fingers) {
+  const auto results = finger_results(array_of_lines, keystrokes, fingers);
+  for (std::size_t f = 0; f < results.size(); ++f) {
+    const auto& r = results[f];
+    if (r.keys == 0) {
+      continue;
+    }
+    std::cout << std::left << std::setw(14) << finger_name(f) << std::right
+              << std::setw(5) << r.keys << " keys "
+              << std::setw(5) << r.time_us / r.keys / 1000 << " ms/key "
+              << std::setw(4) << r.mistakes << " mistakes\n";
+  }
+  std::cout << std::flush;
+}
+
+/// The words that took longest per glyph, and those typed wrong
+void print_word_stats(const passage& array_of_lines, const std::vector<keystroke>& keystrokes, const word_table& table) {
+  auto results = word_results(array_of_lines, keystrokes);
+  results.erase(std::remove_if(results.begin(), results.end(),
+                               [&](const word_result& r) { return r.glyphs == 0 || table.size(r.id) == 0; }),
+                results.end());
+  if (results.empty()) {
+    return;
+  }
+  const std::size_t shown = 5;
+
+  std::sort(results.begin(), results.end(), [](const word_result& a, const word_result& b) {
+    return a.time_us * b.glyphs > b.time_us * a.glyphs;
+  });
+  std::cout << "slowest:";
+  for (std::size_t k = 0; k < results.size() && k < shown; ++k) {
+    std::cout << " " << table.word(results[k].id) << " (" << results[k].time_us / results[k].glyphs / 1000 << " ms/glyph)";
+  }
+  std::cout << "\n";
+
+  std::stable_sort(results.begin(), results.end(), [](const word_result& a, const word_result& b) {
+    return a.mistakes > b.mistakes;
+  });
+  if (results[0].mistakes > 0) {
+    std::cout << "mistyped:";
+    for (std::size_t k = 0; k < results.size() && k < shown && results[k].mistakes > 0; ++k) {
+      std::cout << " " << table.word(results[k].id) << " (" << results[k].mistakes << ")";
+    }
+    std::cout << "\n";
+  }
+  std::cout << std::flush;
+}
 
-  std::ifstream file("popular.txt");
+int rescore(const std::string& dir, std::size_t num_threads, scoring method) {
+  const auto begin = std::chrono::steady_clock::now();
+  const auto totals = rescore_directory(dir, num_threads, method);
+  const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
 
-  std::size_t num_lines{0};
-  std::vector<std::string> words{};
+  if (totals.sessions == 0) {
+    std::cerr << "ttt: no valid session logs in " << dir << std::endl;
+    return 1;
+  }
+
+  std::cout << totals.sessions << " sessions"
+            << " (" << totals.failed << " unreadable)"
+            << " in " << std::setprecision(3) << std::fixed << seconds << "s\n"
+            << std::setprecision(2)
+            << "mean " << totals.sum_wpm / totals.sessions << " wpm, "
+            << "best " << totals.best_wpm << " wpm, "
+            << "mean " << totals.sum_accuracy / totals.sessions << "% accuracy\n";
+  return 0;
+}
+
+/// Draw `draws` samples through each sampling path and report how far
+/// the counts are from uniform, as a z-score of the chi-squared statistic
+int check_sampling(std::uint64_t seed, std::size_t draws) {
+  bool ok = true;
+  auto report = [&ok](const std::string& name, const std::vector<std::uint64_t>& counts, bool extra = true) {
+    const auto z = uniformity_z(counts);
+    const bool pass = extra && std::fabs(z) < 5;
+    ok = ok && pass;
+    std::cout << std::left << std::setw(26) << name << std::right
+              << std::setw(8) << counts.size() << " buckets  z = "
+              << std::setw(6) << std::setprecision(2) << std::fixed << z
+              << (pass ? "  ok" : "  FAIL") << "\n";
+  };
+
+  counter_rng gen(seed);
+  for (std::uint64_t range : {2ULL, 7ULL, 1000ULL, 65537ULL}) {
+    std::vector<std::uint64_t> counts(range);
+    for (std::size_t d = 0; d < draws; ++d) {
+      counts[bounded(gen, range)]++;
+    }
+    report("bounded(" + std::to_string(range) + ")", counts);
+  }
 
+  /// Where modulo reduction would be most biased: 2^64 mod range is a
+  /// third of the range, so thirds of it would come out 2:2:1
   {
-    std::string line;
+    const std::uint64_t third = 1ULL << 62;
+    std::vector<std::uint64_t> counts(3);
+    for (std::size_t d = 0; d < draws; ++d) {
+      counts[bounded(gen, 3 * third) / third]++;
+    }
+    report("bounded(3 * 2^62)", counts);
+  }
 
-    while(getline(file, line)) {
-      num_lines++; 
-      words.push_back(line);  
+  /// The no-repeat window must keep every word equally likely
+  {
+    const std::uint32_t range = 1000;
+    recent_window recent(5);
+    std::vector<std::uint64_t> counts(range);
+    std::vector<std::uint32_t> last(5, range);
+    bool repeated = false;
+    for (std::size_t d = 0; d < draws; ++d) {
+      const auto index = bounded_fresh(gen, range, recent);
+      repeated = repeated || std::find(last.begin(), last.end(), index) != last.end();
+      last[d % last.size()] = index;
+      counts[index]++;
     }
+    report(repeated ? "no-repeat(5), REPEATED" : "no-repeat(5)", counts, !repeated);
+  }
+
+  return ok ? 0 : 1;
+}
+
+/// Who a result belongs to, as the leaderboard shows it
+std::string leaderboard_name() {
+  const char* user = std::getenv("USER");
+  return user && *user ? user : "uid " + std::to_string(getuid());
+}
+
+void submit_to_leaderboard(const std::string& socket_path, const score_result& result) {
+  leaderboard_client client;
+  leaderboard_message standing{};
+  if (!client.connect(socket_path) || !client.submit(result.wpm, result.accuracy, leaderboard_name(), standing)) {
+    std::cerr << "ttt: no leaderboard server on " << socket_path << std::endl;
+    return;
   }
+  std::cout << "rank " << standing.rank << " of " << standing.total << " (top "
+            << std::setprecision(1) << std::fixed << 100.0 * standing.rank / standing.total << "%)" << std::endl;
+}
+
+int print_leaderboard(const std::string& socket_path, std::size_t n) {
+  leaderboard_client client;
+  std::vector<leaderboard_message> entries;
+  std::uint32_t total = 0;
+  if (!client.connect(socket_path) || !client.top(n, entries, total)) {
+    std::cerr << "ttt: no leaderboard server on " << socket_path << std::endl;
+    return 1;
+  }
+  for (const auto& e : entries) {
+    std::cout << std::setw(4) << e.rank << "  " << std::left << std::setw(16)
+              << std::string(e.name, strnlen(e.name, sizeof(e.name))) << std::right
+              << std::setprecision(2) << std::fixed << std::setw(8) << e.wpm / 100.0 << " wpm "
+              << std::setw(7) << e.accuracy / 100.0 << "%\n";
+  }
+  std::cout << total << " results" << std::endl;
+  return 0;
+}
 
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_int_distribution<std::size_t> distr(0, num_lines);
+/// Run a private leaderboard server, flood it from `num_clients`
+/// threads over its socket, and check what it says against the truth
+int check_leaderboard(std::size_t num_clients, std::size_t submissions, std::uint64_t seed) {
+  const auto base = "/tmp/ttt-check-leaderboard-" + std::to_string(getpid());
+  const auto socket_path = base + ".sock";
+  const auto snapshot_path = base + ".snapshot";
+
+  bool ok = true;
+  std::vector<std::uint64_t> counts(leaderboard_buckets, 0);
+  std::vector<std::uint32_t> speeds;
+  {
+    leaderboard_server server(socket_path, snapshot_path);
+    if (!server.listen()) {
+      std::cerr << "ttt: cannot listen on " << socket_path << std::endl;
+      return 1;
+    }
+    std::thread serving([&server]() { server.run(); });
+
+    /// Every client submits its share of speeds from 0 to 150 wpm
+    std::vector<std::vector<std::uint32_t>> submitted(num_clients);
+    std::atomic<std::size_t> failures{0};
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> clients;
+    for (std::size_t c = 0; c < num_clients; ++c) {
+      clients.emplace_back([&, c]() {
+        leaderboard_client client;
+        if (!client.connect(socket_path)) {
+          failures++;
+          return;
+        }
+        counter_rng gen(seed, 100 + c);
+        leaderboard_message standing{};
+        for (std::size_t k = c; k < submissions; k += num_clients) {
+          const auto wpm = static_cast<std::uint32_t>(bounded(gen, 15000));
+          if (!client.submit(wpm / 100.0, 100, "check", standing)) {
+            failures++;
+            return;
+          }
+          submitted[c].push_back(wpm);
+        }
+      });
+    }
+    for (auto& t : clients) {
+      t.join();
+    }
+    const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << submissions << " submissions from " << num_clients << " clients in "
+              << std::setprecision(0) << std::fixed << seconds * 1000 << " ms ("
+              << submissions / seconds << "/s)" << std::endl;
+    if (failures > 0) {
+      std::cout << failures << " clients failed  FAIL" << std::endl;
+      ok = false;
+    }
+
+    for (const auto& s : submitted) {
+      for (auto wpm : s) {
+        counts[leaderboard_bucket(wpm)]++;
+        speeds.push_back(wpm);
+      }
+    }
+    std::sort(speeds.begin(), speeds.end(), std::greater<std::uint32_t>());
+
+    /// Ranks against a count of the faster buckets
+    leaderboard_client client;
+    bool ranks_ok = client.connect(socket_path);
+    counter_rng gen(seed, 99);
+    for (std::size_t q = 0; ranks_ok && q < 1000; ++q) {
+      const auto wpm = static_cast<std::uint32_t>(bounded(gen, 16000));
+      std::uint64_t faster = 0;
+      for (auto b = leaderboard_bucket(wpm) + 1; b < leaderboard_buckets; ++b) {
+        faster += counts[b];
+      }
+      leaderboard_message standing{};
+      ranks_ok = client.rank(wpm / 100.0, standing) && standing.rank == faster + 1 && standing.total == speeds.size();
+    }
+    std::cout << "ranks " << (ranks_ok ? "ok" : "FAIL") << std::endl;
+
+    std::vector<leaderboard_message> top;
+    std::uint32_t total = 0;
+    bool top_ok = client.top(10, top, total) && top.size() == std::min<std::size_t>(10, speeds.size());
+    for (std::size_t k = 0; top_ok && k < top.size(); ++k) {
+      top_ok = top[k].wpm == speeds[k] && top[k].rank == k + 1;
+    }
+    std::cout << "top 10 " << (top_ok ? "ok" : "FAIL") << std::endl;
+    ok = ok && ranks_ok && top_ok;
+
+    server.stop();
+    serving.join();
+  }
+
+  /// The server saved on the way out
+  leaderboard_snapshot snapshot;
+  bool snapshot_ok = read_leaderboard_snapshot(snapshot_path, snapshot);
+  for (std::size_t b = 0; snapshot_ok && b < leaderboard_buckets; ++b) {
+    snapshot_ok = snapshot.counts[b] == counts[b];
+  }
+  std::cout << "snapshot " << (snapshot_ok ? "ok" : "FAIL") << std::endl;
+  ::unlink(snapshot_path.c_str());
+
+  return ok && snapshot_ok ? 0 : 1;
+}
+
+/// Hands everything the test draws to an emulated screen
+class emulator_sink : public output_sink {
+public:
+  explicit emulator_sink(vt_emulator& screen) : screen_(screen) {}
+
+  void write(const char* data, std::size_t size) override {
+    screen_.feed(data, size);
+  }
+
+private:
+  vt_emulator& screen_;
+};
+
+/// Types a passage into the test through a pipe standing in for stdin:
+/// one key every `ms_per_key`, and every seventh key a wrong one taken
+/// back with a backspace first
+class scripted_typist {
+public:
+  scripted_typist(const passage& array_of_lines, unsigned ms_per_key) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+      perror("pipe()");
+      return;
+    }
+    saved_stdin_ = dup(STDIN_FILENO);
+    dup2(fds[0], STDIN_FILENO);
+    close(fds[0]);
+
+    const int out = fds[1];
+    thread_ = std::thread([&array_of_lines, ms_per_key, out] {
+      const auto pause = std::chrono::milliseconds(ms_per_key);
+      auto send = [&](const char* bytes, std::size_t size) {
+        if (write(out, bytes, size) < 0) {
+          perror("write()");
+        }
+        std::this_thread::sleep_for(pause);
+      };
+
+      std::size_t k = 0;
+      std::string text;
+      utf8::line line;
+      for (std::size_t n = 0; n < array_of_lines.num_lines(); ++n) {
+        array_of_lines.line_text(n, text);
+        line.assign(text, array_of_lines.ascii);
+        for (std::size_t i = array_of_lines.indent(n); i < line.size(); ++i, ++k) {
+          /// Not on the last glyph, where a wrong key moves on to the
+          /// next line and the backspace could not take it back
+          if (k % 7 == 3 && i + 1 < line.size()) {
+            send("#", 1);
+            send("\x7f", 1);
+          }
+          const auto g = line.at(i);
+          send(line.text().data() + g.offset, g.base_size);
+        }
+      }
+      close(out);
+    });
+  }
+
+  ~scripted_typist() {
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    if (saved_stdin_ >= 0) {
+      dup2(saved_stdin_, STDIN_FILENO);
+      close(saved_stdin_);
+    }
+  }
+
+  scripted_typist(const scripted_typist&) = delete;
+  scripted_typist& operator=(const scripted_typist&) = delete;
+
+private:
+  int saved_stdin_{-1};
+  std::thread thread_;
+};
+
+/// Report what drawing the test cost on the emulated screen, then check
+/// that the screen ends up showing every line of the passage, in order,
+/// typed correctly. Returns whether it does.
+bool report_render(const vt_emulator& screen, const passage& array_of_lines, std::size_t keystrokes,
+                   const vt_style& correct) {
+  const auto& frames = screen.frames();
+  std::size_t bytes{0}, sequences{0}, most_sequences{0}, cells{0}, most_cells{0};
+  for (const auto& f : frames) {
+    bytes += f.bytes;
+    sequences += f.sequences;
+    cells += f.cells_changed;
+    most_sequences = std::max(most_sequences, f.sequences);
+    most_cells = std::max(most_cells, f.cells_changed);
+  }
+  const auto per_frame = [&](std::size_t total) {
+    return frames.empty() ? 0.0 : double(total) / frames.size();
+  };
+  std::cout << frames.size() << " frames, " << bytes << " bytes for " << keystrokes << " keystrokes ("
+            << std::setprecision(1) << std::fixed
+            << (keystrokes > 0 ? double(bytes) / keystrokes : 0.0) << " bytes/keystroke)\n"
+            << "escape sequences per frame: " << per_frame(sequences) << " average, " << most_sequences << " max\n"
+            << "cells changed per frame: " << per_frame(cells) << " average, " << most_cells << " max\n";
+
+  /// A fullscreen test has left the alternate screen by now; what it
+  /// last showed is still there to look at
+  const bool alternate = !screen.on_alternate_screen() && screen.used_alternate_screen();
+  std::size_t row = 0;
+  std::size_t missing = 0;
+  std::size_t misstyled = 0;
+  std::size_t undrawn = 0;   // the latest run of glyphs not shown as correct
+  utf8::line line;
+  for (std::size_t n = 0; n < array_of_lines.num_lines(); ++n) {
+    line.assign(array_of_lines.line_data(n), array_of_lines.line_size(n), array_of_lines.ascii);
+    std::string expected;
+    for (std::size_t i = 0; i < line.size(); ++i) {
+      const auto g = line.at(i);
+      if (is_newline(line, i)) {
+        expected += "\u21b5";
+      }
+      else {
+        expected.append(line.text(), g.offset, g.size);
+      }
+    }
+    expected.erase(expected.find_last_not_of(' ') + 1);
+
+    while (row < screen.rows() && screen.row_text(row, alternate) != expected) {
+      row++;
+    }
+    if (row == screen.rows()) {
+      std::cout << "line " << n + 1 << " is not on screen: " << expected << "\n";
+      missing++;
+      row = 0;
+      continue;
+    }
+
+    std::size_t col = line.width(0, array_of_lines.indents[n]);
+    for (std::size_t i = array_of_lines.indents[n]; i < line.size() && col < screen.cols(); ++i) {
+      if (screen.at(row, col, alternate).style != correct) {
+        undrawn++;
+      }
+      else {
+        misstyled += undrawn;
+        undrawn = 0;
+      }
+      col += is_newline(line, i) ? 1 : line.at(i).width;
+    }
+    row++;
+  }
+
+  /// A fullscreen test drops the frame still pending when it ends, so
+  /// the keys typed since the last one may never have been drawn
+  if (!alternate) {
+    misstyled += undrawn;
+  }
+
+  const bool ok = missing == 0 && misstyled == 0;
+  std::cout << "screen " << (ok ? "ok" : "FAIL");
+  if (misstyled > 0) {
+    std::cout << " (" << misstyled << " glyphs not shown as typed correctly)";
+  }
+  std::cout << std::endl;
+  if (!ok) {
+    for (std::size_t r = 0; r < screen.rows(); ++r) {
+      std::cout << "|" << screen.row_text(r, alternate) << "\n";
+    }
+    std::cout << std::flush;
+  }
+  return ok;
+}
+
+int main(int argc, char* argv[]) {
+
+  std::string quotes_path;
+  std::string code_path;
+  std::string record_dir;
+  std::string rescore_dir;
+  std::string ghost_dir;
+  std::string source_kind = "uniform";
+  std::string corpus_path;
+  std::uint32_t markov_order{2};
+  std::size_t no_repeat{0};
+  word_filter filter;
+  std::string review_path;
+  double review_ratio{0.25};
+  std::uint64_t seed{0};
+  bool seeded{false};
+  std::size_t check_draws{0};
+  std::size_t num_threads = std::thread::hardware_concurrency();
+  bool color_override{false};
+  bool probe_terminal{false};
+  bool fullscreen{false};
+  unsigned fps{120};
+  bool show_frame_stats{false};
+  bool speculative_echo{false};
+  bool show_word_stats{false};
+  layout_id typed_layout{qwerty};
+  layout_id os_layout{qwerty};
+  bool show_finger_stats{false};
+  bool check_allocations{false};
+  bool render_bench{false};
+  bool session{false};
+  std::string metrics_socket;
+  std::string metrics_file;
+  unsigned render_bench_ms{10};
+  bool submit_result{false};
+  bool leaderboard_server_only{false};
+  std::size_t leaderboard_top{0};
+  std::size_t check_submissions{0};
+  std::string leaderboard_socket = default_leaderboard_socket();
+  std::string leaderboard_snapshot_path = "leaderboard.snapshot";
+  scoring scoring_method{scoring::classic};
+  bool racing{false};
+  bool race_server_only{false};
+  std::string race_socket = default_race_socket();
+  std::size_t num_race_bots{0};
+  color_depth depth{color_depth::none};
+
+  for (int k = 1; k < argc; ++k) {
+    const std::string arg = argv[k];
+    if (arg == "--quotes" && k + 1 < argc) {
+      quotes_path = argv[++k];
+    }
+    else if (arg == "--code" && k + 1 < argc) {
+      code_path = argv[++k];
+    }
+    else if (arg == "--record" && k + 1 < argc) {
+      record_dir = argv[++k];
+    }
+    else if (arg == "--rescore" && k + 1 < argc) {
+      rescore_dir = argv[++k];
+    }
+    else if (arg == "--color" && k + 1 < argc && parse_color_depth(argv[k + 1], depth)) {
+      color_override = true;
+      ++k;
+    }
+    else if (arg == "--probe-terminal") {
+      probe_terminal = true;
+    }
+    else if (arg == "--fullscreen") {
+      fullscreen = true;
+    }
+    else if (arg == "--fps" && k + 1 < argc) {
+      fps = static_cast<unsigned>(std::stoul(argv[++k]));
+    }
+    else if (arg == "--frame-stats") {
+      show_frame_stats = true;
+    }
+    else if (arg == "--speculative-echo") {
+      speculative_echo = true;
+    }
+    else if (arg == "--word-stats") {
+      show_word_stats = true;
+    }
+    else if (arg == "--layout" && k + 1 < argc && parse_layout(argv[k + 1], typed_layout)) {
+      ++k;
+    }
+    else if (arg == "--os-layout" && k + 1 < argc && parse_layout(argv[k + 1], os_layout)) {
+      ++k;
+    }
+    else if (arg == "--finger-stats") {
+      show_finger_stats = true;
+    }
+    else if (arg == "--check-allocations") {
+      check_allocations = true;
+    }
+    else if (arg == "--metrics-socket" && k + 1 < argc) {
+      metrics_socket = argv[++k];
+    }
+    else if (arg == "--metrics-file" && k + 1 < argc) {
+      metrics_file = argv[++k];
+    }
+    else if (arg == "--session") {
+      session = true;
+    }
+    else if (arg == "--render-bench") {
+      render_bench = true;
+      if (k + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[k + 1][0]))) {
+        render_bench_ms = static_cast<unsigned>(std::stoul(argv[++k]));
+      }
+    }
+    else if (arg == "--leaderboard") {
+      submit_result = true;
+    }
+    else if (arg == "--serve-leaderboard") {
+      leaderboard_server_only = true;
+    }
+    else if (arg == "--leaderboard-socket" && k + 1 < argc) {
+      leaderboard_socket = argv[++k];
+    }
+    else if (arg == "--leaderboard-snapshot" && k + 1 < argc) {
+      leaderboard_snapshot_path = argv[++k];
+    }
+    else if (arg == "--leaderboard-top") {
+      leaderboard_top = 10;
+      if (k + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[k + 1][0]))) {
+        leaderboard_top = std::stoul(argv[++k]);
+      }
+    }
+    else if (arg == "--check-leaderboard") {
+      check_submissions = 100 * 1000;
+      if (k + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[k + 1][0]))) {
+        check_submissions = std::stoul(argv[++k]);
+      }
+    }
+    else if (arg == "--scoring" && k + 1 < argc && parse_scoring(argv[k + 1], scoring_method)) {
+      ++k;
+    }
+    else if (arg == "--source" && k + 1 < argc && is_text_source_kind(argv[k + 1])) {
+      source_kind = argv[++k];
+    }
+    else if (arg == "--corpus" && k + 1 < argc) {
+      corpus_path = argv[++k];
+    }
+    else if (arg == "--seed" && k + 1 < argc) {
+      seed = std::stoull(argv[++k]);
+      seeded = true;
+    }
+    else if (arg == "--no-repeat" && k + 1 < argc) {
+      no_repeat = std::stoul(argv[++k]);
+      if (no_repeat > recent_window::capacity) {
+        std::cerr << "ttt: --no-repeat can look back at most " << std::size_t{recent_window::capacity}
+                  << " words" << std::endl;
+        return 1;
+      }
+    }
+    else if (arg == "--letters" && k + 1 < argc) {
+      filter.allowed = letter_mask(argv[++k]);
+    }
+    else if (arg == "--require" && k + 1 < argc) {
+      filter.required |= letter_mask(argv[++k]);
+    }
+    else if (arg == "--review" && k + 1 < argc) {
+      review_path = argv[++k];
+    }
+    else if (arg == "--review-ratio" && k + 1 < argc) {
+      review_ratio = std::stod(argv[++k]);
+    }
+    else if (arg == "--length" && k + 1 < argc
+             && parse_length_range(argv[k + 1], filter.min_length, filter.max_length)) {
+      ++k;
+    }
+    else if (arg == "--check-sampling") {
+      check_draws = 10 * 1000 * 1000;
+      if (k + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[k + 1][0]))) {
+        check_draws = std::stoul(argv[++k]);
+      }
+    }
+    else if (arg == "--markov-order" && k + 1 < argc) {
+      markov_order = static_cast<std::uint32_t>(std::stoul(argv[++k]));
+    }
+    else if (arg == "--ghost" && k + 1 < argc) {
+      ghost_dir = argv[++k];
+    }
+    else if (arg == "--race") {
+      racing = true;
+    }
+    else if (arg == "--race-server") {
+      race_server_only = true;
+    }
+    else if (arg == "--race-socket" && k + 1 < argc) {
+      race_socket = argv[++k];
+    }
+    else if (arg == "--race-bots" && k + 1 < argc) {
+      num_race_bots = std::min<std::size_t>(std::stoul(argv[++k]), race_max_racers - 1);
+    }
+    else if (arg == "--threads" && k + 1 < argc) {
+      num_threads = std::stoul(argv[++k]);
+    }
+    else {
+      print_usage();
+      return arg == "--help" ? 0 : 1;
+    }
+  }
+
+  if (!rescore_dir.empty()) {
+    return rescore(rescore_dir, num_threads, scoring_method);
+  }
+
+  if (check_draws > 0) {
+    return check_sampling(seeded ? seed : 1, check_draws);
+  }
+
+  if (check_allocations && !alloc_stats_enabled) {
+    std::cerr << "ttt: --check-allocations needs a build with allocation accounting, make alloc" << std::endl;
+    return 1;
+  }
+
+  if (session && racing) {
+    std::cerr << "ttt: a race is one test, so --session cannot join one" << std::endl;
+    return 1;
+  }
+
+  if (check_submissions > 0) {
+    return check_leaderboard(std::max<std::size_t>(num_threads, 1), check_submissions, seeded ? seed : 1);
+  }
+
+  if (leaderboard_server_only) {
+    leaderboard_server server(leaderboard_socket, leaderboard_snapshot_path);
+    if (!server.listen()) {
+      std::cerr << "ttt: cannot listen on " << leaderboard_socket << std::endl;
+      return 1;
+    }
+    std::cout << "leaderboard server listening on " << leaderboard_socket << std::endl;
+    server.run();
+    return 0;
+  }
+
+  if (leaderboard_top > 0) {
+    return print_leaderboard(leaderboard_socket, leaderboard_top);
+  }
+
+  if (race_server_only) {
+    race_server server(race_socket);
+    if (!server.listen()) {
+      std::cerr << "ttt: cannot listen on " << race_socket << std::endl;
+      return 1;
+    }
+    std::cout << "race server listening on " << race_socket << std::endl;
+    server.run();
+    return 0;
+  }
+
+  /// Publish metrics for as long as there are tests; the file gets its
+  /// final rewrite on the way out
+  std::unique_ptr<metrics_exporter> exporter;
+  if (!metrics_socket.empty() || !metrics_file.empty()) {
+    exporter.reset(new metrics_exporter(metrics_socket, metrics_file));
+    if (!exporter->start()) {
+      std::cerr << "ttt: cannot serve metrics on " << metrics_socket << std::endl;
+      return 1;
+    }
+  }
+
+  /// Pick the render backend once, up front. A render benchmark draws
+  /// in 16 colours on a 24 by 80 screen unless told otherwise, so its
+  /// numbers compare from one machine to the next.
+  if (render_bench && !color_override) {
+    depth = color_depth::ansi16;
+  }
+  else if (!color_override) {
+    depth = detect_color_depth();
+    if (probe_terminal) {
+      depth = probe_color_depth(depth);
+    }
+  }
+  const auto theme = make_render_backend(depth);
+
+  unsigned short rows, cols;
+  window_size(rows, cols);
+  if (render_bench) {
+    rows = 24;
+    cols = 80;
+  }
+
+  if (!seeded) {
+    std::random_device rd;
+    seed = (std::uint64_t(rd()) << 32) | rd();
+  }
+  counter_rng gen(seed);
+
+  /// Join the race on this host, hosting it ourselves if nobody is
+  std::unique_ptr<race_host> host;
+  race_client race;
+  if (racing && !race.connect(race_socket)) {
+    host.reset(new race_host(race_socket));
+    if (!host->running() || !race.connect(race_socket)) {
+      std::cerr << "ttt: cannot join the race on " << race_socket << std::endl;
+      return 1;
+    }
+  }
+  if (racing) {
+    /// Everyone in the room types the same passage
+    gen = counter_rng(race.seed());
+  }
 
   constexpr std::size_t num_lines_in_test = 3;
   constexpr std::size_t num_words_per_line_in_test = 5;
+  constexpr std::size_t num_lines_in_code_snippet = 6;
+  constexpr std::size_t num_race_rows = 6;
+
+  /// The ghost replays a session straight from its mapped log
+  std::unique_ptr<mapped_session> ghost_session;
+  std::unique_ptr<ghost_replay> ghost;
+  double ghost_wpm{0};
+  if (!ghost_dir.empty()) {
+    ghost_session = load_best_session(ghost_dir, ghost_wpm);
+    if (!ghost_session) {
+      std::cerr << "ttt: no session logs to replay in " << ghost_dir << std::endl;
+      return 1;
+    }
+    ghost.reset(new ghost_replay(ghost_session->view()));
+  }
+
+  std::vector<keystroke> keystrokes;
+  /// Every word typed this run, so results can be kept per word
+  word_table table;
+
+  /// What the test allocated, reported by `make alloc` builds
+  alloc_tally allocations;
+
+  /// Mistyped words due for review, in word mode with --review
+  std::unique_ptr<review_queue> reviews;
+
+  /// The views outlive a test, so the tests of a session share their
+  /// buffers
+  std::unique_ptr<fullscreen_view> full_view;
+  std::unique_ptr<inline_view> line_view;
+
+  /// Speeds of the tests so far, for the end of a session
+  std::size_t tests_done{0};
+  double total_wpm{0};
+  double best_wpm{0};
+
+  auto run = [&](passage& array_of_lines) {
+    if (array_of_lines.word_ids.empty()) {
+      intern_words(array_of_lines, table);
+    }
+
+    loop_extras extras;
+    extras.remap = &layouts.remap[os_layout][typed_layout];
+    extras.allocations = &allocations;
+    extras.ghost = ghost.get();
+    std::unique_ptr<race_bots> bots;
+    if (racing) {
+      extras.race = &race;
+      extras.panel_width = cols > 2 ? cols - 2 : 1;
+      extras.panel_rows = fullscreen ? std::min<std::size_t>(num_race_rows, rows > 4 ? rows - 4 : 0) : num_race_rows;
+      if (num_race_bots > 0) {
+        bots.reset(new race_bots(race_socket, num_race_bots,
+                                 static_cast<std::uint32_t>(array_of_lines.glyphs()), race.seed()));
+      }
+    }
+
+    /// A render benchmark draws on an emulated screen, with a scripted
+    /// typist at the keys
+    vt_emulator screen(render_bench ? rows : 1, render_bench ? cols : 1);
+    emulator_sink sink(screen);
+    std::unique_ptr<scripted_typist> typist;
+    if (render_bench) {
+      screen.reserve(3 * array_of_lines.glyphs());
+      current_output_sink() = &sink;
+      typist.reset(new scripted_typist(array_of_lines, render_bench_ms));
+    }
+
+    frame_stats frames;
+    score_result result;
+    const auto test_start = allocations_so_far();
+    {
+      raw_terminal raw;
+      if (fullscreen) {
+        if (!full_view) {
+          full_view.reset(new fullscreen_view(theme, rows, cols, fps));
+        }
+        auto& view = *full_view;
+        view.resize(rows, cols);
+        view.reserve_panel(extras.panel_rows);
+        view.speculative_echo(speculative_echo);
+        result = loop_array_of_lines(array_of_lines, keystrokes, view, extras, scoring_method);
+        frames = view.frames();
+      }
+      else {
+        if (!line_view) {
+          line_view.reset(new inline_view(theme, fps));
+        }
+        auto& view = *line_view;
+        view.reserve_panel(extras.panel_rows);
+        view.speculative_echo(speculative_echo);
+        result = loop_array_of_lines(array_of_lines, keystrokes, view, extras, scoring_method);
+        frames = view.frames();
+      }
+    }
+    allocations.test = allocations_so_far() - test_start;
+    typist.reset();
+    current_output_sink() = nullptr;
+
+    tests_done++;
+    total_wpm += result.wpm;
+    best_wpm = std::max(best_wpm, result.wpm);
+
+    if (show_frame_stats) {
+      std::cout << frames.frames << " frames, " << frames.echoes << " echoes, " << frames.bytes << " bytes for "
+                << keystrokes.size() << " keystrokes ("
+                << std::setprecision(1) << std::fixed
+                << (frames.frames > 0 ? double(frames.bytes) / frames.frames : 0.0) << " bytes/frame, largest "
+                << frames.largest << ")" << std::endl;
+      auto echo_us = frames.echo_us;
+      if (!echo_us.empty()) {
+        std::sort(echo_us.begin(), echo_us.end());
+        std::cout << "echo latency " << echo_us[echo_us.size() / 2] << " us median, "
+                  << echo_us[echo_us.size() * 99 / 100] << " us 99th percentile, "
+                  << echo_us.back() << " us max" << std::endl;
+      }
+    }
+
+    if (render_bench && !report_render(screen, array_of_lines, keystrokes.size(),
+                                       vt_emulator::parse_style(theme.sgr[style_correct]))) {
+      return 1;
+    }
+
+    if (alloc_stats_enabled) {
+      print_allocations(allocations);
+      if (check_allocations && allocations.steady_allocating > 0) {
+        std::cerr << "ttt: the typing loop allocated" << std::endl;
+        return 1;
+      }
+    }
+
+    if (show_word_stats) {
+      print_word_stats(array_of_lines, keystrokes, table);
+    }
+
+    if (show_finger_stats) {
+      print_finger_stats(array_of_lines, keystrokes, layouts.fingers[typed_layout]);
+    }
+
+    if (reviews) {
+      review_words(*reviews, array_of_lines, keystrokes, table);
+    }
+
+    if (ghost) {
+      std::cout << "ghost: " << int(ghost_wpm) << " wpm" << std::endl;
+    }
+
+    if (submit_result) {
+      submit_to_leaderboard(leaderboard_socket, result);
+    }
+
+    if (!record_dir.empty() && write_session(record_dir, array_of_lines, keystrokes).empty()) {
+      std::cerr << "ttt: cannot write session log to " << record_dir << std::endl;
+      return 1;
+    }
+    return 0;
+  };
+
+  /// One test, or with --session as many as the user likes: after each
+  /// one `next` refills the passage for a new test, or the same text
+  /// is typed again. Everything already warm carries over, from the
+  /// word source to the buffers of the passage, the keystroke log and
+  /// the views, so the next test is ready at once.
+  auto run_session = [&](passage& array_of_lines, auto next) {
+    while (true) {
+      const auto status = run(array_of_lines);
+      if (status != 0 || !session) {
+        return status;
+      }
+
+      const auto choice = ask_next_test();
+      if (choice == next_test::quit) {
+        break;
+      }
+
+      /// The terminal may have changed size in between
+      if (!render_bench) {
+        window_size(rows, cols);
+      }
+      allocations = alloc_tally{};
+      if (choice == next_test::next) {
+        const auto generation_start = allocations_so_far();
+        next(array_of_lines);
+        allocations.generation = allocations_so_far() - generation_start;
+        allocations.lines = array_of_lines.num_lines();
+        if (array_of_lines.num_lines() == 0) {
+          std::cerr << "ttt: nothing left to type" << std::endl;
+          return 1;
+        }
+      }
+      else if (array_of_lines.reflowable()) {
+        /// Same text, laid out again only if it no longer fits
+        for (std::size_t n = 0; n < array_of_lines.num_lines(); ++n) {
+          if (array_of_lines.line_width(n) >= cols) {
+            array_of_lines.reflow(cols);
+            break;
+          }
+        }
+      }
+    }
+
+    std::cout << tests_done << (tests_done == 1 ? " test, " : " tests, ")
+              << int(total_wpm / tests_done) << " wpm on average, best " << int(best_wpm) << " wpm" << std::endl;
+    return 0;
+  };
+
+  if (ghost) {
+    /// The ghost only makes sense on the passage it typed, so every
+    /// test of a session is that one
+    auto array_of_lines = passage_from_session(ghost_session->view());
+    return run_session(array_of_lines, [](passage&) {});
+  }
+
+  if (!quotes_path.empty() || !code_path.empty()) {
+    const auto& path = quotes_path.empty() ? code_path : quotes_path;
+    corpus_reader reader(path);
+    if (!reader.good()) {
+      std::cerr << "ttt: cannot read " << path << std::endl;
+      return 1;
+    }
+
+    auto load = [&](passage& array_of_lines) {
+      if (quotes_path.empty()) {
+        load_code(reader, gen, cols, num_lines_in_code_snippet, array_of_lines);
+      }
+      else {
+        load_quote(reader, gen, cols, array_of_lines);
+      }
+    };
+    passage array_of_lines;
+    load(array_of_lines);
+
+    return run_session(array_of_lines, load);
+  }
+
+  /// Start producing words now, so they are ready by the time the
+  /// terminal is
+  auto dict = load_dictionary("popular.txt");
+  if (dict.words.empty()) {
+    std::cerr << "ttt: cannot read any words from popular.txt" << std::endl;
+    return 1;
+  }
+  if (filter.active()) {
+    dict = select_words(dict, filter_words(dict, filter));
+    if (dict.words.empty()) {
+      std::cerr << "ttt: no word in popular.txt passes --letters, --require and --length" << std::endl;
+      return 1;
+    }
+  }
+  auto source = make_text_source(source_kind, dict, corpus_path, markov_order, no_repeat, gen());
+  if (!source) {
+    std::cerr << "ttt: the " << source_kind << " source needs a readable --corpus <file>" << std::endl;
+    return 1;
+  }
+  prefetching_source words(std::move(source));
+  if (!words.has_words()) {
+    std::cerr << "ttt: the " << source_kind << " source found no words in " << corpus_path << std::endl;
+    return 1;
+  }
+
+  /// Only the reviews due now are read before the first test; the rest
+  /// of the queue waits until there are results to schedule. Every test
+  /// of a session looks again, as the ones before it moved words on.
+  std::vector<std::string> due;
+  if (!review_path.empty()) {
+    reviews.reset(new review_queue(review_path));
+  }
+  review_mixer<prefetching_source> mixed(words, due, review_ratio);
 
   /// Generate list of lines
-  auto array_of_lines = generate_lines<num_lines_in_test, num_words_per_line_in_test>(words, distr, gen, rows, cols);
+  auto generate = [&](passage& array_of_lines) {
+    if (reviews) {
+      reviews->peek_due(unix_seconds(), num_lines_in_test * num_words_per_line_in_test, due);
+      mixed.restart();
+    }
+    generate_lines<num_lines_in_test, num_words_per_line_in_test>(mixed, table, cols, array_of_lines);
+  };
+  passage array_of_lines;
+  const auto generation_start = allocations_so_far();
+  generate(array_of_lines);
+  allocations.generation = allocations_so_far() - generation_start;
+  allocations.lines = array_of_lines.num_lines();
+  if (array_of_lines.num_lines() == 0) {
+    std::cerr << "ttt: no word from the " << source_kind << " source fits in " << cols << " columns" << std::endl;
+    return 1;
+  }
 
   /// Start test
-  loop_array_of_lines<num_lines_in_test, num_words_per_line_in_test>(array_of_lines, words, distr, gen);
+  return run_session(array_of_lines, generate);
 }
@@ -0,0 +1,373 @@
+#ifndef TTT_MARKOV_HPP_
+#define TTT_MARKOV_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "utf8.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// On-disk layout of a trained model, which is also its in-memory
+/// layout, so a cached model is used straight from the mapping:
+///
+///   markov_header
+///   uint32_t word_offsets[num_words + 1]   into text
+///   uint32_t row_offsets[num_states + 1]   CSR rows into the edge arrays
+///   uint32_t edge_word[num_edges]          word emitted by the edge
+///   uint32_t edge_next[num_edges]          state the edge leads to
+///   uint32_t edge_threshold[num_edges]     alias table: keep below this
+///   uint32_t edge_alias[num_edges]         alias table: else this column
+///   uint8_t  widths[num_words]
+///   char     text[text_size]
+///
+/// A state is the last word (order 1) or the last two words (order 2).
+/// Its successors are one CSR row, and the row's alias table makes
+/// picking one O(1) however many there are.
+struct markov_header {
+  char magic[4];
+  std::uint32_t version;
+  std::uint32_t order;
+  std::uint32_t num_words;
+  std::uint32_t num_states;
+  std::uint32_t num_edges;
+  std::uint32_t text_size;
+  std::uint32_t reserved;
+  /// The corpus the model was trained on, to notice when it changes
+  std::uint64_t source_size;
+  std::int64_t source_mtime;
+};
+
+static_assert(sizeof(markov_header) == 48, "markov header layout is part of the cache format");
+
+constexpr char markov_magic[4] = {'T', 'T', 'T', 'M'};
+constexpr std::uint32_t markov_version = 1;
+
+/// A trained model, either built in memory or mapped from its cache
+class markov_model {
+public:
+  markov_model() = default;
+  markov_model(const markov_model&) = delete;
+  markov_model& operator=(const markov_model&) = delete;
+
+  ~markov_model() {
+    if (mapped_) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  /// Load `cache` if it was trained on the current `corpus` with the
+  /// same order; otherwise train and try to write the cache for next time
+  bool load(const std::string& corpus, std::uint32_t order, const std::string& cache) {
+    struct stat st;
+    if (stat(corpus.c_str(), &st) < 0) {
+      return false;
+    }
+    if (map(cache) && header_.order == order && header_.source_size == std::uint64_t(st.st_size)
+        && header_.source_mtime == std::int64_t(st.st_mtime)) {
+      return true;
+    }
+    release();
+
+    if (!train(corpus, order, st)) {
+      return false;
+    }
+
+    /// Write then rename, so a concurrent reader never maps half a file
+    const auto temporary = cache + "." + std::to_string(getpid());
+    std::ofstream file(temporary, std::ios::binary);
+    file.write(image_.data(), image_.size());
+    file.close();
+    if (file) {
+      std::rename(temporary.c_str(), cache.c_str());
+    }
+    else {
+      /// No cache then; the model in memory works all the same
+      std::remove(temporary.c_str());
+    }
+    return true;
+  }
+
+  std::uint32_t num_states() const { return header_.num_states; }
+
+  std::uint32_t order() const { return header_.order; }
+
+  /// Take one step from `state` using 64 random bits: the high half
+  /// picks a column of the row's alias table, the low half decides
+  /// between the column and its alias. Returns false at a dead end.
+  bool step(std::uint32_t& state, std::uint64_t bits, std::uint32_t& word) const {
+    const auto begin = row_offsets_[state];
+    const auto count = row_offsets_[state + 1] - begin;
+    if (count == 0) {
+      return false;
+    }
+    const auto column = static_cast<std::uint32_t>(((bits >> 32) * count) >> 32);
+    const auto edge = begin + (static_cast<std::uint32_t>(bits) < edge_threshold_[begin + column]
+                               ? column : edge_alias_[begin + column]);
+    word = edge_word_[edge];
+    state = edge_next_[edge];
+    return true;
+  }
+
+  const char* word_data(std::uint32_t word) const { return text_ + word_offsets_[word]; }
+
+  std::size_t word_size(std::uint32_t word) const { return word_offsets_[word + 1] - word_offsets_[word]; }
+
+  std::size_t word_width(std::uint32_t word) const { return widths_[word]; }
+
+private:
+  static std::size_t image_size(const markov_header& h) {
+    return sizeof(markov_header)
+      + (std::size_t(h.num_words) + 1 + h.num_states + 1 + 4 * std::size_t(h.num_edges)) * sizeof(std::uint32_t)
+      + h.num_words + h.text_size;
+  }
+
+  bool map(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(markov_header))) {
+      size_ = static_cast<std::size_t>(st.st_size);
+      void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        data_ = static_cast<const char*>(data);
+        mapped_ = true;
+      }
+    }
+    ::close(fd);
+    return mapped_ && parse();
+  }
+
+  void release() {
+    if (mapped_) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+    mapped_ = false;
+    data_ = nullptr;
+    size_ = 0;
+    header_ = markov_header{};
+  }
+
+  /// Point the accessors into data_, rejecting anything out of bounds
+  bool parse() {
+    std::memcpy(&header_, data_, sizeof(header_));
+    if (std::memcmp(header_.magic, markov_magic, sizeof(header_.magic)) != 0
+        || header_.version != markov_version || image_size(header_) != size_) {
+      return false;
+    }
+
+    auto tables = reinterpret_cast<const std::uint32_t*>(data_ + sizeof(markov_header));
+    word_offsets_ = tables;
+    row_offsets_ = word_offsets_ + header_.num_words + 1;
+    edge_word_ = row_offsets_ + header_.num_states + 1;
+    edge_next_ = edge_word_ + header_.num_edges;
+    edge_threshold_ = edge_next_ + header_.num_edges;
+    edge_alias_ = edge_threshold_ + header_.num_edges;
+    widths_ = reinterpret_cast<const std::uint8_t*>(edge_alias_ + header_.num_edges);
+    text_ = reinterpret_cast<const char*>(widths_ + header_.num_words);
+
+    if (header_.num_states == 0 || word_offsets_[header_.num_words] != header_.text_size
+        || row_offsets_[header_.num_states] != header_.num_edges) {
+      return false;
+    }
+    for (std::uint32_t w = 0; w < header_.num_words; ++w) {
+      if (word_offsets_[w] > word_offsets_[w + 1]) {
+        return false;
+      }
+    }
+    for (std::uint32_t s = 0; s < header_.num_states; ++s) {
+      if (row_offsets_[s] > row_offsets_[s + 1]) {
+        return false;
+      }
+    }
+    for (std::uint32_t e = 0; e < header_.num_edges; ++e) {
+      if (edge_word_[e] >= header_.num_words || edge_next_[e] >= header_.num_states) {
+        return false;
+      }
+    }
+    for (std::uint32_t s = 0; s < header_.num_states; ++s) {
+      for (auto e = row_offsets_[s]; e < row_offsets_[s + 1]; ++e) {
+        if (edge_alias_[e] >= row_offsets_[s + 1] - row_offsets_[s]) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  bool train(const std::string& corpus, std::uint32_t order, const struct stat& st) {
+    /// Intern every word of the corpus
+    std::unordered_map<std::string, std::uint32_t> ids;
+    std::vector<std::uint32_t> tokens;
+    std::string text;
+    std::vector<std::uint32_t> word_offsets{0};
+    {
+      std::ifstream file(corpus);
+      std::string word;
+      while (file >> word) {
+        const auto it = ids.emplace(word, static_cast<std::uint32_t>(word_offsets.size() - 1));
+        if (it.second) {
+          text += word;
+          word_offsets.push_back(static_cast<std::uint32_t>(text.size()));
+        }
+        tokens.push_back(it.first->second);
+      }
+    }
+    if (tokens.size() <= order) {
+      return false;
+    }
+    const auto num_words = static_cast<std::uint32_t>(word_offsets.size() - 1);
+
+    /// State k is the context ending at token k + order - 1
+    std::vector<std::uint32_t> state_of(tokens.size() - order + 1);
+    std::uint32_t num_states = num_words;
+    if (order == 1) {
+      std::copy(tokens.begin(), tokens.end(), state_of.begin());
+    }
+    else {
+      std::unordered_map<std::uint64_t, std::uint32_t> pairs;
+      for (std::size_t k = 0; k < state_of.size(); ++k) {
+        const auto key = (std::uint64_t(tokens[k]) << 32) | tokens[k + 1];
+        state_of[k] = pairs.emplace(key, static_cast<std::uint32_t>(pairs.size())).first->second;
+      }
+      num_states = static_cast<std::uint32_t>(pairs.size());
+    }
+
+    /// Every transition as (state, word, next state), sorted so equal
+    /// transitions are adjacent and each state's form one CSR row
+    struct transition {
+      std::uint32_t state, word, next;
+      bool operator<(const transition& o) const {
+        return state != o.state ? state < o.state : word < o.word;
+      }
+    };
+    std::vector<transition> transitions(state_of.size() - 1);
+    for (std::size_t k = 0; k + 1 < state_of.size(); ++k) {
+      transitions[k] = transition{state_of[k], tokens[k + order], state_of[k + 1]};
+    }
+    std::sort(transitions.begin(), transitions.end());
+
+    std::vector<std::uint32_t> row_offsets(std::size_t(num_states) + 1, 0);
+    std::vector<std::uint32_t> edge_word, edge_next, counts;
+    for (std::size_t k = 0; k < transitions.size(); ++k) {
+      const auto& t = transitions[k];
+      if (k > 0 && t.state == transitions[k - 1].state && t.word == transitions[k - 1].word) {
+        counts.back()++;
+        continue;
+      }
+      edge_word.push_back(t.word);
+      edge_next.push_back(t.next);
+      counts.push_back(1);
+      row_offsets[t.state + 1]++;
+    }
+    for (std::uint32_t s = 0; s < num_states; ++s) {
+      row_offsets[s + 1] += row_offsets[s];
+    }
+
+    const auto num_edges = static_cast<std::uint32_t>(edge_word.size());
+    std::vector<std::uint32_t> edge_threshold(num_edges), edge_alias(num_edges);
+    for (std::uint32_t s = 0; s < num_states; ++s) {
+      build_alias(counts.data() + row_offsets[s], row_offsets[s + 1] - row_offsets[s],
+                  edge_threshold.data() + row_offsets[s], edge_alias.data() + row_offsets[s]);
+    }
+
+    /// Lay the model out exactly as the cache file
+    markov_header header{};
+    std::memcpy(header.magic, markov_magic, sizeof(header.magic));
+    header.version = markov_version;
+    header.order = order;
+    header.num_words = num_words;
+    header.num_states = num_states;
+    header.num_edges = num_edges;
+    header.text_size = static_cast<std::uint32_t>(text.size());
+    header.source_size = static_cast<std::uint64_t>(st.st_size);
+    header.source_mtime = static_cast<std::int64_t>(st.st_mtime);
+
+    image_.clear();
+    image_.reserve(image_size(header));
+    auto append = [this](const void* data, std::size_t size) {
+      image_.insert(image_.end(), static_cast<const char*>(data), static_cast<const char*>(data) + size);
+    };
+    append(&header, sizeof(header));
+    for (const auto* table : {&word_offsets, &row_offsets, &edge_word, &edge_next, &edge_threshold, &edge_alias}) {
+      append(table->data(), table->size() * sizeof(std::uint32_t));
+    }
+    for (std::uint32_t w = 0; w < num_words; ++w) {
+      const auto width = utf8::display_width(text.substr(word_offsets[w], word_offsets[w + 1] - word_offsets[w]));
+      image_.push_back(static_cast<char>(std::min<std::size_t>(width, 255)));
+    }
+    append(text.data(), text.size());
+
+    data_ = image_.data();
+    size_ = image_.size();
+    return parse();
+  }
+
+  /// Vose's alias method over integer weights, in 32-bit fixed point
+  static void build_alias(const std::uint32_t* counts, std::uint32_t n,
+                          std::uint32_t* threshold, std::uint32_t* alias) {
+    std::uint64_t total = 0;
+    for (std::uint32_t k = 0; k < n; ++k) {
+      total += counts[k];
+    }
+
+    /// Scaled so that the average column holds exactly `total`
+    std::vector<std::uint64_t> scaled(n);
+    std::vector<std::uint32_t> small, large;
+    for (std::uint32_t k = 0; k < n; ++k) {
+      scaled[k] = std::uint64_t(counts[k]) * n;
+      alias[k] = k;
+      (scaled[k] < total ? small : large).push_back(k);
+    }
+
+    while (!small.empty() && !large.empty()) {
+      const auto s = small.back();
+      small.pop_back();
+      const auto l = large.back();
+
+      threshold[s] = static_cast<std::uint32_t>((scaled[s] << 32) / total);
+      alias[s] = l;
+      scaled[l] -= total - scaled[s];
+      if (scaled[l] < total) {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+
+    /// Whatever is left is full up to rounding: always keep it
+    for (auto k : small) {
+      threshold[k] = 0xFFFFFFFF;
+    }
+    for (auto k : large) {
+      threshold[k] = 0xFFFFFFFF;
+    }
+  }
+
+  markov_header header_{};
+  const char* data_{nullptr};
+  std::size_t size_{0};
+  bool mapped_{false};
+  std::vector<char> image_;
+
+  const std::uint32_t* word_offsets_{nullptr};
+  const std::uint32_t* row_offsets_{nullptr};
+  const std::uint32_t* edge_word_{nullptr};
+  const std::uint32_t* edge_next_{nullptr};
+  const std::uint32_t* edge_threshold_{nullptr};
+  const std::uint32_t* edge_alias_{nullptr};
+  const std::uint8_t* widths_{nullptr};
+  const char* text_{nullptr};
+};
+
+#endif // TTT_MARKOV_HPP_
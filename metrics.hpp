@@ -0,0 +1,441 @@
+#ifndef TTT_METRICS_HPP_
+#define TTT_METRICS_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "unix_socket.hpp"
+
+/// Live and final metrics of the typing loop, for a scraper
+///
+/// Every thread that counts something gets a slot of its own and is the
+/// only one to write it, with plain relaxed stores: no locks and no
+/// shared cache lines on the typing loop. A scrape reads every slot and
+/// adds them up.
+
+/// Echo latencies go in power-of-two buckets of microseconds: bucket b
+/// holds latencies below 2^b us, the last one everything longer
+constexpr std::size_t metrics_latency_buckets = 25;
+
+/// Threads that can count at once; any more share the last slot's
+/// counts, racing on them
+constexpr std::size_t metrics_max_threads = 16;
+
+struct alignas(64) metrics_slot {
+  std::atomic<std::uint64_t> keystrokes{0};
+  std::atomic<std::uint64_t> mistakes{0};
+  std::atomic<std::uint64_t> tests{0};
+  std::atomic<std::uint64_t> render_bytes{0};
+  std::atomic<std::uint64_t> writes{0};
+  std::atomic<std::uint64_t> latency_sum_us{0};
+  std::atomic<std::uint64_t> latency[metrics_latency_buckets];
+
+  /// The test under way, or the last one: when it last changed, so the
+  /// newest wins on a scrape, and where it stands
+  std::atomic<std::uint64_t> updated{0};
+  std::atomic<std::uint64_t> running{0};
+  std::atomic<std::uint64_t> position{0};
+  std::atomic<std::uint64_t> elapsed_us{0};
+  std::atomic<std::uint64_t> test_keys{0};
+  std::atomic<std::uint64_t> test_mistakes{0};
+  std::atomic<std::uint64_t> final_wpm{0};        // hundredths
+  std::atomic<std::uint64_t> final_accuracy{0};   // hundredths of a percent
+
+  metrics_slot() {
+    for (auto& b : latency) {
+      b.store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+namespace metrics_detail {
+
+/// Only the owning thread writes a slot, so an increment needs no
+/// atomic read-modify-write
+inline void add(std::atomic<std::uint64_t>& counter, std::uint64_t by) {
+  counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+inline void set(std::atomic<std::uint64_t>& gauge, std::uint64_t value) {
+  gauge.store(value, std::memory_order_relaxed);
+}
+
+inline std::uint64_t now_us() {
+  return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+struct registry {
+  metrics_slot slots[metrics_max_threads];
+  std::atomic<std::size_t> used{0};
+};
+
+inline registry& global() {
+  static registry r;
+  return r;
+}
+
+inline metrics_slot* claim() {
+  auto& r = global();
+  const auto k = r.used.fetch_add(1, std::memory_order_relaxed);
+  return &r.slots[std::min(k, metrics_max_threads - 1)];
+}
+
+}
+
+/// The calling thread's own counters
+class thread_metrics {
+public:
+  explicit thread_metrics(metrics_slot& slot) : slot_(slot) {}
+
+  void started() {
+    using namespace metrics_detail;
+    set(slot_.position, 0);
+    set(slot_.elapsed_us, 0);
+    set(slot_.test_keys, 0);
+    set(slot_.test_mistakes, 0);
+    set(slot_.running, 1);
+    set(slot_.updated, now_us());
+  }
+
+  /// A key was scored: glyph `position` of the passage is next, `elapsed_us`
+  /// into the test
+  void keyed(bool mistake, std::uint64_t position, std::uint64_t elapsed_us) {
+    using namespace metrics_detail;
+    add(slot_.keystrokes, 1);
+    add(slot_.test_keys, 1);
+    if (mistake) {
+      add(slot_.mistakes, 1);
+      add(slot_.test_mistakes, 1);
+    }
+    set(slot_.position, position);
+    set(slot_.elapsed_us, elapsed_us);
+  }
+
+  void finished(double wpm, double accuracy) {
+    using namespace metrics_detail;
+    add(slot_.tests, 1);
+    set(slot_.final_wpm, static_cast<std::uint64_t>(std::max(wpm, 0.0) * 100 + 0.5));
+    set(slot_.final_accuracy, static_cast<std::uint64_t>(std::max(accuracy, 0.0) * 100 + 0.5));
+    set(slot_.running, 0);
+    set(slot_.updated, now_us());
+  }
+
+  /// `bytes` were drawn, with `writes` system calls
+  void rendered(std::uint64_t bytes, std::uint64_t writes) {
+    metrics_detail::add(slot_.render_bytes, bytes);
+    metrics_detail::add(slot_.writes, writes);
+  }
+
+  /// A key reached the screen `us` microseconds after it was read
+  void echoed(std::uint64_t us) {
+    std::size_t b = 0;
+    while (b + 1 < metrics_latency_buckets && us >= (std::uint64_t(1) << b)) {
+      b++;
+    }
+    metrics_detail::add(slot_.latency[b], 1);
+    metrics_detail::add(slot_.latency_sum_us, us);
+  }
+
+private:
+  metrics_slot& slot_;
+};
+
+inline thread_metrics& local_metrics() {
+  thread_local thread_metrics metrics(*metrics_detail::claim());
+  return metrics;
+}
+
+/// Every slot added up, as of one scrape
+struct metrics_snapshot {
+  std::uint64_t keystrokes{0};
+  std::uint64_t mistakes{0};
+  std::uint64_t tests{0};
+  std::uint64_t render_bytes{0};
+  std::uint64_t writes{0};
+  std::uint64_t latency_count{0};
+  std::uint64_t latency_sum_us{0};
+  std::uint64_t latency[metrics_latency_buckets]{};
+  std::size_t threads{0};
+
+  /// Of the latest test: live while it runs, final once it is over
+  bool running{false};
+  double wpm{0};
+  double accuracy{100};
+
+  /// Latency quantile q in microseconds, interpolated within its bucket
+  double latency_us(double q) const {
+    if (latency_count == 0) {
+      return 0;
+    }
+    const double rank = q * static_cast<double>(latency_count);
+    double below = 0;
+    for (std::size_t b = 0; b < metrics_latency_buckets; ++b) {
+      const auto in = static_cast<double>(latency[b]);
+      if (in > 0 && below + in >= rank) {
+        const double low = b == 0 ? 0 : static_cast<double>(std::uint64_t(1) << (b - 1));
+        const double high = static_cast<double>(std::uint64_t(1) << b);
+        return low + (high - low) * (rank - below) / in;
+      }
+      below += in;
+    }
+    return static_cast<double>(std::uint64_t(1) << (metrics_latency_buckets - 1));
+  }
+};
+
+inline metrics_snapshot scrape_metrics() {
+  auto& r = metrics_detail::global();
+  metrics_snapshot s;
+  s.threads = std::min(r.used.load(std::memory_order_relaxed), metrics_max_threads);
+
+  std::uint64_t newest = 0;
+  for (std::size_t t = 0; t < s.threads; ++t) {
+    const auto& slot = r.slots[t];
+    auto get = [](const std::atomic<std::uint64_t>& a) { return a.load(std::memory_order_relaxed); };
+    s.keystrokes += get(slot.keystrokes);
+    s.mistakes += get(slot.mistakes);
+    s.tests += get(slot.tests);
+    s.render_bytes += get(slot.render_bytes);
+    s.writes += get(slot.writes);
+    s.latency_sum_us += get(slot.latency_sum_us);
+    for (std::size_t b = 0; b < metrics_latency_buckets; ++b) {
+      s.latency[b] += get(slot.latency[b]);
+      s.latency_count += get(slot.latency[b]);
+    }
+
+    const auto updated = get(slot.updated);
+    if (updated == 0 || updated < newest) {
+      continue;
+    }
+    newest = updated;
+    s.running = get(slot.running) != 0;
+    if (s.running) {
+      /// Five glyphs to the word, as of the last key
+      const auto elapsed = get(slot.elapsed_us);
+      s.wpm = elapsed > 0 ? get(slot.position) / 5.0 / (elapsed / 60e6) : 0;
+      const auto keys = get(slot.test_keys);
+      s.accuracy = keys > 0 ? 100.0 * (keys - get(slot.test_mistakes)) / keys : 100;
+    }
+    else {
+      s.wpm = get(slot.final_wpm) / 100.0;
+      s.accuracy = get(slot.final_accuracy) / 100.0;
+    }
+  }
+  return s;
+}
+
+/// The Prometheus text exposition format
+inline std::string format_prometheus(const metrics_snapshot& s) {
+  std::ostringstream out;
+  auto metric = [&](const char* name, const char* type, const char* help, double value) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " " << type << "\n"
+        << name << " " << value << "\n";
+  };
+  metric("ttt_keystrokes_total", "counter", "Keystrokes scored.", double(s.keystrokes));
+  metric("ttt_mistakes_total", "counter", "Keystrokes that did not match the text.", double(s.mistakes));
+  metric("ttt_tests_total", "counter", "Tests finished.", double(s.tests));
+  metric("ttt_render_bytes_total", "counter", "Bytes drawn to the terminal.", double(s.render_bytes));
+  metric("ttt_write_syscalls_total", "counter", "write() calls that drew to the terminal.", double(s.writes));
+  metric("ttt_test_running", "gauge", "1 while a test is under way.", s.running ? 1 : 0);
+  metric("ttt_wpm", "gauge", "Speed of the latest test, live while it runs.", s.wpm);
+  metric("ttt_accuracy_percent", "gauge", "Accuracy of the latest test, live while it runs.", s.accuracy);
+  metric("ttt_metrics_threads", "gauge", "Threads counting metrics.", double(s.threads));
+
+  out << "# HELP ttt_echo_latency_seconds Time from reading a key to the write that showed it.\n"
+      << "# TYPE ttt_echo_latency_seconds summary\n";
+  for (const auto q : {0.5, 0.9, 0.99}) {
+    out << "ttt_echo_latency_seconds{quantile=\"" << q << "\"} " << s.latency_us(q) / 1e6 << "\n";
+  }
+  out << "ttt_echo_latency_seconds_sum " << s.latency_sum_us / 1e6 << "\n"
+      << "ttt_echo_latency_seconds_count " << s.latency_count << "\n";
+  return out.str();
+}
+
+inline std::string format_json(const metrics_snapshot& s) {
+  std::ostringstream out;
+  out << "{\"keystrokes\":" << s.keystrokes
+      << ",\"mistakes\":" << s.mistakes
+      << ",\"tests\":" << s.tests
+      << ",\"render_bytes\":" << s.render_bytes
+      << ",\"write_syscalls\":" << s.writes
+      << ",\"test_running\":" << (s.running ? "true" : "false")
+      << ",\"wpm\":" << s.wpm
+      << ",\"accuracy_percent\":" << s.accuracy
+      << ",\"threads\":" << s.threads
+      << ",\"echo_latency_us\":{\"count\":" << s.latency_count
+      << ",\"sum\":" << s.latency_sum_us
+      << ",\"p50\":" << s.latency_us(0.5)
+      << ",\"p90\":" << s.latency_us(0.9)
+      << ",\"p99\":" << s.latency_us(0.99) << "}}\n";
+  return out.str();
+}
+
+/// JSON for paths ending in .json, Prometheus text otherwise
+inline std::string format_metrics(const metrics_snapshot& s, const std::string& path) {
+  const bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+  return json ? format_json(s) : format_prometheus(s);
+}
+
+/// Publishes the metrics from a thread of its own: on a Unix socket, one
+/// scrape per connection, and in a file rewritten atomically once a
+/// second and once more when it stops
+///
+/// The socket speaks enough HTTP for `curl --unix-socket <path>
+/// http://localhost/metrics` (or /metrics.json). A client that sends
+/// anything else gets the bare body: JSON if the first line is "json",
+/// Prometheus text otherwise.
+class metrics_exporter {
+public:
+  metrics_exporter(const std::string& socket_path, const std::string& file_path)
+    : socket_path_(socket_path), file_path_(file_path) {}
+
+  ~metrics_exporter() {
+    if (thread_.joinable()) {
+      const char byte = 0;
+      if (::write(stop_[1], &byte, 1) < 0) {
+        /// The thread is gone already
+      }
+      thread_.join();
+    }
+    if (!file_path_.empty()) {
+      write_file();
+    }
+    if (listener_ >= 0) {
+      ::close(listener_);
+      ::unlink(socket_path_.c_str());
+    }
+    if (stop_[0] >= 0) {
+      ::close(stop_[0]);
+      ::close(stop_[1]);
+    }
+  }
+
+  metrics_exporter(const metrics_exporter&) = delete;
+  metrics_exporter& operator=(const metrics_exporter&) = delete;
+
+  /// Start publishing; false if the socket cannot be served
+  bool start() {
+    if (!socket_path_.empty() && !listen()) {
+      return false;
+    }
+    if (::pipe2(stop_, O_CLOEXEC) < 0) {
+      return false;
+    }
+    thread_ = std::thread([this] { run(); });
+    return true;
+  }
+
+private:
+  bool listen() {
+    listener_ = listen_unix(socket_path_, SOCK_STREAM, 16);
+    return listener_ >= 0;
+  }
+
+  void run() {
+    auto next_file = std::chrono::steady_clock::now();
+    while (true) {
+      if (!file_path_.empty() && std::chrono::steady_clock::now() >= next_file) {
+        write_file();
+        next_file += std::chrono::seconds(1);
+      }
+      const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+        next_file - std::chrono::steady_clock::now()).count();
+
+      struct pollfd fds[2] = {{stop_[0], POLLIN, 0}, {listener_, POLLIN, 0}};
+      const int ready = ::poll(fds, 2, file_path_.empty() ? -1 : static_cast<int>(std::max<long long>(wait, 0)));
+      if (ready < 0 && errno != EINTR) {
+        return;
+      }
+      if (fds[0].revents) {
+        return;
+      }
+      if (fds[1].revents & POLLIN) {
+        const int client = ::accept4(listener_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client >= 0) {
+          serve(client);
+          ::close(client);
+        }
+      }
+    }
+  }
+
+  /// Answer one scrape. The request is whatever arrives within a short
+  /// wait, so a client that sends nothing still gets Prometheus text.
+  void serve(int client) {
+    char request[512];
+    std::size_t size = 0;
+    struct pollfd fd = {client, POLLIN, 0};
+    while (size < sizeof(request) - 1 && ::poll(&fd, 1, 100) > 0) {
+      const auto got = ::read(client, request + size, sizeof(request) - 1 - size);
+      if (got <= 0) {
+        break;
+      }
+      size += static_cast<std::size_t>(got);
+      if (std::memchr(request, '\n', size)) {
+        break;
+      }
+    }
+    const std::string first_line(request, std::find(request, request + size, '\n'));
+
+    const auto snapshot = scrape_metrics();
+    std::string response;
+    if (first_line.compare(0, 4, "GET ") == 0) {
+      const auto path = first_line.substr(4, first_line.find(' ', 4) - 4);
+      const bool json = path.find(".json") != std::string::npos || path.find("format=json") != std::string::npos;
+      const auto body = json ? format_json(snapshot) : format_prometheus(snapshot);
+      response = "HTTP/1.0 200 OK\r\nContent-Type: "
+        + std::string(json ? "application/json" : "text/plain; version=0.0.4")
+        + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    }
+    else {
+      const bool json = first_line.compare(0, 4, "json") == 0;
+      response = json ? format_json(snapshot) : format_prometheus(snapshot);
+    }
+
+    std::size_t sent = 0;
+    while (sent < response.size()) {
+      const auto n = ::send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        return;
+      }
+      sent += static_cast<std::size_t>(n);
+    }
+  }
+
+  void write_file() {
+    const auto temporary = file_path_ + ".tmp";
+    {
+      std::ofstream file(temporary, std::ios::binary);
+      file << format_metrics(scrape_metrics(), file_path_);
+      if (!file) {
+        return;
+      }
+    }
+    std::rename(temporary.c_str(), file_path_.c_str());
+  }
+
+  std::string socket_path_;
+  std::string file_path_;
+  int listener_{-1};
+  int stop_[2]{-1, -1};
+  std::thread thread_;
+};
+
+#endif // TTT_METRICS_HPP_
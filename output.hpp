@@ -0,0 +1,191 @@
+#ifndef TTT_OUTPUT_HPP_
+#define TTT_OUTPUT_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "metrics.hpp"
+#include "trace.hpp"
+
+/// Collects what is written to a stream until the next frame goes out
+///
+/// Install it with std::cout.rdbuf() so code that prints with iostreams
+/// fills a frame instead of the terminal. A few bytes are kept free in
+/// front of the frame, so prepend() copies into place rather than
+/// moving the frame or building a new one.
+class frame_buffer : public std::streambuf {
+public:
+  frame_buffer() { clear(); }
+
+  const char* data() const { return data_.data() + begin_; }
+
+  std::size_t size() const { return data_.size() - begin_; }
+
+  void clear() {
+    data_.assign(headroom, '\0');
+    begin_ = headroom;
+  }
+
+  void reserve(std::size_t bytes) { data_.reserve(headroom + bytes); }
+
+  /// Put `size` bytes in front of the frame; at most `headroom` in all
+  /// until the next clear()
+  void prepend(const char* text, std::size_t size) {
+    size = std::min(size, begin_);
+    begin_ -= size;
+    std::copy(text, text + size, &data_[begin_]);
+  }
+
+  enum : std::size_t { headroom = 32 };
+
+protected:
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      data_.push_back(traits_type::to_char_type(c));
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char* s, std::streamsize n) override {
+    data_.append(s, static_cast<std::size_t>(n));
+    return n;
+  }
+
+private:
+  std::string data_;
+  std::size_t begin_{headroom};
+};
+
+/// How soon a change has to reach the screen
+enum class urgency {
+  feedback,   // the cursor and the colour of what was just typed
+  status,     // panels, ghosts and other things that update by themselves
+};
+
+/// What went out to the terminal, for --frame-stats
+struct frame_stats {
+  std::size_t frames{0};
+  std::size_t echoes{0};
+  std::size_t bytes{0};
+  std::size_t largest{0};
+
+  /// For every keystroke drawn, microseconds from the view being told
+  /// about it to the write that put it on the screen
+  std::vector<std::uint32_t> echo_us;
+};
+
+/// Decides when the changes drawn so far go out as one frame
+///
+/// Every frame is one write, so over SSH one packet rather than one per
+/// escape sequence or keystroke. Feedback goes out at once if the last
+/// frame is older than 1/fps, so a lone keystroke echoes immediately,
+/// and otherwise waits for that, so a burst is batched. Status changes
+/// alone go out at a quarter of that rate and ride along with feedback
+/// frames whenever there are some. An fps of 0 means no cap.
+class frame_scheduler {
+public:
+  using clock = std::chrono::steady_clock;
+
+  explicit frame_scheduler(unsigned fps)
+    : interval_(fps > 0 ? std::chrono::duration_cast<clock::duration>(std::chrono::seconds(1)) / fps
+                        : clock::duration::zero()) {}
+
+  /// Something of this urgency has been drawn and wants a frame
+  void mark(urgency level) {
+    const int divisor = level == urgency::feedback ? 1 : status_divisor;
+    const auto wait = interval_ * divisor;
+    const auto due = std::max(last_ + wait, clock::now());
+    if (!pending_ || due < due_) {
+      due_ = due;
+    }
+    pending_ = true;
+  }
+
+  bool pending() const { return pending_; }
+
+  /// Milliseconds until the pending frame should go out, 0 if it is due
+  /// now, -1 if there is none. Rounded up so a poll() never wakes early.
+  int due_in_ms() const {
+    if (!pending_) {
+      return -1;
+    }
+    const auto left = due_ - clock::now();
+    if (left <= clock::duration::zero()) {
+      return 0;
+    }
+    return static_cast<int>((std::chrono::duration_cast<std::chrono::microseconds>(left).count() + 999) / 1000);
+  }
+
+  /// Make room to time up to `keys` keystrokes without allocating
+  void reserve(std::size_t keys) {
+    stats_.echo_us.reserve(keys);
+    unpainted_.reserve(keys);
+  }
+
+  /// Start over for another test, keeping the room made by reserve()
+  void reset() {
+    last_ = clock::time_point{};
+    due_ = clock::time_point{};
+    pending_ = false;
+    unpainted_.clear();
+    stats_.frames = stats_.echoes = stats_.bytes = stats_.largest = 0;
+    stats_.echo_us.clear();
+  }
+
+  /// A keystroke has been drawn into the pending frame
+  void keyed() {
+    unpainted_.push_back(clock::now());
+  }
+
+  /// The last keystroke drawn went out on its own, ahead of its frame,
+  /// in `bytes`
+  void echoed(std::size_t bytes) {
+    stats_.echoes++;
+    stats_.bytes += bytes;
+    if (!unpainted_.empty()) {
+      painted(unpainted_.back(), clock::now());
+      unpainted_.pop_back();
+    }
+  }
+
+  /// A frame of `bytes` went out
+  void presented(std::size_t bytes) {
+    pending_ = false;
+    last_ = clock::now();
+    for (const auto& t : unpainted_) {
+      painted(t, last_);
+    }
+    unpainted_.clear();
+    if (bytes > 0) {
+      stats_.frames++;
+      stats_.bytes += bytes;
+      stats_.largest = std::max(stats_.largest, bytes);
+    }
+  }
+
+  const frame_stats& stats() const { return stats_; }
+
+private:
+  static constexpr int status_divisor = 4;
+
+  void painted(clock::time_point keyed, clock::time_point now) {
+    const auto us = std::chrono::duration_cast<std::chrono::microseconds>(now - keyed).count();
+    TTT_TRACE_INSTANT("echo us", us);
+    local_metrics().echoed(static_cast<std::uint64_t>(us));
+    stats_.echo_us.push_back(static_cast<std::uint32_t>(us));
+  }
+
+  clock::duration interval_;
+  clock::time_point last_{};
+  clock::time_point due_{};
+  bool pending_{false};
+  std::vector<clock::time_point> unpainted_;
+  frame_stats stats_;
+};
+
+#endif // TTT_OUTPUT_HPP_
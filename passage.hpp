@@ -0,0 +1,472 @@
+#ifndef TTT_PASSAGE_HPP_
+#define TTT_PASSAGE_HPP_
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "sampling.hpp"
+#include "utf8.hpp"
+#include "word_table.hpp"
+
+/// The text of one test, tokenised once into a single contiguous buffer
+///
+/// Lines are stored back to back in `text`. Code lines keep their
+/// trailing '\n', which the user types with Enter, and their leading
+/// indentation, which is skipped automatically.
+///
+/// Generated word tests are stored as the ids of their words in a
+/// shared word_table instead, with the first word of each line. A line
+/// is spelled out when it is shown, and the whole text only once the
+/// test is over, by materialize().
+struct passage {
+  std::string text;
+
+  /// Byte offset where each line starts, plus one past the end
+  std::vector<std::uint32_t> line_offsets{0};
+
+  /// Number of leading glyphs of each line that the user does not type
+  std::vector<std::uint32_t> indents;
+
+  bool ascii{true};
+
+  /// Interned id of each word. For a passage stored as words these are
+  /// its text: every word but the last is followed by one space.
+  std::vector<std::uint32_t> word_ids;
+
+  /// The table `word_ids` index when they are the stored form
+  const word_table* table{nullptr};
+
+  /// First word of each line, plus one past the last, when stored as
+  /// words
+  std::vector<std::uint32_t> line_words{0};
+
+  /// Where each word starts, plus one past the end. A word owns the
+  /// spaces after it, so words tile the text whatever the layout.
+  std::vector<std::uint32_t> word_offsets;
+
+  bool stored_as_words() const { return table != nullptr; }
+
+  std::size_t num_lines() const { return stored_as_words() ? line_words.size() - 1 : indents.size(); }
+
+  std::size_t indent(std::size_t n) const { return stored_as_words() ? 0 : indents[n]; }
+
+  /// Line n of the text, which a passage stored as words only has once
+  /// materialized
+  const char* line_data(std::size_t n) const { return text.data() + line_offsets[n]; }
+
+  std::size_t line_size(std::size_t n) const { return line_offsets[n + 1] - line_offsets[n]; }
+
+  std::string line(std::size_t n) const { return std::string(line_data(n), line_size(n)); }
+
+  /// Spell out line n into `out`, reusing its buffer
+  void line_text(std::size_t n, std::string& out) const {
+    if (!stored_as_words()) {
+      out.assign(line_data(n), line_size(n));
+      return;
+    }
+    out.clear();
+    append_words(n, out);
+  }
+
+  /// Glyphs of line n, and of the whole passage
+  std::size_t line_glyphs(std::size_t n) const {
+    if (!stored_as_words()) {
+      return ascii ? line_size(n) : utf8::glyph_count(line_data(n), line_size(n));
+    }
+    std::size_t result = 0;
+    for (auto w = line_words[n]; w < line_words[n + 1]; ++w) {
+      result += word_glyphs(w);
+    }
+    return result;
+  }
+
+  std::size_t glyphs() const {
+    if (!stored_as_words()) {
+      return ascii ? text.size() : utf8::glyph_count(text);
+    }
+    std::size_t result = 0;
+    for (std::size_t w = 0; w < word_ids.size(); ++w) {
+      result += word_glyphs(w);
+    }
+    return result;
+  }
+
+  /// Display width of line n
+  std::size_t line_width(std::size_t n) const {
+    if (!stored_as_words()) {
+      return utf8::display_width(line(n));
+    }
+    std::size_t result = 0;
+    for (auto w = line_words[n]; w < line_words[n + 1]; ++w) {
+      result += word_width(w);
+    }
+    return result;
+  }
+
+  /// Glyphs and display width of word w of a passage stored as words,
+  /// its trailing space included
+  std::size_t word_glyphs(std::size_t w) const {
+    const auto id = word_ids[w];
+    const auto glyphs = ascii ? table->size(id) : utf8::glyph_count(table->data(id), table->size(id));
+    return glyphs + (w + 1 < word_ids.size() ? 1 : 0);
+  }
+
+  std::size_t word_width(std::size_t w) const {
+    return table->width(word_ids[w]) + (w + 1 < word_ids.size() ? 1 : 0);
+  }
+
+  void add_line(const std::string& line, std::size_t indent = 0) {
+    text += line;
+    line_offsets.push_back(static_cast<std::uint32_t>(text.size()));
+    indents.push_back(static_cast<std::uint32_t>(indent));
+  }
+
+  void clear() {
+    text.clear();
+    line_offsets.assign(1, 0);
+    indents.clear();
+    ascii = true;
+    word_ids.clear();
+    table = nullptr;
+    line_words.assign(1, 0);
+    word_offsets.clear();
+  }
+
+  /// Spell out the text, line offsets and indents of a passage stored
+  /// as words, for scoring, the logs and per-glyph statistics
+  void materialize() {
+    if (!stored_as_words()) {
+      return;
+    }
+    text.clear();
+    line_offsets.assign(1, 0);
+    for (std::size_t n = 0; n < num_lines(); ++n) {
+      append_words(n, text);
+      line_offsets.push_back(static_cast<std::uint32_t>(text.size()));
+    }
+    indents.assign(num_lines(), 0);
+  }
+
+  /// Prose can be laid out again for another width: nothing is indented
+  /// and no line ends in a typed newline. Code keeps its layout.
+  bool reflowable() const {
+    if (stored_as_words()) {
+      return true;
+    }
+    for (auto indent : indents) {
+      if (indent > 0) {
+        return false;
+      }
+    }
+    return text.find('\n') == std::string::npos;
+  }
+
+  /// Find the word boundaries once, for reflow() and intern_words()
+  void index_words() {
+    word_offsets.clear();
+    std::size_t k = 0;
+    while (k < text.size()) {
+      word_offsets.push_back(static_cast<std::uint32_t>(k));
+      bool spaces = false;
+      while (k < text.size() && (!spaces || text[k] == ' ')) {
+        spaces = spaces || text[k] == ' ';
+        k++;
+      }
+    }
+    word_offsets.push_back(static_cast<std::uint32_t>(text.size()));
+  }
+
+  /// Break the text into lines narrower than `cols` again, in one pass
+  /// over the words. A word too wide for any line gets one to itself.
+  void reflow(unsigned short cols) {
+    const std::size_t limit = cols > 1 ? cols - 1 : 1;
+    std::size_t width = 0;
+
+    if (stored_as_words()) {
+      line_words.assign(1, 0);
+      for (std::size_t w = 0; w < word_ids.size(); ++w) {
+        const auto word = word_width(w);
+        if (width > 0 && width + word > limit) {
+          line_words.push_back(static_cast<std::uint32_t>(w));
+          width = 0;
+        }
+        width += word;
+      }
+      line_words.push_back(static_cast<std::uint32_t>(word_ids.size()));
+      return;
+    }
+
+    if (word_offsets.empty()) {
+      index_words();
+    }
+    line_offsets.assign(1, 0);
+    for (std::size_t w = 0; w + 1 < word_offsets.size(); ++w) {
+      const auto begin = word_offsets[w];
+      const auto end = word_offsets[w + 1];
+      std::size_t word = ascii ? end - begin : 0;
+      for (std::size_t k = begin; !ascii && k < end;) {
+        word += utf8::width(utf8::decode(text.data(), end, k));
+      }
+      if (width > 0 && width + word > limit) {
+        line_offsets.push_back(begin);
+        width = 0;
+      }
+      width += word;
+    }
+    line_offsets.push_back(static_cast<std::uint32_t>(text.size()));
+    indents.assign(line_offsets.size() - 1, 0);
+  }
+
+private:
+  void append_words(std::size_t n, std::string& out) const {
+    for (auto w = line_words[n]; w < line_words[n + 1]; ++w) {
+      out.append(table->data(word_ids[w]), table->size(word_ids[w]));
+      if (w + 1 < word_ids.size()) {
+        out += ' ';
+      }
+    }
+  }
+};
+
+/// Replace tabs with spaces and drop trailing whitespace
+inline std::string normalise_code_line(const std::string& raw, std::size_t tab_width = 4) {
+  std::string result;
+  result.reserve(raw.size());
+  for (auto c : raw) {
+    if (c == '\t') {
+      result.append(tab_width - result.size() % tab_width, ' ');
+    }
+    else if (c != '\r') {
+      result += c;
+    }
+  }
+  while (!result.empty() && result.back() == ' ') {
+    result.pop_back();
+  }
+  return result;
+}
+
+inline std::size_t leading_spaces(const std::string& str) {
+  std::size_t result{0};
+  while (result < str.size() && str[result] == ' ') {
+    result++;
+  }
+  return result;
+}
+
+/// Word-wrap `str` into lines narrower than `cols`
+///
+/// Every line but the last keeps its trailing space, so the user types
+/// across line breaks exactly as in word mode. Wrapped continuation
+/// lines inherit `indent` so code stays aligned. A trailing '\n' takes
+/// a column, as its marker does on screen, and never ends up on a line
+/// of its own: the glyph before it moves down with it.
+inline void wrap_into(passage& result, const std::string& str, unsigned short cols, std::size_t indent = 0) {
+  const std::size_t limit = cols > 1 ? cols - 1 : 1;
+
+  /// Indentation deeper than half a line would leave little to type;
+  /// keep only that much of it
+  std::size_t begin = 0;
+  if (indent > limit / 2) {
+    begin = indent - limit / 2;
+    indent = limit / 2;
+  }
+  const std::size_t first = begin;
+
+  while (begin < str.size()) {
+    std::size_t end = begin;
+    std::size_t last_break = std::string::npos;
+    std::size_t last_glyph = std::string::npos;
+    std::size_t width = (begin == first) ? 0 : indent;
+    const std::size_t typed_from = begin + (begin == first ? indent : 0);
+
+    while (end < str.size() && width < limit) {
+      if (str[end] == ' ' && end > begin) {
+        last_break = end;
+      }
+      std::size_t next = end;
+      const auto cp = utf8::decode(str.data(), str.size(), next);
+      const auto w = (cp == '\n') ? 1 : utf8::width(cp);
+      if (w > 0 && end >= typed_from) {
+        last_glyph = end;
+      }
+      width += w;
+      end = next;
+    }
+
+    if (end < str.size() && last_break != std::string::npos && last_break > typed_from) {
+      end = last_break + 1;
+    }
+    else if (end + 1 == str.size() && str[end] == '\n') {
+      /// Only the newline is left over
+      end = (last_glyph != std::string::npos && last_glyph > typed_from) ? last_glyph : str.size();
+    }
+
+    if (begin == first) {
+      result.add_line(str.substr(begin, end - begin), indent);
+    }
+    else {
+      result.add_line(std::string(indent, ' ') + str.substr(begin, end - begin), indent);
+    }
+    begin = end;
+  }
+}
+
+/// Reads lines from a corpus file on demand instead of loading it whole
+///
+/// Corpora (quote collections, whole source trees concatenated together)
+/// can be many MB, so only the chunk around the requested offset is read.
+class corpus_reader {
+public:
+  explicit corpus_reader(const std::string& path) : file_(path, std::ios::binary) {
+    if (file_) {
+      file_.seekg(0, std::ios::end);
+      size_ = static_cast<std::size_t>(file_.tellg());
+      file_.seekg(0);
+    }
+  }
+
+  bool good() const { return size_ > 0; }
+
+  std::size_t size() const { return size_; }
+
+  /// Append up to `count` whole lines starting at the first line
+  /// boundary at or after `offset`, wrapping around at end of file
+  ///
+  /// Returns the offset to pass next time to carry on with the line
+  /// after the last one read.
+  std::size_t read_lines(std::size_t offset, std::size_t count, std::vector<std::string>& out) {
+    std::string partial;
+    bool synced = (offset == 0);
+    bool wrapped = false;
+    std::size_t added = 0;
+    std::size_t base = offset;
+    std::size_t resume = offset;
+
+    file_.clear();
+    file_.seekg(static_cast<std::streamoff>(offset));
+
+    while (added < count) {
+      file_.read(buffer_, sizeof(buffer_));
+      const auto got = static_cast<std::size_t>(file_.gcount());
+
+      for (std::size_t k = 0; k < got && added < count; ++k) {
+        if (buffer_[k] != '\n') {
+          partial += buffer_[k];
+          continue;
+        }
+        if (synced) {
+          out.push_back(partial);
+          added++;
+          resume = base + k;
+        }
+        synced = true;
+        partial.clear();
+      }
+      base += got;
+
+      if (got < sizeof(buffer_)) {
+        /// End of file
+        if (synced && !partial.empty() && added < count) {
+          out.push_back(partial);
+          added++;
+          resume = 0;
+        }
+        if (wrapped || added >= count) {
+          break;
+        }
+        wrapped = true;
+        synced = true;
+        base = 0;
+        partial.clear();
+        file_.clear();
+        file_.seekg(0);
+      }
+    }
+
+    /// A newline that ends the file leads back to the start
+    return resume + 1 >= size_ ? 0 : resume;
+  }
+
+private:
+  std::ifstream file_;
+  std::size_t size_{0};
+  char buffer_[64 * 1024];
+};
+
+/// Pick one quote (one per line) from a quotes file into `result`,
+/// reusing its buffers
+///
+/// Quotes are chosen by seeking to a uniformly random byte offset and
+/// taking the next whole line, so a quote's chance of being picked is
+/// proportional to the length of the quote before it.
+inline void load_quote(corpus_reader& reader, counter_rng& gen, unsigned short cols, passage& result) {
+  result.clear();
+
+  std::vector<std::string> lines;
+  for (std::size_t attempt = 0; attempt < 16 && result.num_lines() == 0; ++attempt) {
+    lines.clear();
+    reader.read_lines(bounded(gen, reader.size()), 1, lines);
+    if (!lines.empty()) {
+      auto quote = normalise_code_line(lines[0]);
+      quote.erase(0, leading_spaces(quote));
+      wrap_into(result, quote, cols);
+    }
+  }
+
+  result.ascii = utf8::is_ascii(result.text);
+}
+
+/// Pick a snippet of consecutive non-blank lines from a source file
+/// into `result`, reusing its buffers
+inline void load_code(corpus_reader& reader, counter_rng& gen, unsigned short cols, std::size_t num_lines,
+                      passage& result) {
+  result.clear();
+
+  std::vector<std::string> lines;
+  for (std::size_t attempt = 0; attempt < 16 && result.num_lines() == 0; ++attempt) {
+    lines.clear();
+    /// Over-read so that skipped blank lines still leave a full snippet
+    reader.read_lines(bounded(gen, reader.size()), num_lines * 4, lines);
+
+    std::size_t added = 0;
+    for (const auto& raw : lines) {
+      if (added == num_lines) {
+        break;
+      }
+      auto line = normalise_code_line(raw);
+      if (line.empty()) {
+        continue;
+      }
+      const auto indent = leading_spaces(line);
+      if (indent == line.size()) {
+        continue;
+      }
+      line += '\n';
+      wrap_into(result, line, cols, indent);
+      added++;
+    }
+  }
+
+  /// Nothing follows the final line, and a final line left with
+  /// nothing to type goes too
+  while (result.num_lines() > 0) {
+    if (!result.text.empty() && result.text.back() == '\n') {
+      result.text.pop_back();
+      result.line_offsets.back() -= 1;
+    }
+    const auto last = result.num_lines() - 1;
+    if (result.line_size(last) > result.indents[last]) {
+      break;
+    }
+    result.text.resize(result.line_offsets[last]);
+    result.line_offsets.pop_back();
+    result.indents.pop_back();
+  }
+
+  result.ascii = utf8::is_ascii(result.text);
+}
+
+#endif // TTT_PASSAGE_HPP_
@@ -0,0 +1,509 @@
+#ifndef TTT_RACE_HPP_
+#define TTT_RACE_HPP_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "unix_socket.hpp"
+
+/// Every message on the race socket is exactly this size
+///
+/// The socket is SOCK_SEQPACKET, so packet boundaries are preserved
+/// and one packet may carry a whole batch of messages back to back.
+struct race_message {
+  enum : std::uint8_t { welcome = 1, progress = 2, leave = 3 };
+
+  std::uint8_t type;
+  std::uint8_t racer;
+  std::uint16_t wpm;
+  std::uint32_t position;  // glyphs typed
+  std::uint32_t total;     // glyphs in the passage
+  std::uint32_t seed;      // welcome only
+};
+
+static_assert(sizeof(race_message) == 16, "race messages are fixed-size on the wire");
+
+constexpr std::size_t race_max_racers = 255;
+
+/// The most messages the server packs into one packet, and so what a
+/// client has to be ready to receive: a SOCK_SEQPACKET read into a
+/// smaller buffer silently loses the rest of the packet
+constexpr std::size_t race_max_batch = race_max_racers + 1;
+
+/// How often the server broadcasts standings, and the fastest a client
+/// may report its own progress
+constexpr int race_tick_ms = 50;
+constexpr int race_report_interval_ms = 100;
+
+inline std::string default_race_socket() {
+  const char* runtime = std::getenv("XDG_RUNTIME_DIR");
+  return std::string(runtime && *runtime ? runtime : "/tmp") + "/ttt-race-" + std::to_string(getuid()) + ".sock";
+}
+
+/// Relays progress between racers on one host
+///
+/// Single-threaded epoll loop. Progress from clients only updates a
+/// table; every tick the changed table goes out to every client as one
+/// packet, so traffic per client is bounded by the tick rate no matter
+/// how many racers are typing. Writes never block: a client that can't
+/// keep up just misses a tick and gets the newer table next time.
+class race_server {
+public:
+  explicit race_server(const std::string& path) : path_(path) {}
+
+  ~race_server() {
+    for (auto& r : racers_) {
+      if (r.fd >= 0) {
+        ::close(r.fd);
+      }
+    }
+    if (timer_ >= 0) ::close(timer_);
+    if (epoll_ >= 0) ::close(epoll_);
+    if (listener_ >= 0) {
+      ::close(listener_);
+      ::unlink(path_.c_str());
+    }
+  }
+
+  /// Bind the socket. Fails if another server is already listening.
+  bool listen() {
+    listener_ = listen_unix(path_, SOCK_SEQPACKET | SOCK_NONBLOCK, 64);
+    if (listener_ < 0) {
+      return false;
+    }
+
+    epoll_ = epoll_create1(EPOLL_CLOEXEC);
+    timer_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    itimerspec tick{};
+    tick.it_interval.tv_nsec = race_tick_ms * 1000 * 1000;
+    tick.it_value = tick.it_interval;
+    timerfd_settime(timer_, 0, &tick, nullptr);
+
+    add(listener_, listener_tag);
+    add(timer_, timer_tag);
+
+    std::random_device rd;
+    seed_ = rd();
+    return true;
+  }
+
+  /// Serve until stop() is called from another thread
+  void run() {
+    epoll_event events[64];
+    while (!stopping_) {
+      const int ready = epoll_wait(epoll_, events, 64, race_tick_ms * 2);
+      for (int e = 0; e < ready; ++e) {
+        const auto tag = events[e].data.u64;
+        if (tag == listener_tag) {
+          accept_all();
+        }
+        else if (tag == timer_tag) {
+          std::uint64_t expirations;
+          if (read(timer_, &expirations, sizeof(expirations)) > 0) {
+            broadcast();
+          }
+        }
+        else {
+          receive(static_cast<std::size_t>(tag));
+        }
+      }
+    }
+  }
+
+  void stop() { stopping_ = true; }
+
+private:
+  static constexpr std::uint64_t listener_tag = 1ULL << 32;
+  static constexpr std::uint64_t timer_tag = (1ULL << 32) + 1;
+
+  struct racer {
+    int fd{-1};
+    race_message last{};
+    bool reported{false};
+  };
+
+  void add(int fd, std::uint64_t tag) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = tag;
+    epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event);
+  }
+
+  void accept_all() {
+    while (true) {
+      const int fd = ::accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        return;
+      }
+
+      if (connected_ == 0) {
+        /// A new room: everyone who joins it types the same passage
+        seed_ = seed_ * 6364136223846793005ULL + 1442695040888963407ULL;
+        racers_.clear();
+        left_.clear();
+      }
+
+      /// Reuse the lowest free slot; its index is the racer id
+      std::size_t id = 0;
+      while (id < racers_.size() && (racers_[id].fd >= 0 || racers_[id].reported)) {
+        id++;
+      }
+      if (id >= race_max_racers) {
+        ::close(fd);
+        continue;
+      }
+      if (id == racers_.size()) {
+        racers_.emplace_back();
+      }
+      racers_[id] = racer{};
+      racers_[id].fd = fd;
+      /// A leave still waiting to go out would now clear the newcomer
+      left_.erase(std::remove(left_.begin(), left_.end(), static_cast<std::uint8_t>(id)), left_.end());
+      connected_++;
+      dirty_ = true;
+      add(fd, id);
+
+      race_message hello{};
+      hello.type = race_message::welcome;
+      hello.racer = static_cast<std::uint8_t>(id);
+      hello.seed = static_cast<std::uint32_t>(seed_ >> 32);
+      if (::send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) < 0) {
+        drop(id);
+      }
+    }
+  }
+
+  void receive(std::size_t id) {
+    race_message batch[16];
+    while (true) {
+      const auto got = ::recv(racers_[id].fd, batch, sizeof(batch), 0);
+      if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        drop(id);
+        return;
+      }
+      if (got < 0) {
+        return;
+      }
+      for (std::size_t k = 0; k < static_cast<std::size_t>(got) / sizeof(race_message); ++k) {
+        if (batch[k].type == race_message::progress) {
+          racers_[id].last = batch[k];
+          racers_[id].last.racer = static_cast<std::uint8_t>(id);
+          racers_[id].reported = true;
+          dirty_ = true;
+        }
+      }
+    }
+  }
+
+  void drop(std::size_t id) {
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, racers_[id].fd, nullptr);
+    ::close(racers_[id].fd);
+    racers_[id].fd = -1;
+    connected_--;
+
+    /// Racers who finished keep their bar until the room empties
+    const auto& last = racers_[id].last;
+    if (!racers_[id].reported || last.position < last.total) {
+      racers_[id].reported = false;
+      left_.push_back(static_cast<std::uint8_t>(id));
+      dirty_ = true;
+    }
+  }
+
+  void broadcast() {
+    if (!dirty_) {
+      return;
+    }
+    dirty_ = false;
+
+    /// Everyone on the board, at most race_max_racers, then as many
+    /// leaves as still fit; the rest go out with the next tick
+    packet_.clear();
+    for (const auto& r : racers_) {
+      if (r.reported) {
+        packet_.push_back(r.last);
+      }
+    }
+    const auto leaving = std::min(left_.size(), race_max_batch - packet_.size());
+    for (std::size_t k = 0; k < leaving; ++k) {
+      race_message gone{};
+      gone.type = race_message::leave;
+      gone.racer = left_[k];
+      packet_.push_back(gone);
+    }
+    left_.erase(left_.begin(), left_.begin() + leaving);
+    dirty_ = !left_.empty();
+
+    if (packet_.empty()) {
+      return;
+    }
+    for (auto& r : racers_) {
+      if (r.fd >= 0) {
+        /// Non-blocking: on EAGAIN this client just misses a tick
+        ::send(r.fd, packet_.data(), packet_.size() * sizeof(race_message), MSG_NOSIGNAL | MSG_DONTWAIT);
+      }
+    }
+  }
+
+  std::string path_;
+  int listener_{-1};
+  int epoll_{-1};
+  int timer_{-1};
+  std::uint64_t seed_{0};
+  std::size_t connected_{0};
+  bool dirty_{false};
+  std::atomic<bool> stopping_{false};
+  std::vector<racer> racers_;
+  std::vector<std::uint8_t> left_;
+  std::vector<race_message> packet_;
+};
+
+/// What a racer knows about everyone in the room
+struct race_standing {
+  bool present{false};
+  std::uint32_t position{0};
+  std::uint32_t total{0};
+  std::uint16_t wpm{0};
+};
+
+/// One racer's connection to the server
+class race_client {
+public:
+  ~race_client() { disconnect(); }
+
+  /// Connect and wait for the welcome carrying our id and the room seed
+  bool connect(const std::string& path, int timeout_ms = 1000) {
+    sockaddr_un address;
+    if (!make_unix_address(path, address)) {
+      return false;
+    }
+    disconnect();
+    fd_ = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd_ < 0 || ::connect(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+      disconnect();
+      return false;
+    }
+
+    pollfd pfd{fd_, POLLIN, 0};
+    race_message hello{};
+    if (poll(&pfd, 1, timeout_ms) <= 0 || ::recv(fd_, &hello, sizeof(hello), 0) != sizeof(hello)
+        || hello.type != race_message::welcome) {
+      disconnect();
+      return false;
+    }
+    id_ = hello.racer;
+    seed_ = hello.seed;
+    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+    return true;
+  }
+
+  void disconnect() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  int fd() const { return fd_; }
+  std::uint8_t id() const { return id_; }
+  std::uint32_t seed() const { return seed_; }
+
+  /// Note our own progress; it is sent by flush() at most every
+  /// race_report_interval_ms, and immediately once we finish
+  void update(std::uint32_t position, std::uint32_t total, std::uint16_t wpm) {
+    pending_.type = race_message::progress;
+    pending_.racer = id_;
+    pending_.position = position;
+    pending_.total = total;
+    pending_.wpm = wpm;
+    has_pending_ = true;
+
+    auto& own = standings_[id_];
+    own.present = true;
+    own.position = position;
+    own.total = total;
+    own.wpm = wpm;
+
+    if (position >= total) {
+      last_sent_ = std::chrono::steady_clock::time_point{};
+    }
+  }
+
+  void flush() {
+    if (fd_ < 0 || !has_pending_ || timeout_ms() > 0) {
+      return;
+    }
+    ::send(fd_, &pending_, sizeof(pending_), MSG_NOSIGNAL | MSG_DONTWAIT);
+    last_sent_ = std::chrono::steady_clock::now();
+    has_pending_ = false;
+  }
+
+  /// How long until a pending report may be sent; -1 if none is pending
+  int timeout_ms() const {
+    if (!has_pending_) {
+      return -1;
+    }
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - last_sent_).count();
+    return elapsed >= race_report_interval_ms ? 0 : static_cast<int>(race_report_interval_ms - elapsed);
+  }
+
+  /// Drain every packet that has arrived. Returns true if the
+  /// standings changed.
+  bool receive() {
+    bool changed = false;
+    race_message batch[race_max_batch];
+    while (true) {
+      const auto got = ::recv(fd_, batch, sizeof(batch), MSG_DONTWAIT);
+      if (got <= 0) {
+        break;
+      }
+      for (std::size_t k = 0; k < static_cast<std::size_t>(got) / sizeof(race_message); ++k) {
+        const auto& m = batch[k];
+        auto& s = standings_[m.racer];
+        if (m.type == race_message::progress) {
+          s.present = true;
+          s.position = m.position;
+          s.total = m.total;
+          s.wpm = m.wpm;
+          changed = true;
+        }
+        else if (m.type == race_message::leave) {
+          s = race_standing{};
+          changed = true;
+        }
+      }
+    }
+    return changed;
+  }
+
+  const race_standing& standing(std::size_t racer) const { return standings_[racer]; }
+
+  /// One progress bar per racer, ours first
+  std::vector<std::string> bars(std::size_t width, std::size_t max_rows) const {
+    std::vector<std::string> result;
+    auto add = [&](std::size_t racer) {
+      const auto& s = standings_[racer];
+      const auto label = racer == id_ ? std::string("you      ") : "racer " + pad(racer, 3);
+      const auto suffix = " " + pad(s.wpm, 3) + " wpm";
+      const auto inner = width > label.size() + suffix.size() + 3 ? width - label.size() - suffix.size() - 3 : 0;
+      const auto filled = s.total ? std::min<std::size_t>(inner, std::size_t(s.position) * inner / s.total) : 0;
+      result.push_back(label + " [" + std::string(filled, '#') + std::string(inner - filled, '-') + "]" + suffix);
+    };
+
+    add(id_);
+    for (std::size_t racer = 0; racer < standings_.size() && result.size() < max_rows; ++racer) {
+      if (racer != id_ && standings_[racer].present) {
+        add(racer);
+      }
+    }
+    return result;
+  }
+
+private:
+  static std::string pad(std::size_t value, std::size_t width) {
+    auto str = std::to_string(value);
+    return str.size() < width ? std::string(width - str.size(), ' ') + str : str;
+  }
+
+  int fd_{-1};
+  std::uint8_t id_{0};
+  std::uint32_t seed_{0};
+  race_message pending_{};
+  bool has_pending_{false};
+  std::chrono::steady_clock::time_point last_sent_{};
+  std::array<race_standing, race_max_racers + 1> standings_{};
+};
+
+/// A server running on a background thread of this process, for the
+/// first racer on a host when no standalone server is listening
+class race_host {
+public:
+  explicit race_host(const std::string& path) : server_(path) {
+    if (server_.listen()) {
+      thread_ = std::thread([this]() { server_.run(); });
+    }
+  }
+
+  ~race_host() {
+    if (thread_.joinable()) {
+      server_.stop();
+      thread_.join();
+    }
+  }
+
+  bool running() const { return thread_.joinable(); }
+
+private:
+  race_server server_;
+  std::thread thread_;
+};
+
+/// Simulated opponents for offline play and testing
+///
+/// Each bot is an ordinary race_client on its own thread, typing the
+/// same passage at a steady random speed.
+class race_bots {
+public:
+  race_bots(const std::string& path, std::size_t count, std::uint32_t total, std::uint32_t seed) {
+    for (std::size_t b = 0; b < count; ++b) {
+      threads_.emplace_back([this, path, total, seed, b]() {
+        race_client client;
+        if (!client.connect(path)) {
+          return;
+        }
+        std::mt19937 gen(seed + static_cast<std::uint32_t>(b));
+        std::uniform_int_distribution<int> speed(30, 110);
+        const auto wpm = speed(gen);
+
+        /// A word is five glyphs, so glyphs per second is wpm * 5 / 60
+        const auto start = std::chrono::steady_clock::now();
+        std::uint32_t position = 0;
+        while (!stopping_ && position < total) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(race_report_interval_ms));
+          const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+          position = std::min<std::uint32_t>(total, static_cast<std::uint32_t>(seconds * wpm * 5 / 60));
+          client.update(position, total, static_cast<std::uint16_t>(wpm));
+          client.flush();
+          client.receive();
+        }
+        while (!stopping_) {
+          /// Stay in the room once finished so our bar stays visible
+          std::this_thread::sleep_for(std::chrono::milliseconds(race_tick_ms));
+          client.receive();
+        }
+      });
+    }
+  }
+
+  ~race_bots() {
+    stopping_ = true;
+    for (auto& t : threads_) {
+      t.join();
+    }
+  }
+
+private:
+  std::atomic<bool> stopping_{false};
+  std::vector<std::thread> threads_;
+};
+
+#endif // TTT_RACE_HPP_
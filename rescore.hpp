@@ -0,0 +1,221 @@
+#ifndef TTT_RESCORE_HPP_
+#define TTT_RESCORE_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "score.hpp"
+#include "session.hpp"
+
+#include <dirent.h>
+
+/// Storage on a T's own alignment, for vectors of per-thread state
+///
+/// Before C++17, std::allocator ignores alignas beyond max_align_t, so
+/// a vector of cache-line aligned elements may still start mid-line
+/// and have neighbours share one.
+template <typename T>
+struct cache_aligned_allocator {
+  using value_type = T;
+
+  cache_aligned_allocator() = default;
+
+  template <typename U>
+  cache_aligned_allocator(const cache_aligned_allocator<U>&) {}
+
+  T* allocate(std::size_t n) {
+    void* p = nullptr;
+    if (posix_memalign(&p, alignof(T), n * sizeof(T)) != 0) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, std::size_t) { std::free(p); }
+
+  template <typename U>
+  bool operator==(const cache_aligned_allocator<U>&) const { return true; }
+
+  template <typename U>
+  bool operator!=(const cache_aligned_allocator<U>&) const { return false; }
+};
+
+template <typename T>
+using cache_aligned_vector = std::vector<T, cache_aligned_allocator<T>>;
+
+/// Runs `fn(task, worker)` for every task in [0, num_tasks)
+///
+/// Each worker owns a contiguous range of tasks and takes from its
+/// front. A worker that runs dry steals the back half of the largest
+/// remaining range, so a few slow files never leave cores idle.
+class work_stealing_pool {
+public:
+  explicit work_stealing_pool(std::size_t num_threads)
+    : num_threads_(std::max<std::size_t>(1, num_threads)) {}
+
+  std::size_t size() const { return num_threads_; }
+
+  template <typename Fn>
+  void run(std::size_t num_tasks, Fn fn) {
+    cache_aligned_vector<range> ranges(num_threads_);
+    for (std::size_t w = 0; w < num_threads_; ++w) {
+      ranges[w].begin = num_tasks * w / num_threads_;
+      ranges[w].end = num_tasks * (w + 1) / num_threads_;
+    }
+
+    auto worker = [&](std::size_t w) {
+      std::size_t task;
+      while (pop(ranges[w], task) || steal(ranges, w, task)) {
+        fn(task, w);
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t w = 1; w < num_threads_; ++w) {
+      threads.emplace_back(worker, w);
+    }
+    worker(0);
+    for (auto& t : threads) {
+      t.join();
+    }
+  }
+
+private:
+  struct alignas(64) range {
+    std::mutex mutex;
+    std::size_t begin{0};
+    std::size_t end{0};
+  };
+
+  static bool pop(range& r, std::size_t& task) {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    if (r.begin == r.end) {
+      return false;
+    }
+    task = r.begin++;
+    return true;
+  }
+
+  bool steal(cache_aligned_vector<range>& ranges, std::size_t thief, std::size_t& task) {
+    while (true) {
+      /// Pick the victim with the most work left
+      std::size_t victim = thief;
+      std::size_t most = 0;
+      for (std::size_t w = 0; w < num_threads_; ++w) {
+        std::lock_guard<std::mutex> lock(ranges[w].mutex);
+        if (ranges[w].end - ranges[w].begin > most) {
+          most = ranges[w].end - ranges[w].begin;
+          victim = w;
+        }
+      }
+      if (most == 0) {
+        return false;
+      }
+
+      std::size_t begin, end;
+      {
+        std::lock_guard<std::mutex> lock(ranges[victim].mutex);
+        auto& r = ranges[victim];
+        if (r.begin == r.end) {
+          /// Someone else got there first
+          continue;
+        }
+        /// Take the back half, which is the whole range when one task is left
+        const auto mid = r.begin + (r.end - r.begin) / 2;
+        begin = mid;
+        end = r.end;
+        r.end = mid;
+      }
+
+      std::lock_guard<std::mutex> lock(ranges[thief].mutex);
+      ranges[thief].begin = begin + 1;
+      ranges[thief].end = end;
+      task = begin;
+      return true;
+    }
+  }
+
+  std::size_t num_threads_;
+};
+
+/// Totals over many sessions, one per worker so workers never share
+/// a cache line; merged once after all workers have finished
+struct alignas(64) rescore_totals {
+  std::size_t sessions{0};
+  std::size_t failed{0};
+  std::size_t keystrokes{0};
+  double sum_wpm{0};
+  double sum_accuracy{0};
+  double best_wpm{0};
+
+  void add(const score_result& result, std::size_t num_keys) {
+    sessions++;
+    keystrokes += num_keys;
+    sum_wpm += result.wpm;
+    sum_accuracy += result.accuracy;
+    best_wpm = std::max(best_wpm, result.wpm);
+  }
+
+  void merge(const rescore_totals& other) {
+    sessions += other.sessions;
+    failed += other.failed;
+    keystrokes += other.keystrokes;
+    sum_wpm += other.sum_wpm;
+    sum_accuracy += other.sum_accuracy;
+    best_wpm = std::max(best_wpm, other.best_wpm);
+  }
+};
+
+inline std::vector<std::string> list_sessions(const std::string& dir) {
+  std::vector<std::string> result;
+  const std::string extension = session_extension;
+
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    return result;
+  }
+  while (auto entry = readdir(d)) {
+    const std::string name = entry->d_name;
+    if (name.size() > extension.size()
+        && name.compare(name.size() - extension.size(), extension.size(), extension) == 0) {
+      result.push_back(dir + "/" + name);
+    }
+  }
+  closedir(d);
+
+  /// Deterministic order, so per-thread ranges are reproducible
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+/// Re-score every session log in `dir` with the current scoring rules
+inline rescore_totals rescore_directory(const std::string& dir, std::size_t num_threads,
+                                        scoring method = scoring::classic) {
+  const auto paths = list_sessions(dir);
+
+  work_stealing_pool pool(std::min(num_threads, std::max<std::size_t>(1, paths.size())));
+  cache_aligned_vector<rescore_totals> per_worker(pool.size());
+
+  pool.run(paths.size(), [&](std::size_t task, std::size_t worker) {
+    mapped_session session(paths[task]);
+    if (!session.valid()) {
+      per_worker[worker].failed++;
+      return;
+    }
+    per_worker[worker].add(score(session.view(), method), session.view().num_keys);
+  });
+
+  rescore_totals totals;
+  for (const auto& t : per_worker) {
+    totals.merge(t);
+  }
+  return totals;
+}
+
+#endif // TTT_RESCORE_HPP_
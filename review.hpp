@@ -0,0 +1,313 @@
+#ifndef TTT_REVIEW_HPP_
+#define TTT_REVIEW_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "text_source.hpp"
+#include "utf8.hpp"
+
+/// A mistyped word and when to see it again, SM-2 style
+struct review_card {
+  std::string word;
+  std::int64_t due;            // seconds since the epoch
+  double easiness{2.5};
+  std::uint32_t repetitions{0};
+  std::uint32_t interval{0};   // days
+};
+
+/// Words that were mistyped, scheduled for review
+///
+/// On disk it is a snapshot, one card per line, "due easiness
+/// repetitions interval word", sorted by due time, and a journal next
+/// to it that every graded card is appended to. With no journal, the
+/// words due now are read off the front of the snapshot without loading
+/// the rest, so a backlog of tens of thousands of words costs nothing at
+/// startup. Otherwise, or once results come in, both are loaded into a
+/// binary heap keyed on due time, later journal lines winning. Scheduling
+/// a word is then a hash lookup and a sift, O(log n), and the due words
+/// are read off the top of the heap. The snapshot is only rewritten once
+/// the journal outgrows it, which keeps saving O(log n) a word overall.
+class review_queue {
+public:
+  static constexpr std::int64_t seconds_per_day = 24 * 60 * 60;
+
+  explicit review_queue(const std::string& path) : path_(path), journal_path_(path + ".log") {}
+
+  /// Up to `limit` words due by `now` into `out`, soonest first
+  void peek_due(std::int64_t now, std::size_t limit, std::vector<std::string>& out) {
+    out.clear();
+    if (!loaded_ && !std::ifstream(journal_path_).good()) {
+      std::ifstream file(path_);
+      std::string line;
+      review_card card;
+      while (out.size() < limit && getline(file, line)) {
+        if (!parse(line, card)) {
+          continue;
+        }
+        if (card.due > now) {
+          break;
+        }
+        out.push_back(card.word);
+      }
+      return;
+    }
+
+    /// A heap's k smallest are a walk from the root that only ever
+    /// steps to the children of the cards already taken
+    load();
+    const auto later = [this](std::size_t a, std::size_t b) { return heap_[a].due > heap_[b].due; };
+    frontier_.clear();
+    if (!heap_.empty()) {
+      frontier_.push_back(0);
+    }
+    while (out.size() < limit && !frontier_.empty()) {
+      std::pop_heap(frontier_.begin(), frontier_.end(), later);
+      const auto k = frontier_.back();
+      frontier_.pop_back();
+      if (heap_[k].due > now) {
+        break;
+      }
+      out.push_back(heap_[k].word);
+      for (auto child : {2 * k + 1, 2 * k + 2}) {
+        if (child < heap_.size()) {
+          frontier_.push_back(child);
+          std::push_heap(frontier_.begin(), frontier_.end(), later);
+        }
+      }
+    }
+  }
+
+  /// Grade how a word went, 0 (forgotten) to 5 (perfect). Words not in
+  /// the queue only join it when they went badly.
+  void grade(const std::string& word, unsigned quality, std::int64_t now) {
+    load();
+    auto found = position_.find(word);
+    if (found == position_.end()) {
+      if (quality >= 3) {
+        return;
+      }
+      review_card card;
+      card.word = word;
+      card.due = now;
+      heap_.push_back(card);
+      found = position_.emplace(word, heap_.size() - 1).first;
+    }
+
+    const auto index = found->second;
+    schedule(heap_[index], quality, now);
+    write_card(unsaved_, heap_[index]);
+    unsaved_lines_++;
+    sift_down(sift_up(index));
+  }
+
+  /// Append the cards graded since the last save to the journal, and
+  /// fold the journal into the snapshot once it holds more lines than
+  /// there are cards. The snapshot goes through a temporary file so a
+  /// crash never leaves half a queue.
+  bool save() {
+    if (unsaved_lines_ == 0) {
+      return true;
+    }
+    {
+      std::ofstream journal(journal_path_, std::ios::app);
+      journal << unsaved_.str();
+      if (!journal) {
+        return false;
+      }
+    }
+    journal_lines_ += unsaved_lines_;
+    unsaved_.str(std::string());
+    unsaved_lines_ = 0;
+    if (journal_lines_ <= heap_.size()) {
+      return true;
+    }
+
+    auto cards = heap_;
+    std::sort(cards.begin(), cards.end(), [](const review_card& a, const review_card& b) {
+      return a.due < b.due;
+    });
+
+    const auto temporary = path_ + ".tmp";
+    {
+      std::ofstream file(temporary);
+      for (const auto& card : cards) {
+        write_card(file, card);
+      }
+      if (!file) {
+        return false;
+      }
+    }
+    if (std::rename(temporary.c_str(), path_.c_str()) != 0) {
+      return false;
+    }
+    journal_lines_ = 0;
+    return std::remove(journal_path_.c_str()) == 0;
+  }
+
+private:
+  static bool parse(const std::string& line, review_card& card) {
+    std::istringstream stream(line);
+    return static_cast<bool>(stream >> card.due >> card.easiness >> card.repetitions >> card.interval >> card.word);
+  }
+
+  static void write_card(std::ostream& out, const review_card& card) {
+    out << card.due << ' ' << card.easiness << ' ' << card.repetitions << ' '
+        << card.interval << ' ' << card.word << '\n';
+  }
+
+  /// SM-2: a failed recall starts the word over the next day; a good
+  /// one grows the interval 1, 6, then by the easiness, which moves
+  /// with every grade and never drops below 1.3
+  static void schedule(review_card& card, unsigned quality, std::int64_t now) {
+    quality = std::min(quality, 5u);
+    if (quality < 3) {
+      card.repetitions = 0;
+      card.interval = 1;
+    }
+    else {
+      card.repetitions++;
+      if (card.repetitions == 1) {
+        card.interval = 1;
+      }
+      else if (card.repetitions == 2) {
+        card.interval = 6;
+      }
+      else {
+        card.interval = static_cast<std::uint32_t>(card.interval * card.easiness + 0.5);
+      }
+    }
+    const double miss = 5.0 - quality;
+    card.easiness = std::max(1.3, card.easiness + 0.1 - miss * (0.08 + miss * 0.02));
+    card.due = now + std::int64_t(card.interval) * seconds_per_day;
+  }
+
+  void load() {
+    if (loaded_) {
+      return;
+    }
+    loaded_ = true;
+
+    /// Cards from the journal replace those of the same word before
+    /// them. A file sorted by due time is already a heap; make_heap is
+    /// one cheap pass for the journal and in case it was edited by hand.
+    std::string line;
+    review_card card;
+    auto read = [&](const std::string& path) {
+      std::ifstream file(path);
+      std::size_t lines = 0;
+      while (getline(file, line)) {
+        if (!parse(line, card)) {
+          continue;
+        }
+        lines++;
+        const auto found = position_.emplace(card.word, heap_.size());
+        if (found.second) {
+          heap_.push_back(card);
+        }
+        else {
+          heap_[found.first->second] = card;
+        }
+      }
+      return lines;
+    };
+    read(path_);
+    journal_lines_ = read(journal_path_);
+
+    std::make_heap(heap_.begin(), heap_.end(), [](const review_card& a, const review_card& b) {
+      return a.due > b.due;
+    });
+    for (std::size_t k = 0; k < heap_.size(); ++k) {
+      position_[heap_[k].word] = k;
+    }
+  }
+
+  void swap_cards(std::size_t a, std::size_t b) {
+    std::swap(heap_[a], heap_[b]);
+    position_[heap_[a].word] = a;
+    position_[heap_[b].word] = b;
+  }
+
+  std::size_t sift_up(std::size_t k) {
+    while (k > 0 && heap_[(k - 1) / 2].due > heap_[k].due) {
+      swap_cards(k, (k - 1) / 2);
+      k = (k - 1) / 2;
+    }
+    return k;
+  }
+
+  std::size_t sift_down(std::size_t k) {
+    while (true) {
+      auto smallest = k;
+      for (auto child : {2 * k + 1, 2 * k + 2}) {
+        if (child < heap_.size() && heap_[child].due < heap_[smallest].due) {
+          smallest = child;
+        }
+      }
+      if (smallest == k) {
+        return k;
+      }
+      swap_cards(k, smallest);
+      k = smallest;
+    }
+  }
+
+  std::string path_;
+  std::string journal_path_;
+  bool loaded_{false};
+  std::vector<review_card> heap_;
+  std::unordered_map<std::string, std::size_t> position_;
+  std::vector<std::size_t> frontier_;
+
+  /// Journal lines on disk, and those graded since the last save
+  std::size_t journal_lines_{0};
+  std::ostringstream unsaved_;
+  std::size_t unsaved_lines_{0};
+};
+
+/// Hands out words from a source with due review words mixed in, one in
+/// every 1/ratio, evenly spread
+template <typename Words>
+class review_mixer {
+public:
+  review_mixer(Words& words, const std::vector<std::string>& reviews, double ratio)
+    : words_(words), reviews_(reviews), ratio_(std::max(0.0, std::min(ratio, 1.0))) {
+    restart();
+  }
+
+  /// Start over on the reviews, which have been refilled for a new test
+  void restart() {
+    widths_.clear();
+    for (const auto& word : reviews_) {
+      widths_.push_back(utf8::display_width(word));
+    }
+    credit_ = 0;
+    next_review_ = 0;
+  }
+
+  word_ref next() {
+    credit_ += ratio_;
+    if (credit_ >= 1.0 && next_review_ < reviews_.size()) {
+      credit_ -= 1.0;
+      const auto& word = reviews_[next_review_];
+      return word_ref{word.data(), word.size(), widths_[next_review_++]};
+    }
+    return words_.next();
+  }
+
+private:
+  Words& words_;
+  const std::vector<std::string>& reviews_;
+  std::vector<std::size_t> widths_;
+  double ratio_;
+  double credit_{0};
+  std::size_t next_review_{0};
+};
+
+#endif // TTT_REVIEW_HPP_
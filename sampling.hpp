@@ -0,0 +1,136 @@
+#ifndef TTT_SAMPLING_HPP_
+#define TTT_SAMPLING_HPP_
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/// Counter-based random number generator
+///
+/// The n-th output is a pure function of the key and n: SplitMix64's
+/// finaliser applied to key + n * golden gamma. The whole state is two
+/// integers, any output can be computed directly with at(), and
+/// independent streams are just different keys. Outputs are the same on
+/// every platform, unlike the std distributions, so a --seed reproduces
+/// a test anywhere.
+class counter_rng {
+public:
+  using result_type = std::uint64_t;
+
+  explicit counter_rng(std::uint64_t seed = 0, std::uint64_t stream = 0)
+    : key_(mix(mix(seed) + stream * gamma)) {}
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return ~result_type(0); }
+
+  result_type operator()() { return at(counter_++); }
+
+  result_type at(std::uint64_t n) const { return mix(key_ + (n + 1) * gamma); }
+
+  std::uint64_t counter() const { return counter_; }
+
+private:
+  static constexpr std::uint64_t gamma = 0x9E3779B97F4A7C15ULL;
+
+  static std::uint64_t mix(std::uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  std::uint64_t key_;
+  std::uint64_t counter_{0};
+};
+
+/// Uniform integer in [0, range) by Lemire's multiply-shift
+///
+/// The high half of x * range is the result. Only when the low half
+/// falls below 2^64 mod range would that be biased; the division that
+/// computes the threshold and the redraw both happen with probability
+/// range / 2^64, so in practice this is one multiply per draw.
+template <typename Rng>
+std::uint64_t bounded(Rng& rng, std::uint64_t range) {
+  unsigned __int128 product = static_cast<unsigned __int128>(rng()) * range;
+  auto low = static_cast<std::uint64_t>(product);
+  if (low < range) {
+    const auto threshold = (0 - range) % range;
+    while (low < threshold) {
+      product = static_cast<unsigned __int128>(rng()) * range;
+      low = static_cast<std::uint64_t>(product);
+    }
+  }
+  return static_cast<std::uint64_t>(product >> 64);
+}
+
+/// Uniform double in [0, 1) from the top 53 bits
+template <typename Rng>
+double unit_interval(Rng& rng) {
+  return static_cast<double>(rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/// The last few picks, so a sampler can avoid repeating itself
+///
+/// Fixed capacity and a linear scan: windows are a line's worth of
+/// words, where a scan of a few cache-resident entries beats hashing.
+class recent_window {
+public:
+  static constexpr std::size_t capacity = 64;
+
+  explicit recent_window(std::size_t size = 0) : size_(std::min(size, std::size_t{capacity})) {}
+
+  std::size_t size() const { return size_; }
+
+  bool contains(std::uint32_t value) const {
+    return std::find(entries_.begin(), entries_.begin() + filled_, value) != entries_.begin() + filled_;
+  }
+
+  void push(std::uint32_t value) {
+    if (size_ == 0) {
+      return;
+    }
+    entries_[next_] = value;
+    next_ = (next_ + 1) % size_;
+    filled_ = std::min(filled_ + 1, size_);
+  }
+
+private:
+  std::size_t size_;
+  std::size_t next_{0};
+  std::size_t filled_{0};
+  std::array<std::uint32_t, capacity> entries_{};
+};
+
+/// Uniform index in [0, range) that is not among the recent picks
+///
+/// Redraws on a hit. Callers keep the window smaller than the range,
+/// so at least one index is always allowed.
+template <typename Rng>
+std::uint32_t bounded_fresh(Rng& rng, std::uint32_t range, recent_window& recent) {
+  std::uint32_t index;
+  do {
+    index = static_cast<std::uint32_t>(bounded(rng, range));
+  } while (recent.contains(index));
+  recent.push(index);
+  return index;
+}
+
+/// Pearson's chi-squared statistic of observed counts against a uniform
+/// expectation, as a z-score: (chi2 - df) / sqrt(2 df), which is close
+/// to standard normal for the bucket counts used here
+inline double uniformity_z(const std::vector<std::uint64_t>& counts) {
+  std::uint64_t total = 0;
+  for (auto c : counts) {
+    total += c;
+  }
+  const double expected = double(total) / counts.size();
+  double chi2 = 0;
+  for (auto c : counts) {
+    chi2 += (c - expected) * (c - expected) / expected;
+  }
+  const double df = double(counts.size() - 1);
+  return (chi2 - df) / std::sqrt(2 * df);
+}
+
+#endif // TTT_SAMPLING_HPP_
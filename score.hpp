@@ -0,0 +1,209 @@
+#ifndef TTT_SCORE_HPP_
+#define TTT_SCORE_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "utf8.hpp"
+
+/// One classified keystroke, as recorded by the typing loop
+struct keystroke {
+  enum : std::uint8_t { correct = 0, mistake = 1, backspace = 2 };
+
+  /// Microseconds since the first keystroke of the test
+  std::uint64_t time_us;
+
+  /// Glyph index within the whole passage
+  std::uint32_t position;
+
+  std::uint8_t kind;
+  std::uint8_t padding[3];
+};
+
+static_assert(sizeof(keystroke) == 16, "keystroke records are written to disk as-is");
+
+/// Read-only view of a finished test
+///
+/// Points either into a live passage and keystroke buffer or straight
+/// into a memory-mapped session log, so scoring never copies.
+struct session_view {
+  const char* text;
+  const std::uint32_t* line_offsets; // num_lines + 1 entries
+  const std::uint32_t* indents;      // num_lines entries
+  std::size_t num_lines;
+  bool ascii;
+  const keystroke* keys;
+  std::size_t num_keys;
+};
+
+/// Which rules `wpm` and `accuracy` follow
+///
+/// classic:  words in the passage per minute, and mistakes against the
+///           passage length, corrected or not
+/// standard: net speed in five-glyph words per minute, and accuracy
+///           after corrections, as typing tests usually report them
+enum class scoring { classic, standard };
+
+inline bool parse_scoring(const std::string& name, scoring& method) {
+  if (name == "classic") {
+    method = scoring::classic;
+  }
+  else if (name == "standard") {
+    method = scoring::standard;
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+struct score_result {
+  double wpm;
+  double accuracy;
+  std::size_t num_words;
+  std::size_t num_chars;
+  std::size_t num_mistakes;
+
+  /// Both rule sets are always filled in; `wpm` and `accuracy` are
+  /// copies of whichever was asked for
+  double gross_wpm;            // everything typed, five glyphs a word
+  double net_wpm;              // gross less uncorrected mistakes a minute
+  double raw_accuracy;         // right first time, of everything typed
+  double corrected_accuracy;   // right at the end, of the passage
+  double speed_variation;      // coefficient of variation of per-second speed
+  std::size_t num_typed;
+  std::size_t num_uncorrected;
+};
+
+inline std::size_t count_words(const char* str, std::size_t size) {
+  std::size_t result{0};
+
+  char prev = ' ';
+
+  for(std::size_t i = 0; i < size; ++i) {
+    if(i + 1 < size && str[i] != ' ' && prev == ' ') {
+      result++;
+    }
+    prev = str[i];
+  }
+
+  return result;
+}
+
+inline std::size_t count_words(const std::string& str) {
+  return count_words(str.data(), str.size());
+}
+
+/// Running mean and variance of glyphs typed in each whole second,
+/// by Welford's method
+class speed_by_second {
+public:
+  /// A glyph typed `time_us` into the test
+  void add(std::uint64_t time_us) {
+    const auto second = time_us / 1000000;
+    while (second > current_) {
+      close();
+    }
+    count_++;
+  }
+
+  /// Coefficient of variation over the whole seconds seen so far; the
+  /// last second, still under way, is left out
+  double variation() const {
+    if (seconds_ < 2 || mean_ <= 0) {
+      return 0.0;
+    }
+    return std::sqrt(m2_ / double(seconds_)) / mean_;
+  }
+
+private:
+  void close() {
+    seconds_++;
+    const double delta = double(count_) - mean_;
+    mean_ += delta / double(seconds_);
+    m2_ += delta * (double(count_) - mean_);
+    count_ = 0;
+    current_++;
+  }
+
+  std::uint64_t current_{0};
+  std::size_t count_{0};
+  std::size_t seconds_{0};
+  double mean_{0};
+  double m2_{0};
+};
+
+/// Score a finished test
+///
+/// This is the single place the scoring rules live: the typing loop and
+/// `--rescore` both call it, so a rule change applies to old logs too.
+/// Every figure comes out of one pass over the keystrokes.
+inline score_result score(const session_view& session, scoring method = scoring::classic) {
+  score_result result{};
+
+  for (std::size_t n = 0; n < session.num_lines; ++n) {
+    const auto data = session.text + session.line_offsets[n];
+    const auto size = session.line_offsets[n + 1] - session.line_offsets[n];
+    result.num_words += count_words(data, size);
+    result.num_chars += (session.ascii ? size : utf8::glyph_count(data, size)) - session.indents[n];
+  }
+
+  /// Whether the glyph at each position is currently typed wrong; a
+  /// backspace records the position it erased. Glyphs never outnumber
+  /// bytes, so this is big enough without counting them.
+  std::vector<std::uint8_t> wrong(session.line_offsets[session.num_lines] + 1, 0);
+  speed_by_second speed;
+
+  for (std::size_t k = 0; k < session.num_keys; ++k) {
+    const auto& key = session.keys[k];
+    const auto position = std::min<std::size_t>(key.position, wrong.size() - 1);
+    switch (key.kind) {
+    case keystroke::mistake:
+      result.num_mistakes++;
+      result.num_uncorrected++;
+      wrong[position] = 1;
+      // fall through
+    case keystroke::correct:
+      result.num_typed++;
+      speed.add(key.time_us);
+      break;
+    case keystroke::backspace:
+      result.num_uncorrected -= wrong[position];
+      wrong[position] = 0;
+      break;
+    }
+  }
+
+  const auto microseconds = session.num_keys > 0 ? session.keys[session.num_keys - 1].time_us : 0;
+  const auto minutes = microseconds / (60 * 1000 * 1000.0);
+
+  result.accuracy = result.num_chars > 0
+    ? 100.0 - (double(result.num_mistakes) / result.num_chars * 100.0)
+    : 0.0;
+  result.wpm = microseconds > 0
+    ? (double(result.num_words) / microseconds) * 60 * 1000 * 1000.0
+    : 0.0;
+
+  if (minutes > 0) {
+    result.gross_wpm = result.num_typed / 5.0 / minutes;
+    result.net_wpm = std::max(0.0, result.gross_wpm - result.num_uncorrected / minutes);
+  }
+  result.raw_accuracy = result.num_typed > 0
+    ? 100.0 * double(result.num_typed - result.num_mistakes) / result.num_typed
+    : 0.0;
+  result.corrected_accuracy = result.num_chars > 0
+    ? 100.0 * double(result.num_chars - std::min(result.num_uncorrected, result.num_chars)) / result.num_chars
+    : 0.0;
+  result.speed_variation = speed.variation();
+
+  if (method == scoring::standard) {
+    result.wpm = result.net_wpm;
+    result.accuracy = result.corrected_accuracy;
+  }
+  return result;
+}
+
+#endif // TTT_SCORE_HPP_
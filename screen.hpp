@@ -0,0 +1,309 @@
+#ifndef TTT_SCREEN_HPP_
+#define TTT_SCREEN_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "terminal.hpp"
+
+/// One terminal column
+struct cell {
+  char bytes[13];
+  std::uint8_t size;   // 0 marks the right half of a wide glyph
+  std::uint8_t width;
+  std::uint8_t style;
+
+  bool operator==(const cell& other) const {
+    return size == other.size && style == other.style && width == other.width
+      && std::memcmp(bytes, other.bytes, size) == 0;
+  }
+
+  bool operator!=(const cell& other) const { return !(*this == other); }
+};
+
+namespace screen_detail {
+
+inline std::size_t digits(std::size_t n) {
+  std::size_t result = 1;
+  while (n >= 10) {
+    n /= 10;
+    result++;
+  }
+  return result;
+}
+
+/// Length of CSI <n> <final>, where a parameter of 1 can be omitted
+inline std::size_t csi_length(std::size_t n) {
+  return 3 + (n == 1 ? 0 : digits(n));
+}
+
+inline void append_csi(std::string& out, std::size_t n, char final) {
+  out += "\033[";
+  if (n != 1) {
+    out += std::to_string(n);
+  }
+  out += final;
+}
+
+}
+
+/// Append the shortest escape sequence that moves the cursor from
+/// (r0, c0) to (r1, c1). With `known` false only absolute addressing
+/// is safe, e.g. after a write into the last column left a pending wrap.
+inline void append_cursor_move(std::string& out, std::size_t r0, std::size_t c0,
+                               std::size_t r1, std::size_t c1, bool known) {
+  using namespace screen_detail;
+
+  if (known && r0 == r1 && c0 == c1) {
+    return;
+  }
+
+  /// Absolute: CUP, dropping default parameters
+  std::size_t absolute;
+  if (r1 == 0 && c1 == 0) {
+    absolute = 3;
+  }
+  else if (c1 == 0) {
+    absolute = 3 + digits(r1 + 1);
+  }
+  else {
+    absolute = 4 + digits(r1 + 1) + digits(c1 + 1);
+  }
+
+  if (!known) {
+    out += "\033[";
+    if (r1 != 0 || c1 != 0) {
+      out += std::to_string(r1 + 1);
+    }
+    if (c1 != 0) {
+      out += ';';
+      out += std::to_string(c1 + 1);
+    }
+    out += 'H';
+    return;
+  }
+
+  /// Relative: vertical CUU/CUD plus the cheapest horizontal move
+  enum { none, backspace, carriage_return, return_forward, forward, back, column } horizontal = none;
+  std::size_t horizontal_length = 0;
+
+  auto consider = [&](int option, std::size_t length) {
+    if (horizontal == none || length < horizontal_length) {
+      horizontal = static_cast<decltype(horizontal)>(option);
+      horizontal_length = length;
+    }
+  };
+
+  if (c1 > c0) {
+    consider(forward, csi_length(c1 - c0));
+  }
+  else if (c1 < c0) {
+    if (c1 + 1 == c0) {
+      consider(backspace, 1);
+    }
+    consider(back, csi_length(c0 - c1));
+  }
+  if (c1 != c0) {
+    if (c1 == 0) {
+      consider(carriage_return, 1);
+    }
+    else {
+      consider(return_forward, 1 + csi_length(c1));
+    }
+    consider(column, csi_length(c1 + 1));
+  }
+
+  const std::size_t vertical_length = (r1 == r0) ? 0 : csi_length(r1 > r0 ? r1 - r0 : r0 - r1);
+
+  if (absolute < vertical_length + horizontal_length) {
+    append_cursor_move(out, r0, c0, r1, c1, false);
+    return;
+  }
+
+  if (r1 < r0) {
+    append_csi(out, r0 - r1, 'A');
+  }
+  else if (r1 > r0) {
+    append_csi(out, r1 - r0, 'B');
+  }
+
+  switch (horizontal) {
+    case none: break;
+    case backspace: out += '\b'; break;
+    case carriage_return: out += '\r'; break;
+    case return_forward: out += '\r'; append_csi(out, c1, 'C'); break;
+    case forward: append_csi(out, c1 - c0, 'C'); break;
+    case back: append_csi(out, c0 - c1, 'D'); break;
+    case column: append_csi(out, c1 + 1, 'G'); break;
+  }
+}
+
+/// Double-buffered cell grid
+///
+/// Callers draw a whole frame into the back buffer; flush() compares it
+/// with the front buffer (what the terminal currently shows) and emits
+/// only the cells that changed, with the shortest cursor motions.
+class screen {
+public:
+  static constexpr std::uint8_t unknown_style = 0xFF;
+
+  /// Resize both buffers. The terminal is assumed to have just been
+  /// cleared, so the front buffer starts out blank.
+  void resize(std::size_t rows, std::size_t cols) {
+    rows_ = rows;
+    cols_ = cols;
+    front_.assign(rows * cols, blank());
+    back_.assign(rows * cols, blank());
+    cursor_known_ = false;
+    current_style_ = unknown_style;
+  }
+
+  /// Forget what the terminal shows; the next flush redraws every cell
+  void invalidate() {
+    cell junk = blank();
+    junk.style = unknown_style;
+    front_.assign(rows_ * cols_, junk);
+    cursor_known_ = false;
+    current_style_ = unknown_style;
+  }
+
+  std::size_t rows() const { return rows_; }
+  std::size_t cols() const { return cols_; }
+
+  void clear() {
+    back_.assign(rows_ * cols_, blank());
+  }
+
+  /// Draw one glyph. Glyphs that do not fit are dropped.
+  void put(std::size_t row, std::size_t col, const char* bytes, std::size_t size,
+           std::size_t width, std::uint8_t style) {
+    if (row >= rows_ || col + width > cols_ || width == 0 || size > sizeof(cell::bytes)) {
+      return;
+    }
+    auto& c = back_[row * cols_ + col];
+    std::memcpy(c.bytes, bytes, size);
+    c.size = static_cast<std::uint8_t>(size);
+    c.width = static_cast<std::uint8_t>(width);
+    c.style = style;
+    for (std::size_t k = 1; k < width; ++k) {
+      auto& right = back_[row * cols_ + col + k];
+      right.size = 0;
+      right.width = 0;
+      right.style = style;
+    }
+  }
+
+  /// Draw single-column text, returning the column after it
+  std::size_t put_text(std::size_t row, std::size_t col, const std::string& text, std::uint8_t style) {
+    for (auto c : text) {
+      put(row, col++, &c, 1, 1, style);
+    }
+    return col;
+  }
+
+  void set_cursor(std::size_t row, std::size_t col) {
+    cursor_row_ = row;
+    cursor_col_ = col;
+  }
+
+  /// Append the escape sequences that turn the front buffer into the
+  /// back buffer, and return the number of cells that changed
+  std::size_t flush(std::string& out, const render_backend& theme) {
+    std::size_t changed = 0;
+
+    for (std::size_t row = 0; row < rows_; ++row) {
+      for (std::size_t col = 0; col < cols_; ++col) {
+        const auto index = row * cols_ + col;
+        const auto& want = back_[index];
+        if (want == front_[index]) {
+          continue;
+        }
+        changed++;
+
+        if (want.size == 0) {
+          /// Right half of a wide glyph whose left half is unchanged:
+          /// the terminal already shows it
+          front_[index] = want;
+          continue;
+        }
+
+        append_cursor_move(out, row_, col_, row, col, cursor_known_);
+        if (want.style != current_style_) {
+          out += theme.sgr[want.style];
+          current_style_ = want.style;
+        }
+        out.append(want.bytes, want.size);
+
+        for (std::size_t k = 0; k < want.width; ++k) {
+          front_[index + k] = back_[index + k];
+        }
+
+        row_ = row;
+        col_ = col + want.width;
+        cursor_known_ = col_ < cols_;
+        col += want.width - 1;
+      }
+    }
+
+    append_cursor_move(out, row_, col_, cursor_row_, cursor_col_, cursor_known_);
+    row_ = cursor_row_;
+    col_ = cursor_col_;
+    cursor_known_ = true;
+
+    return changed;
+  }
+
+  /// Append one single-column glyph written at the terminal's cursor
+  /// ahead of the next frame, in `style`. Only the front buffer learns
+  /// about it, so that frame rewrites the cell if the back buffer
+  /// disagrees. Returns false, appending nothing, if the cursor is
+  /// unknown or the write would leave a pending wrap.
+  bool echo(std::string& out, const char* bytes, std::size_t size, std::uint8_t style,
+            const render_backend& theme) {
+    if (!cursor_known_ || row_ >= rows_ || col_ + 1 >= cols_ || size > sizeof(cell::bytes)) {
+      return false;
+    }
+    if (style != current_style_) {
+      out += theme.sgr[style];
+      current_style_ = style;
+    }
+    out.append(bytes, size);
+
+    auto& c = front_[row_ * cols_ + col_];
+    std::memcpy(c.bytes, bytes, size);
+    c.size = static_cast<std::uint8_t>(size);
+    c.width = 1;
+    c.style = style;
+    col_++;
+    return true;
+  }
+
+private:
+  static cell blank() {
+    cell c{};
+    c.bytes[0] = ' ';
+    c.size = 1;
+    c.width = 1;
+    c.style = style_plain;
+    return c;
+  }
+
+  std::size_t rows_{0};
+  std::size_t cols_{0};
+  std::vector<cell> front_;
+  std::vector<cell> back_;
+
+  /// Where the terminal's cursor is, if we know
+  std::size_t row_{0};
+  std::size_t col_{0};
+  bool cursor_known_{false};
+  std::uint8_t current_style_{unknown_style};
+
+  /// Where the cursor should rest after a flush
+  std::size_t cursor_row_{0};
+  std::size_t cursor_col_{0};
+};
+
+#endif // TTT_SCREEN_HPP_
@@ -0,0 +1,178 @@
+#ifndef TTT_SESSION_HPP_
+#define TTT_SESSION_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "passage.hpp"
+#include "score.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// On-disk layout of a recorded session:
+///
+///   session_header
+///   uint32_t line_offsets[num_lines + 1]
+///   uint32_t indents[num_lines]
+///   char     text[text_size], zero-padded to an 8-byte boundary
+///   keystroke keys[num_keys]
+///
+/// Every section stays naturally aligned, so a memory-mapped log can be
+/// scored in place.
+struct session_header {
+  char magic[4];
+  std::uint32_t version;
+  std::uint32_t text_size;
+  std::uint32_t num_lines;
+  std::uint64_t num_keys;
+  std::uint32_t flags;
+  std::uint32_t reserved;
+};
+
+static_assert(sizeof(session_header) == 32, "session header layout is part of the file format");
+
+constexpr char session_magic[4] = {'T', 'T', 'T', 'S'};
+constexpr std::uint32_t session_version = 1;
+constexpr std::uint32_t session_flag_ascii = 1;
+constexpr const char* session_extension = ".session";
+
+/// Zero bytes needed after the tables and text to realign to 8 bytes
+inline std::size_t session_text_padding(std::size_t tables_and_text_size) {
+  return (8 - tables_and_text_size % 8) % 8;
+}
+
+/// Write a finished test to `dir`, returning the path written
+inline std::string write_session(const std::string& dir, const passage& p, const std::vector<keystroke>& keys) {
+  const auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+  const auto path = dir + "/" + std::to_string(now) + "-" + std::to_string(getpid()) + session_extension;
+
+  std::ofstream file(path, std::ios::binary);
+  if (!file) {
+    return "";
+  }
+
+  session_header header{};
+  std::memcpy(header.magic, session_magic, sizeof(header.magic));
+  header.version = session_version;
+  header.text_size = static_cast<std::uint32_t>(p.text.size());
+  header.num_lines = static_cast<std::uint32_t>(p.num_lines());
+  header.num_keys = keys.size();
+  header.flags = p.ascii ? session_flag_ascii : 0;
+
+  /// Offsets and indents are 4-byte arrays; pad the text so the
+  /// keystrokes that follow start on an 8-byte boundary
+  const char zeros[8] = {};
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(p.line_offsets.data()), p.line_offsets.size() * sizeof(std::uint32_t));
+  file.write(reinterpret_cast<const char*>(p.indents.data()), p.indents.size() * sizeof(std::uint32_t));
+  file.write(p.text.data(), p.text.size());
+  file.write(zeros, session_text_padding((2 * p.num_lines() + 1) * sizeof(std::uint32_t) + p.text.size()));
+  file.write(reinterpret_cast<const char*>(keys.data()), keys.size() * sizeof(keystroke));
+
+  return file ? path : "";
+}
+
+/// A session log mapped read-only into memory
+class mapped_session {
+public:
+  explicit mapped_session(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(session_header))) {
+      size_ = static_cast<std::size_t>(st.st_size);
+      void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        data_ = static_cast<const char*>(data);
+      }
+    }
+    ::close(fd);
+
+    if (data_) {
+      valid_ = parse();
+    }
+  }
+
+  ~mapped_session() {
+    if (data_) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  mapped_session(const mapped_session&) = delete;
+  mapped_session& operator=(const mapped_session&) = delete;
+
+  bool valid() const { return valid_; }
+
+  const session_view& view() const { return view_; }
+
+private:
+  bool parse() {
+    session_header header;
+    std::memcpy(&header, data_, sizeof(header));
+    if (std::memcmp(header.magic, session_magic, sizeof(header.magic)) != 0 || header.version != session_version) {
+      return false;
+    }
+
+    const std::size_t tables = (2 * std::size_t(header.num_lines) + 1) * sizeof(std::uint32_t);
+    const std::size_t keys_offset = sizeof(header) + tables + header.text_size
+      + session_text_padding(tables + header.text_size);
+
+    if (keys_offset > size_ || (size_ - keys_offset) / sizeof(keystroke) < header.num_keys) {
+      return false;
+    }
+
+    const auto tables_begin = data_ + sizeof(header);
+    view_.line_offsets = reinterpret_cast<const std::uint32_t*>(tables_begin);
+    view_.indents = view_.line_offsets + header.num_lines + 1;
+    view_.text = tables_begin + tables;
+    view_.num_lines = header.num_lines;
+    view_.ascii = (header.flags & session_flag_ascii) != 0;
+    view_.keys = reinterpret_cast<const keystroke*>(data_ + keys_offset);
+    view_.num_keys = header.num_keys;
+
+    /// Reject corrupt tables rather than scoring out of bounds
+    for (std::size_t n = 0; n < header.num_lines; ++n) {
+      if (view_.line_offsets[n] > view_.line_offsets[n + 1]) {
+        return false;
+      }
+    }
+    if (view_.line_offsets[header.num_lines] > header.text_size) {
+      return false;
+    }
+
+    /// An indent is that many leading spaces, so never more glyphs
+    /// than the line has
+    for (std::size_t n = 0; n < header.num_lines; ++n) {
+      const auto size = view_.line_offsets[n + 1] - view_.line_offsets[n];
+      if (view_.indents[n] > size) {
+        return false;
+      }
+      const auto line = view_.text + view_.line_offsets[n];
+      for (std::uint32_t k = 0; k < view_.indents[n]; ++k) {
+        if (line[k] != ' ') {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  const char* data_{nullptr};
+  std::size_t size_{0};
+  bool valid_{false};
+  session_view view_{};
+};
+
+#endif // TTT_SESSION_HPP_
@@ -0,0 +1,436 @@
+#ifndef TTT_TERMINAL_HPP_
+#define TTT_TERMINAL_HPP_
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+#include "metrics.hpp"
+#include "termcolor.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+/// How many colours the terminal can show
+enum class color_depth {
+  none,      // dumb terminal, pipe or NO_COLOR
+  ansi16,
+  ansi256,
+  truecolor,
+};
+
+inline const char* to_string(color_depth depth) {
+  switch (depth) {
+    case color_depth::none: return "none";
+    case color_depth::ansi16: return "16";
+    case color_depth::ansi256: return "256";
+    case color_depth::truecolor: return "truecolor";
+  }
+  return "none";
+}
+
+inline bool parse_color_depth(const std::string& str, color_depth& depth) {
+  for (auto d : {color_depth::none, color_depth::ansi16, color_depth::ansi256, color_depth::truecolor}) {
+    if (str == to_string(d)) {
+      depth = d;
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Guess the colour depth from the environment alone
+inline color_depth detect_color_depth() {
+  if (!isatty(STDOUT_FILENO) || std::getenv("NO_COLOR")) {
+    return color_depth::none;
+  }
+
+  const char* term = std::getenv("TERM");
+  if (!term || !*term || std::strcmp(term, "dumb") == 0) {
+    return color_depth::none;
+  }
+
+  const char* colorterm = std::getenv("COLORTERM");
+  if (colorterm && (std::strcmp(colorterm, "truecolor") == 0 || std::strcmp(colorterm, "24bit") == 0)) {
+    return color_depth::truecolor;
+  }
+
+  if (std::strstr(term, "direct")) {
+    return color_depth::truecolor;
+  }
+  if (std::strstr(term, "256color")) {
+    return color_depth::ansi256;
+  }
+  return color_depth::ansi16;
+}
+
+/// Ask the terminal itself whether it keeps a truecolor SGR
+///
+/// Sets a 24-bit background, reads it back with DECRQSS and finishes
+/// with a Primary Device Attributes request. Every VT100-compatible
+/// terminal answers DA, so the read ends as soon as that reply arrives
+/// and only a silent terminal costs the full timeout. Returns `fallback`
+/// if there is no answer.
+inline color_depth probe_color_depth(color_depth fallback, int timeout_ms = 100) {
+  if (fallback == color_depth::none || !isatty(STDIN_FILENO)) {
+    return fallback;
+  }
+
+  struct termios old;
+  if (tcgetattr(STDIN_FILENO, &old) < 0) {
+    return fallback;
+  }
+  auto raw = old;
+  raw.c_lflag &= ~(ICANON | ECHO);
+  raw.c_cc[VMIN] = 0;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+  const char request[] = "\033[48;2;1;2;3m\033P$qm\033\\\033[00m\033[c";
+  if (write(STDOUT_FILENO, request, sizeof(request) - 1) < 0) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &old);
+    return fallback;
+  }
+
+  std::string reply;
+  bool answered = false;
+  struct pollfd pfd{STDIN_FILENO, POLLIN, 0};
+  while (!answered && poll(&pfd, 1, timeout_ms) > 0) {
+    char buf[256];
+    const auto got = read(STDIN_FILENO, buf, sizeof(buf));
+    if (got <= 0) {
+      break;
+    }
+    reply.append(buf, static_cast<std::size_t>(got));
+
+    /// DA1 reply: CSI ? ... c
+    const auto da = reply.find("\033[?");
+    answered = da != std::string::npos && reply.find('c', da) != std::string::npos;
+  }
+
+  tcsetattr(STDIN_FILENO, TCSANOW, &old);
+
+  if (!answered) {
+    return fallback;
+  }
+  if (reply.find("48:2:1:2:3") != std::string::npos || reply.find("48;2;1;2;3") != std::string::npos
+      || reply.find("48:2::1:2:3") != std::string::npos) {
+    return color_depth::truecolor;
+  }
+  return fallback;
+}
+
+/// What a glyph in the passage is drawn as
+///
+/// Every style other than style_plain sets the same attributes
+/// (foreground and bold), so switching between two of them never
+/// needs a reset in between. style_plain is the reset itself.
+enum style : std::size_t {
+  style_plain,
+  style_pending,
+  style_correct,
+  style_error,
+  style_ghost,   // where a replayed session has got to
+  num_styles,
+};
+
+/// Escape sequences for one colour depth, built once at startup
+///
+/// The typing loop only ever writes `sgr[style]` and `reset`, so the
+/// choice of backend costs nothing per glyph.
+struct render_backend {
+  color_depth depth;
+  std::string sgr[num_styles];
+  std::string reset;
+};
+
+inline render_backend make_render_backend(color_depth depth) {
+  render_backend result;
+  result.depth = depth;
+
+  if (depth == color_depth::none) {
+    return result;
+  }
+
+  std::ostringstream os;
+  os << termcolor::colorize;
+  auto take = [&os]() {
+    auto str = os.str();
+    os.str("");
+    return str;
+  };
+
+  switch (depth) {
+    case color_depth::ansi16:
+      os << termcolor::grey << termcolor::bold;
+      result.sgr[style_pending] = take();
+      os << termcolor::yellow << termcolor::bold;
+      result.sgr[style_correct] = take();
+      os << termcolor::red << termcolor::bold;
+      result.sgr[style_error] = take();
+      os << termcolor::blue << termcolor::bold;
+      result.sgr[style_ghost] = take();
+      break;
+    case color_depth::ansi256:
+      os << termcolor::color<244> << termcolor::bold;
+      result.sgr[style_pending] = take();
+      os << termcolor::color<220> << termcolor::bold;
+      result.sgr[style_correct] = take();
+      os << termcolor::color<196> << termcolor::bold;
+      result.sgr[style_error] = take();
+      os << termcolor::color<39> << termcolor::bold;
+      result.sgr[style_ghost] = take();
+      break;
+    case color_depth::truecolor:
+      os << termcolor::color<128, 128, 128> << termcolor::bold;
+      result.sgr[style_pending] = take();
+      os << termcolor::color<229, 192, 123> << termcolor::bold;
+      result.sgr[style_correct] = take();
+      os << termcolor::color<224, 108, 117> << termcolor::bold;
+      result.sgr[style_error] = take();
+      os << termcolor::color<97, 175, 239> << termcolor::bold;
+      result.sgr[style_ghost] = take();
+      break;
+    case color_depth::none:
+      break;
+  }
+
+  os << termcolor::reset;
+  result.reset = take();
+  result.sgr[style_plain] = result.reset;
+  return result;
+}
+
+/// A run of text drawn in one style
+struct styled_span {
+  std::size_t style;
+  const char* data;
+  std::size_t size;
+};
+
+/// Append a whole run in one style: one SGR before it, one reset after
+inline void append_styled(std::string& out, const render_backend& theme, std::size_t style,
+                          const char* data, std::size_t size) {
+  out += theme.sgr[style];
+  out.append(data, size);
+  out += theme.reset;
+}
+
+/// Append several runs as one buffer. An SGR is written only where the
+/// style changes and a single reset ends it all, so a line costs one
+/// escape sequence per change of colour rather than several per glyph.
+inline void append_spans(std::string& out, const render_backend& theme,
+                         const styled_span* spans, std::size_t count) {
+  std::size_t current = num_styles;
+  for (std::size_t k = 0; k < count; ++k) {
+    if (spans[k].size == 0) {
+      continue;
+    }
+    if (spans[k].style != current) {
+      current = spans[k].style;
+      out += theme.sgr[current];
+    }
+    out.append(spans[k].data, spans[k].size);
+  }
+  if (current != num_styles) {
+    out += theme.reset;
+  }
+}
+
+namespace terminal_detail {
+
+inline struct termios& saved_termios() {
+  static struct termios saved;
+  return saved;
+}
+
+inline volatile sig_atomic_t& alternate_screen_active() {
+  static volatile sig_atomic_t active = 0;
+  return active;
+}
+
+/// Self-pipe the SIGWINCH handler writes to, so a resize shows up in
+/// poll() on whichever thread the signal happens to be delivered to
+inline int* resize_pipe() {
+  static int fds[2] = {-1, -1};
+  return fds;
+}
+
+inline void note_resize(int) {
+  const char byte = 0;
+  if (write(resize_pipe()[1], &byte, 1) < 0) {
+    /// Pipe full: a resize is already pending
+  }
+}
+
+inline void restore_and_exit(int signum) {
+  if (alternate_screen_active()) {
+    const char leave[] = "\033[00m\033[?1049l";
+    if (write(STDOUT_FILENO, leave, sizeof(leave) - 1) < 0) {
+      /// Nothing more we can do while exiting
+    }
+  }
+  tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios());
+  signal(signum, SIG_DFL);
+  raise(signum);
+}
+
+}
+
+/// Keeps the terminal in non-canonical, no-echo mode for as long as it
+/// lives, instead of toggling modes around every single read.
+/// Interrupts restore the terminal before the process goes away.
+class raw_terminal {
+public:
+  raw_terminal() {
+    active_ = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &terminal_detail::saved_termios()) == 0;
+    if (!active_) {
+      return;
+    }
+
+    auto raw = terminal_detail::saved_termios();
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+    struct sigaction restore{};
+    restore.sa_handler = terminal_detail::restore_and_exit;
+    sigemptyset(&restore.sa_mask);
+    for (std::size_t k = 0; k < exit_signals; ++k) {
+      sigaction(exit_signal(k), &restore, &saved_exit_[k]);
+    }
+
+    if (pipe2(terminal_detail::resize_pipe(), O_NONBLOCK | O_CLOEXEC) == 0) {
+      struct sigaction resize{};
+      resize.sa_handler = terminal_detail::note_resize;
+      resize.sa_flags = SA_RESTART;
+      sigemptyset(&resize.sa_mask);
+      sigaction(SIGWINCH, &resize, &saved_resize_);
+    }
+  }
+
+  /// Puts back the terminal settings and whatever handled the signals
+  /// before, as a session makes one of these per prompt
+  ~raw_terminal() {
+    if (active_) {
+      for (std::size_t k = 0; k < exit_signals; ++k) {
+        sigaction(exit_signal(k), &saved_exit_[k], nullptr);
+      }
+      auto fds = terminal_detail::resize_pipe();
+      if (fds[0] >= 0) {
+        sigaction(SIGWINCH, &saved_resize_, nullptr);
+        close(fds[0]);
+        close(fds[1]);
+        fds[0] = fds[1] = -1;
+      }
+      tcsetattr(STDIN_FILENO, TCSADRAIN, &terminal_detail::saved_termios());
+    }
+  }
+
+  raw_terminal(const raw_terminal&) = delete;
+  raw_terminal& operator=(const raw_terminal&) = delete;
+
+private:
+  enum : std::size_t { exit_signals = 3 };
+
+  static int exit_signal(std::size_t k) {
+    static const int signals[exit_signals] = {SIGINT, SIGTERM, SIGHUP};
+    return signals[k];
+  }
+
+  bool active_{false};
+  struct sigaction saved_exit_[exit_signals];
+  struct sigaction saved_resize_;
+};
+
+/// Readable once the terminal has been resized, for poll(); -1 when
+/// no raw_terminal is watching
+inline int resize_fd() {
+  return terminal_detail::resize_pipe()[0];
+}
+
+/// Whether the terminal has been resized since the last call
+inline bool take_resize() {
+  char bytes[64];
+  bool resized = false;
+  while (resize_fd() >= 0 && read(resize_fd(), bytes, sizeof(bytes)) > 0) {
+    resized = true;
+  }
+  return resized;
+}
+
+/// The terminal's size in character cells, 0 by 0 if it is not one
+inline void window_size(unsigned short& rows, unsigned short& cols) {
+  struct winsize w{};
+  ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+  rows = w.ws_row;
+  cols = w.ws_col;
+}
+
+/// Somewhere other than stdout for the test to draw on, such as an
+/// emulated screen
+class output_sink {
+public:
+  virtual ~output_sink() = default;
+  virtual void write(const char* data, std::size_t size) = 0;
+};
+
+/// The sink drawing goes to, or nullptr for stdout
+inline output_sink*& current_output_sink() {
+  static output_sink* sink = nullptr;
+  return sink;
+}
+
+/// Send bytes to the terminal, or to the current sink if there is one
+inline void write_terminal(const char* data, std::size_t size) {
+  if (current_output_sink()) {
+    local_metrics().rendered(size, 0);
+    current_output_sink()->write(data, size);
+    return;
+  }
+
+  /// A large frame can go out in pieces, and a signal can interrupt it;
+  /// carry on until all of it is out so the screen is never left torn
+  std::size_t writes = 0;
+  std::size_t done = 0;
+  while (done < size) {
+    const auto wrote = write(STDOUT_FILENO, data + done, size - done);
+    writes++;
+    if (wrote >= 0) {
+      done += static_cast<std::size_t>(wrote);
+    }
+    else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      pollfd out{STDOUT_FILENO, POLLOUT, 0};
+      poll(&out, 1, -1);
+    }
+    else if (errno != EINTR) {
+      perror("write()");
+      break;
+    }
+  }
+  local_metrics().rendered(size, writes);
+}
+
+/// Switch to the alternate screen buffer and clear it
+inline void enter_alternate_screen() {
+  const char enter[] = "\033[?1049h\033[2J\033[H";
+  terminal_detail::alternate_screen_active() = current_output_sink() == nullptr;
+  write_terminal(enter, sizeof(enter) - 1);
+}
+
+/// Return to the normal screen, with whatever was there before
+inline void leave_alternate_screen() {
+  const char leave[] = "\033[00m\033[?1049l";
+  write_terminal(leave, sizeof(leave) - 1);
+  terminal_detail::alternate_screen_active() = 0;
+}
+
+#endif // TTT_TERMINAL_HPP_
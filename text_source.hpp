@@ -0,0 +1,542 @@
+#ifndef TTT_TEXT_SOURCE_HPP_
+#define TTT_TEXT_SOURCE_HPP_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "markov.hpp"
+#include "passage.hpp"
+#include "sampling.hpp"
+#include "utf8.hpp"
+
+/// Words handed over in one go, stored back to back like a passage so
+/// a batch costs a few allocations rather than one per word
+struct word_batch {
+  std::string text;
+  std::vector<std::uint32_t> offsets{0};
+  std::vector<std::uint16_t> widths;
+
+  std::size_t size() const { return widths.size(); }
+
+  void add(const char* data, std::size_t size, std::size_t width) {
+    text.append(data, size);
+    offsets.push_back(static_cast<std::uint32_t>(text.size()));
+    widths.push_back(static_cast<std::uint16_t>(width));
+  }
+
+  void add(const std::string& word, std::size_t width) {
+    add(word.data(), word.size(), width);
+  }
+
+  void clear() {
+    text.clear();
+    offsets.assign(1, 0);
+    widths.clear();
+  }
+};
+
+/// One word as seen by the line generator
+struct word_ref {
+  const char* data;
+  std::size_t size;
+  std::size_t width;
+};
+
+/// A word list, one word per line, most common first
+///
+/// A line may also give the word's frequency after it ("the 23135851"),
+/// which the weighted source then uses instead of the rank.
+struct dictionary {
+  std::vector<std::string> words;
+  std::vector<std::size_t> widths;
+  std::vector<double> counts;
+  bool ascii{true};
+
+  /// Per word, for filtering: which letters it uses (see letter_mask)
+  /// and how many glyphs long it is, capped at 255
+  std::vector<std::uint32_t> letters;
+  std::vector<std::uint8_t> lengths;
+};
+
+/// One bit per letter a-z, either case, bit 26 for an apostrophe and
+/// bit 31 for anything else
+inline std::uint32_t letter_mask(const std::string& word) {
+  std::uint32_t mask = 0;
+  for (auto c : word) {
+    const auto lower = static_cast<unsigned char>(c) | 0x20;
+    if (lower >= 'a' && lower <= 'z') {
+      mask |= 1u << (lower - 'a');
+    }
+    else if (c == '\'') {
+      mask |= 1u << 26;
+    }
+    else {
+      mask |= 1u << 31;
+    }
+  }
+  return mask;
+}
+
+inline dictionary load_dictionary(const std::string& path) {
+  dictionary result;
+  std::ifstream file(path);
+
+  std::string line;
+  while (getline(file, line)) {
+    const auto space = line.find_first_of(" \t");
+    if (space != std::string::npos) {
+      result.counts.push_back(std::strtod(line.c_str() + space + 1, nullptr));
+      line.erase(space);
+    }
+    result.words.push_back(line);
+  }
+  if (result.counts.size() != result.words.size()) {
+    result.counts.clear();
+  }
+
+  /// Pure-ASCII dictionaries skip UTF-8 decoding entirely
+  result.widths.resize(result.words.size());
+  result.letters.resize(result.words.size());
+  result.lengths.resize(result.words.size());
+  for (std::size_t i = 0; i < result.words.size(); ++i) {
+    const auto& word = result.words[i];
+    std::size_t length;
+    if (utf8::is_ascii(word)) {
+      result.widths[i] = word.size();
+      length = word.size();
+    }
+    else {
+      result.ascii = false;
+      result.widths[i] = utf8::display_width(word);
+      length = utf8::glyph_count(word);
+    }
+    result.letters[i] = letter_mask(word);
+    result.lengths[i] = static_cast<std::uint8_t>(std::min<std::size_t>(length, 255));
+  }
+  return result;
+}
+
+/// Which dictionary words a test may use
+struct word_filter {
+  std::uint32_t allowed{~std::uint32_t(0)};   // letters a word may use
+  std::uint32_t required{0};                  // letters a word must use
+  std::size_t min_length{1};
+  std::size_t max_length{255};
+
+  bool active() const {
+    return allowed != ~std::uint32_t(0) || required != 0 || min_length > 1 || max_length < 255;
+  }
+};
+
+/// Parse "4-7", "4-" or "5" into a length range
+inline bool parse_length_range(const std::string& text, std::size_t& min_length, std::size_t& max_length) {
+  auto number = [](const std::string& digits, std::size_t& out) {
+    if (digits.empty() || digits.size() > 3 || digits.find_first_not_of("0123456789") != std::string::npos) {
+      return false;
+    }
+    out = std::stoul(digits);
+    return true;
+  };
+
+  const auto dash = text.find('-');
+  std::size_t low, high;
+  if (!number(text.substr(0, dash), low)) {
+    return false;
+  }
+  if (dash == std::string::npos) {
+    high = low;
+  }
+  else if (dash + 1 == text.size()) {
+    high = 255;
+  }
+  else if (!number(text.substr(dash + 1), high)) {
+    return false;
+  }
+  if (low > high) {
+    return false;
+  }
+  min_length = low;
+  max_length = high;
+  return true;
+}
+
+/// Indices of the words that pass `filter`, in dictionary order
+///
+/// The scan only reads the masks and lengths, and has no branches, so
+/// the compiler vectorises it; half a million words take about half a
+/// millisecond.
+inline std::vector<std::uint32_t> filter_words(const dictionary& dict, const word_filter& filter) {
+  const auto size = dict.letters.size();
+  const auto forbidden = ~filter.allowed;
+  const auto required = filter.required;
+  const auto min_length = static_cast<std::uint8_t>(std::min<std::size_t>(filter.min_length, 255));
+  const auto span = static_cast<std::uint8_t>(std::min<std::size_t>(filter.max_length, 255) - min_length);
+  const auto* letters = dict.letters.data();
+  const auto* lengths = dict.lengths.data();
+
+  std::vector<std::uint8_t> pass(size);
+  for (std::size_t i = 0; i < size; ++i) {
+    pass[i] = ((letters[i] & forbidden) == 0) & ((letters[i] & required) == required)
+      & (static_cast<std::uint8_t>(lengths[i] - min_length) <= span);
+  }
+
+  std::vector<std::uint32_t> result;
+  result.reserve(size);
+  for (std::size_t i = 0; i < size; ++i) {
+    if (pass[i]) {
+      result.push_back(static_cast<std::uint32_t>(i));
+    }
+  }
+  return result;
+}
+
+/// The words at `indices` as a dictionary of their own, for the sources
+inline dictionary select_words(const dictionary& dict, const std::vector<std::uint32_t>& indices) {
+  dictionary result;
+  result.ascii = dict.ascii;
+  result.words.reserve(indices.size());
+  for (auto i : indices) {
+    result.words.push_back(dict.words[i]);
+    result.widths.push_back(dict.widths[i]);
+    result.letters.push_back(dict.letters[i]);
+    result.lengths.push_back(dict.lengths[i]);
+    if (!dict.counts.empty()) {
+      result.counts.push_back(dict.counts[i]);
+    }
+  }
+  return result;
+}
+
+/// Where the words of a test come from
+class text_source {
+public:
+  virtual ~text_source() {}
+
+  /// Append the next `count` words to `out`. False if the source has
+  /// no words to give and never will.
+  virtual bool fill(word_batch& out, std::size_t count) = 0;
+};
+
+/// Every dictionary word equally likely, optionally never repeating
+/// any of the last `no_repeat` words
+class uniform_source : public text_source {
+public:
+  uniform_source(const dictionary& dict, std::uint64_t seed, std::size_t no_repeat)
+    : dict_(dict), gen_(seed, 1),
+      recent_(std::min(no_repeat, dict.words.empty() ? 0 : dict.words.size() - 1)) {}
+
+  bool fill(word_batch& out, std::size_t count) override {
+    const auto size = static_cast<std::uint32_t>(dict_.words.size());
+    if (size == 0) {
+      return false;
+    }
+    for (std::size_t k = 0; k < count; ++k) {
+      const auto index = bounded_fresh(gen_, size, recent_);
+      out.add(dict_.words[index], dict_.widths[index]);
+    }
+    return true;
+  }
+
+private:
+  const dictionary& dict_;
+  counter_rng gen_;
+  recent_window recent_;
+};
+
+/// Common words more often: by the dictionary's counts if it has
+/// them, else by Zipf's law over the rank
+class weighted_source : public text_source {
+public:
+  weighted_source(const dictionary& dict, std::uint64_t seed, std::size_t no_repeat)
+    : dict_(dict), gen_(seed, 2),
+      recent_(std::min(no_repeat, dict.words.empty() ? 0 : dict.words.size() - 1)) {
+    cumulative_.reserve(dict.words.size());
+    for (std::size_t i = 0; i < dict.words.size(); ++i) {
+      total_ += dict.counts.empty() ? 1.0 / double(i + 1) : dict.counts[i];
+      cumulative_.push_back(total_);
+    }
+  }
+
+  bool fill(word_batch& out, std::size_t count) override {
+    if (cumulative_.empty()) {
+      return false;
+    }
+    for (std::size_t k = 0; k < count; ++k) {
+      std::uint32_t index;
+      do {
+        const auto it = std::upper_bound(cumulative_.begin(), cumulative_.end(), unit_interval(gen_) * total_);
+        index = static_cast<std::uint32_t>(std::min<std::size_t>(it - cumulative_.begin(), cumulative_.size() - 1));
+      } while (recent_.contains(index));
+      recent_.push(index);
+      out.add(dict_.words[index], dict_.widths[index]);
+    }
+    return true;
+  }
+
+private:
+  const dictionary& dict_;
+  counter_rng gen_;
+  recent_window recent_;
+  std::vector<double> cumulative_;
+  double total_{0};
+};
+
+/// Split a line of running text into words
+inline void split_words(const std::string& line, std::vector<std::string>& out) {
+  std::istringstream stream(line);
+  std::string word;
+  while (stream >> word) {
+    out.push_back(word);
+  }
+}
+
+/// Running text from a corpus, in order, from a random place onwards
+class sequential_source : public text_source {
+public:
+  sequential_source(const std::string& path, std::uint64_t seed) : reader_(path) {
+    if (reader_.good()) {
+      counter_rng gen(seed, 3);
+      offset_ = bounded(gen, reader_.size());
+    }
+  }
+
+  bool good() const { return reader_.good(); }
+
+  bool fill(word_batch& out, std::size_t count) override {
+    std::size_t added = 0;
+
+    /// Bounded, in case the corpus holds no words at all
+    for (std::size_t attempt = 0; added < count && attempt < 64; ++attempt) {
+      if (next_ == pending_.size()) {
+        refill();
+      }
+      for (; next_ < pending_.size() && added < count; ++next_, ++added) {
+        out.add(pending_[next_], utf8::display_width(pending_[next_]));
+      }
+    }
+    return added > 0;
+  }
+
+private:
+  static constexpr std::size_t lines_per_read = 64;
+
+  void refill() {
+    pending_.clear();
+    next_ = 0;
+    lines_.clear();
+    offset_ = reader_.read_lines(offset_, lines_per_read, lines_);
+    for (const auto& line : lines_) {
+      split_words(line, pending_);
+    }
+  }
+
+  corpus_reader reader_;
+  std::size_t offset_{0};
+  std::vector<std::string> lines_;
+  std::vector<std::string> pending_;
+  std::size_t next_{0};
+};
+
+/// Word-level Markov chain of order 1 or 2 trained on a corpus
+///
+/// The model is cached next to the corpus and memory-mapped on later
+/// runs. Loading or training waits for the first fill(), which runs on
+/// the prefetch thread rather than holding up startup.
+class markov_source : public text_source {
+public:
+  markov_source(const std::string& path, std::uint32_t order, std::uint64_t seed)
+    : path_(path), order_(order), gen_(seed, 4) {
+    /// One more word than the order, for at least one transition
+    std::ifstream file(path);
+    std::string word;
+    std::uint32_t words = 0;
+    while (words <= order && file >> word) {
+      words++;
+    }
+    good_ = (order == 1 || order == 2) && words > order;
+  }
+
+  bool good() const { return good_; }
+
+  bool fill(word_batch& out, std::size_t count) override {
+    if (!loaded_) {
+      loaded_ = true;
+      if (!model_.load(path_, order_, path_ + ".markov" + std::to_string(order_))) {
+        return false;
+      }
+      state_ = random_state();
+    }
+    if (model_.num_states() == 0) {
+      return false;
+    }
+
+    for (std::size_t k = 0; k < count; ++k) {
+      std::uint32_t word;
+      while (!model_.step(state_, gen_(), word)) {
+        /// Dead end, the end of the corpus: start afresh
+        state_ = random_state();
+      }
+      out.add(model_.word_data(word), model_.word_size(word), model_.word_width(word));
+    }
+    return true;
+  }
+
+private:
+  std::uint32_t random_state() {
+    return static_cast<std::uint32_t>(bounded(gen_, model_.num_states()));
+  }
+
+  std::string path_;
+  std::uint32_t order_;
+  bool good_{false};
+  bool loaded_{false};
+  counter_rng gen_;
+  markov_model model_;
+  std::uint32_t state_{0};
+};
+
+/// Runs a text source on a background thread, keeping a few batches
+/// of words ready ahead of whoever is consuming them
+///
+/// Slow generators (a Markov model being trained, a corpus on a cold
+/// disk) then cost the consumer nothing once the first batch is in.
+/// Spent batches go back to the producer, so their buffers are reused.
+class prefetching_source {
+public:
+  explicit prefetching_source(std::unique_ptr<text_source> source,
+                              std::size_t batch_size = 256, std::size_t depth = 2)
+    : source_(std::move(source)), batch_size_(batch_size), depth_(depth) {
+    thread_ = std::thread([this]() { produce(); });
+  }
+
+  ~prefetching_source() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    changed_.notify_all();
+    thread_.join();
+  }
+
+  prefetching_source(const prefetching_source&) = delete;
+  prefetching_source& operator=(const prefetching_source&) = delete;
+
+  /// Wait for the first batch. False if the source gave up without
+  /// producing any words, e.g. a corpus of nothing but whitespace.
+  bool has_words() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this]() { return !ready_.empty() || exhausted_; });
+    return !ready_.empty();
+  }
+
+  /// The next word. Valid until the following call; blocks only if
+  /// the producer has fallen behind. Empty once the source has run dry.
+  word_ref next() {
+    while (cursor_ == current_.size()) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [this]() { return !ready_.empty() || exhausted_; });
+      if (ready_.empty()) {
+        return word_ref{current_.text.data(), 0, 0};
+      }
+      spare_.push_back(std::move(current_));
+      current_ = std::move(ready_.front());
+      ready_.pop_front();
+      cursor_ = 0;
+      lock.unlock();
+      changed_.notify_all();
+    }
+
+    const auto begin = current_.offsets[cursor_];
+    word_ref result{current_.text.data() + begin, current_.offsets[cursor_ + 1] - begin, current_.widths[cursor_]};
+    cursor_++;
+    return result;
+  }
+
+private:
+  void produce() {
+    while (true) {
+      word_batch batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this]() { return stopping_ || ready_.size() < depth_; });
+        if (stopping_) {
+          return;
+        }
+        if (!spare_.empty()) {
+          batch = std::move(spare_.back());
+          spare_.pop_back();
+        }
+      }
+
+      batch.clear();
+      const bool more = source_->fill(batch, batch_size_);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (batch.size() > 0) {
+          ready_.push_back(std::move(batch));
+        }
+        exhausted_ = !more;
+      }
+      changed_.notify_all();
+      if (!more) {
+        return;
+      }
+    }
+  }
+
+  std::unique_ptr<text_source> source_;
+  std::size_t batch_size_;
+  std::size_t depth_;
+
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::deque<word_batch> ready_;
+  std::vector<word_batch> spare_;
+  bool stopping_{false};
+  bool exhausted_{false};
+
+  /// Consumer side only
+  word_batch current_;
+  std::size_t cursor_{0};
+
+  std::thread thread_;
+};
+
+inline bool is_text_source_kind(const std::string& kind) {
+  return kind == "uniform" || kind == "weighted" || kind == "sequential" || kind == "markov";
+}
+
+/// Build the source named by `--source`. Returns null if the name is
+/// unknown or its corpus cannot be read.
+inline std::unique_ptr<text_source> make_text_source(const std::string& kind, const dictionary& dict,
+                                                     const std::string& corpus_path, std::uint32_t markov_order,
+                                                     std::size_t no_repeat, std::uint64_t seed) {
+  if (kind == "uniform") {
+    return std::unique_ptr<text_source>(new uniform_source(dict, seed, no_repeat));
+  }
+  if (kind == "weighted") {
+    return std::unique_ptr<text_source>(new weighted_source(dict, seed, no_repeat));
+  }
+  if (kind == "sequential") {
+    std::unique_ptr<sequential_source> source(new sequential_source(corpus_path, seed));
+    return source->good() ? std::move(source) : nullptr;
+  }
+  if (kind == "markov") {
+    std::unique_ptr<markov_source> source(new markov_source(corpus_path, markov_order, seed));
+    return source->good() ? std::move(source) : nullptr;
+  }
+  return nullptr;
+}
+
+#endif // TTT_TEXT_SOURCE_HPP_
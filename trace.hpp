@@ -0,0 +1,159 @@
+#ifndef TTT_TRACE_HPP_
+#define TTT_TRACE_HPP_
+
+/// Trace points for the hot paths
+///
+///   TTT_TRACE_SCOPE("render");          begin now, end at scope exit
+///   TTT_TRACE_INSTANT("getch", byte);   a point in time with a value
+///
+/// Unless TTT_TRACE is defined (`make trace`) both expand to nothing,
+/// arguments included. With it, events go into a ring buffer owned by
+/// the calling thread and are written as Chrome trace-event JSON when
+/// the program exits, to $TTT_TRACE_FILE or ttt-trace-<pid>.json. Load
+/// the file in chrome://tracing or Perfetto.
+
+#ifndef TTT_TRACE
+
+#define TTT_TRACE_SCOPE(name) ((void)0)
+#define TTT_TRACE_INSTANT(name, value) ((void)0)
+
+#else
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace trace_detail {
+
+/// Raw timestamp: the TSC where there is one, which costs a few cycles,
+/// else the monotonic clock in nanoseconds
+inline std::uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+struct event {
+  std::uint64_t ticks;
+  const char* name;
+  std::int64_t value;
+  char phase;   // 'B'egin, 'E'nd or 'i'nstant
+};
+
+/// Events of one thread. Only that thread writes; when full, the
+/// oldest events are overwritten so the end of a long run survives.
+struct ring {
+  static constexpr std::size_t capacity = 1 << 16;
+
+  explicit ring(std::size_t tid) : tid(tid), events(capacity) {}
+
+  void push(char phase, const char* name, std::int64_t value) {
+    events[written % capacity] = event{now(), name, value, phase};
+    written++;
+  }
+
+  std::size_t tid;
+  std::vector<event> events;
+  std::uint64_t written{0};
+};
+
+/// Every thread's ring, dumped when the program exits
+class registry {
+public:
+  static registry& instance() {
+    static registry r;
+    return r;
+  }
+
+  ring& local() {
+    thread_local ring* mine = nullptr;
+    if (!mine) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      rings_.emplace_back(new ring(rings_.size()));
+      mine = rings_.back().get();
+    }
+    return *mine;
+  }
+
+  ~registry() { dump(); }
+
+private:
+  registry() : start_ticks_(now()), start_(std::chrono::steady_clock::now()) {}
+
+  void dump() {
+    /// Calibrate ticks against the monotonic clock over the whole run
+    const auto ticks = now() - start_ticks_;
+    const auto elapsed_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start_).count();
+    const double us_per_tick = ticks > 0 ? elapsed_us / double(ticks) : 0.0;
+
+    const char* env = std::getenv("TTT_TRACE_FILE");
+    const auto path = env && *env ? std::string(env) : "ttt-trace-" + std::to_string(getpid()) + ".json";
+    FILE* file = std::fopen(path.c_str(), "w");
+    if (!file) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::fprintf(file, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (const auto& r : rings_) {
+      const auto begin = r->written > ring::capacity ? r->written - ring::capacity : 0;
+      for (auto k = begin; k < r->written; ++k) {
+        const auto& e = r->events[k % ring::capacity];
+        std::fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%zu%s",
+                     first ? "" : ",\n", e.name, e.phase, double(e.ticks - start_ticks_) * us_per_tick,
+                     int(getpid()), r->tid, e.phase == 'i' ? ",\"s\":\"t\"" : "");
+        if (e.phase != 'E') {
+          std::fprintf(file, ",\"args\":{\"value\":%lld}", static_cast<long long>(e.value));
+        }
+        std::fprintf(file, "}");
+        first = false;
+      }
+    }
+    std::fprintf(file, "\n]}\n");
+    std::fclose(file);
+  }
+
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<ring>> rings_;
+  std::uint64_t start_ticks_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+class scope {
+public:
+  explicit scope(const char* name) : ring_(registry::instance().local()), name_(name) {
+    ring_.push('B', name_, 0);
+  }
+  ~scope() { ring_.push('E', name_, 0); }
+
+private:
+  ring& ring_;
+  const char* name_;
+};
+
+}
+
+#define TTT_TRACE_CONCAT_(a, b) a##b
+#define TTT_TRACE_CONCAT(a, b) TTT_TRACE_CONCAT_(a, b)
+#define TTT_TRACE_SCOPE(name) trace_detail::scope TTT_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TTT_TRACE_INSTANT(name, value) \
+  trace_detail::registry::instance().local().push('i', name, static_cast<std::int64_t>(value))
+
+#endif // TTT_TRACE
+
+#endif // TTT_TRACE_HPP_
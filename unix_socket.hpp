@@ -0,0 +1,66 @@
+#ifndef TTT_UNIX_SOCKET_HPP_
+#define TTT_UNIX_SOCKET_HPP_
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/// Fill in the address of the Unix domain socket at `path`. Fails if
+/// the path does not fit.
+inline bool make_unix_address(const std::string& path, sockaddr_un& address) {
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    return false;
+  }
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+/// Bind and listen on a socket of `type` (SOCK_STREAM or SOCK_SEQPACKET,
+/// optionally | SOCK_NONBLOCK) at `path`
+///
+/// Returns the listening socket, or -1 if the path is unusable or
+/// another server is already listening there. A socket file left by a
+/// server that died refuses connections, and is safe to replace.
+inline int listen_unix(const std::string& path, int type, int backlog) {
+  sockaddr_un address;
+  if (!make_unix_address(path, address)) {
+    return -1;
+  }
+  const int fd = ::socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  auto bind_to_path = [&]() {
+    return ::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+  };
+
+  if (!bind_to_path()) {
+    const int probe = ::socket(AF_UNIX, (type & ~SOCK_NONBLOCK) | SOCK_CLOEXEC, 0);
+    int error = errno;
+    bool alive = false;
+    if (probe >= 0) {
+      alive = ::connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+      error = errno;
+      ::close(probe);
+    }
+    if (alive || error != ECONNREFUSED || ::unlink(path.c_str()) < 0 || !bind_to_path()) {
+      ::close(fd);
+      return -1;
+    }
+  }
+
+  if (::listen(fd, backlog) < 0) {
+    ::close(fd);
+    ::unlink(path.c_str());
+    return -1;
+  }
+  return fd;
+}
+
+#endif // TTT_UNIX_SOCKET_HPP_
@@ -0,0 +1,295 @@
+#ifndef TTT_UTF8_HPP_
+#define TTT_UTF8_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace utf8 {
+
+/// Number of bytes in a UTF-8 sequence, given its lead byte
+/// Returns 0 for continuation bytes and invalid leads
+inline std::size_t sequence_length(unsigned char lead) {
+  if (lead < 0x80) return 1;
+  if ((lead >> 5) == 0x06) return 2;
+  if ((lead >> 4) == 0x0E) return 3;
+  if ((lead >> 3) == 0x1E) return 4;
+  return 0;
+}
+
+inline bool is_continuation(unsigned char c) {
+  return (c & 0xC0) == 0x80;
+}
+
+/// Check 8 bytes at a time for any byte with the high bit set
+inline bool is_ascii(const char* data, std::size_t size) {
+  std::size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    std::uint64_t chunk;
+    std::memcpy(&chunk, data + i, 8);
+    if (chunk & 0x8080808080808080ULL) {
+      return false;
+    }
+  }
+  for (; i < size; ++i) {
+    if (static_cast<unsigned char>(data[i]) & 0x80) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool is_ascii(const std::string& str) {
+  return is_ascii(str.data(), str.size());
+}
+
+/// Decode the codepoint starting at str[pos] and advance pos past it
+/// Malformed input decodes to U+FFFD and consumes a single byte
+inline char32_t decode(const char* str, std::size_t size, std::size_t& pos) {
+  const auto lead = static_cast<unsigned char>(str[pos]);
+  const auto length = sequence_length(lead);
+
+  if (length == 1) {
+    pos += 1;
+    return lead;
+  }
+
+  if (length == 0 || pos + length > size) {
+    pos += 1;
+    return 0xFFFD;
+  }
+
+  char32_t cp = lead & (0xFF >> (length + 1));
+  for (std::size_t k = 1; k < length; ++k) {
+    const auto c = static_cast<unsigned char>(str[pos + k]);
+    if (!is_continuation(c)) {
+      pos += 1;
+      return 0xFFFD;
+    }
+    cp = (cp << 6) | (c & 0x3F);
+  }
+
+  pos += length;
+  return cp;
+}
+
+struct width_interval {
+  char32_t first;
+  char32_t last;
+  std::uint8_t width;
+};
+
+/// Sorted, non-overlapping ranges of codepoints whose display width is
+/// not 1. Combining marks and format characters are 0 columns wide,
+/// East Asian wide/fullwidth characters and emoji are 2 columns wide.
+static const width_interval width_table[] = {
+  {0x0300, 0x036F, 0}, {0x0483, 0x0489, 0}, {0x0591, 0x05BD, 0},
+  {0x05BF, 0x05BF, 0}, {0x05C1, 0x05C2, 0}, {0x05C4, 0x05C5, 0},
+  {0x05C7, 0x05C7, 0}, {0x0610, 0x061A, 0}, {0x064B, 0x065F, 0},
+  {0x0670, 0x0670, 0}, {0x06D6, 0x06DC, 0}, {0x06DF, 0x06E4, 0},
+  {0x06E7, 0x06E8, 0}, {0x06EA, 0x06ED, 0}, {0x0711, 0x0711, 0},
+  {0x0730, 0x074A, 0}, {0x07A6, 0x07B0, 0}, {0x0900, 0x0902, 0},
+  {0x093A, 0x093A, 0}, {0x093C, 0x093C, 0}, {0x0941, 0x0948, 0},
+  {0x094D, 0x094D, 0}, {0x0951, 0x0957, 0}, {0x0962, 0x0963, 0},
+  {0x0E31, 0x0E31, 0}, {0x0E34, 0x0E3A, 0}, {0x0E47, 0x0E4E, 0},
+  {0x1100, 0x115F, 2}, {0x1AB0, 0x1AFF, 0}, {0x1DC0, 0x1DFF, 0},
+  {0x200B, 0x200F, 0}, {0x202A, 0x202E, 0}, {0x2060, 0x2064, 0},
+  {0x20D0, 0x20FF, 0}, {0x231A, 0x231B, 2}, {0x2329, 0x232A, 2},
+  {0x23E9, 0x23EC, 2}, {0x23F0, 0x23F0, 2}, {0x23F3, 0x23F3, 2},
+  {0x25FD, 0x25FE, 2}, {0x2614, 0x2615, 2}, {0x2E80, 0x303E, 2},
+  {0x3041, 0x33FF, 2}, {0x3400, 0x4DBF, 2}, {0x4E00, 0x9FFF, 2},
+  {0xA000, 0xA4CF, 2}, {0xA960, 0xA97F, 2}, {0xAC00, 0xD7A3, 2},
+  {0xF900, 0xFAFF, 2}, {0xFE00, 0xFE0F, 0}, {0xFE10, 0xFE19, 2},
+  {0xFE20, 0xFE2F, 0}, {0xFE30, 0xFE6F, 2}, {0xFEFF, 0xFEFF, 0},
+  {0xFF00, 0xFF60, 2}, {0xFFE0, 0xFFE6, 2}, {0x1F1E6, 0x1F1FF, 2},
+  {0x1F300, 0x1F64F, 2}, {0x1F900, 0x1F9FF, 2}, {0x20000, 0x2FFFD, 2},
+  {0x30000, 0x3FFFD, 2}, {0xE0100, 0xE01EF, 0},
+};
+
+/// Number of terminal columns used by a codepoint
+inline std::size_t width(char32_t cp) {
+  /// Everything below the first table entry is narrow
+  if (cp < 0x0300) {
+    return (cp < 0x20 || cp == 0x7F) ? 0 : 1;
+  }
+
+  const auto end = std::end(width_table);
+  const auto it = std::upper_bound(std::begin(width_table), end, cp,
+    [](char32_t value, const width_interval& interval) { return value < interval.first; });
+
+  if (it != std::begin(width_table) && cp <= (it - 1)->last) {
+    return (it - 1)->width;
+  }
+  return 1;
+}
+
+/// Display width of a whole string. A newline counts one column for
+/// its marker, as in segment().
+inline std::size_t display_width(const std::string& str) {
+  if (is_ascii(str)) {
+    return str.size();
+  }
+
+  std::size_t result{0};
+  std::size_t pos = 0;
+  while (pos < str.size()) {
+    const auto cp = decode(str.data(), str.size(), pos);
+    result += (cp == '\n') ? 1 : width(cp);
+  }
+  return result;
+}
+
+/// Does this keystroke consist of a single zero-width codepoint,
+/// e.g. a combining accent sent after its base letter?
+inline bool is_zero_width(const char* bytes, std::size_t size) {
+  if (size < 2) {
+    return false;
+  }
+  std::size_t pos = 0;
+  const auto cp = decode(bytes, size, pos);
+  return pos == size && width(cp) == 0;
+}
+
+/// A user-perceived character: a base codepoint followed by any
+/// zero-width combining marks, variation selectors or ZWJ sequences
+struct glyph {
+  std::uint32_t offset;
+  std::uint16_t size;
+  std::uint8_t width;
+  std::uint8_t base_size;
+};
+
+/// Split a string into glyphs, appending them to `out`
+inline void segment(const char* data, std::size_t size, std::vector<glyph>& out) {
+  std::size_t pos = 0;
+  bool joining = false;
+
+  while (pos < size) {
+    const auto start = pos;
+    const auto cp = decode(data, size, pos);
+    /// Newlines are typed with Enter and drawn as a visible marker
+    const auto w = (cp == '\n') ? 1 : width(cp);
+    const bool regional = (cp >= 0x1F1E6 && cp <= 0x1F1FF);
+
+    bool attach = !out.empty() && (w == 0 || joining);
+
+    /// Pair up regional indicators into a single flag
+    if (regional && !out.empty() && out.back().base_size == 4 && out.back().size == 4) {
+      std::size_t prev = out.back().offset;
+      const auto prev_cp = decode(data, size, prev);
+      if (prev_cp >= 0x1F1E6 && prev_cp <= 0x1F1FF) {
+        attach = true;
+      }
+    }
+
+    if (attach) {
+      out.back().size = static_cast<std::uint16_t>(pos - out.back().offset);
+    } else {
+      out.push_back(glyph{static_cast<std::uint32_t>(start),
+                          static_cast<std::uint16_t>(pos - start),
+                          static_cast<std::uint8_t>(w),
+                          static_cast<std::uint8_t>(pos - start)});
+    }
+
+    joining = (cp == 0x200D);
+  }
+}
+
+inline void segment(const std::string& str, std::vector<glyph>& out) {
+  segment(str.data(), str.size(), out);
+}
+
+/// Number of glyphs in a string
+inline std::size_t glyph_count(const char* data, std::size_t size) {
+  if (is_ascii(data, size)) {
+    return size;
+  }
+  std::vector<glyph> glyphs;
+  segment(data, size, glyphs);
+  return glyphs.size();
+}
+
+inline std::size_t glyph_count(const std::string& str) {
+  return glyph_count(str.data(), str.size());
+}
+
+/// Target text of one line, indexed by glyph rather than by byte
+///
+/// When the text is known to be pure ASCII no glyph table is built
+/// and glyph i is simply byte i.
+class line {
+public:
+  void assign(const std::string& str, bool known_ascii = false) {
+    assign(str.data(), str.size(), known_ascii);
+  }
+
+  void assign(const char* data, std::size_t size, bool known_ascii = false) {
+    text_.assign(data, size);
+    glyphs_.clear();
+    ascii_ = known_ascii || is_ascii(text_);
+    if (!ascii_) {
+      segment(text_.data(), text_.size(), glyphs_);
+    }
+  }
+
+  const std::string& text() const { return text_; }
+
+  bool ascii() const { return ascii_; }
+
+  /// Number of glyphs
+  std::size_t size() const {
+    return ascii_ ? text_.size() : glyphs_.size();
+  }
+
+  glyph at(std::size_t i) const {
+    if (ascii_) {
+      return glyph{static_cast<std::uint32_t>(i), 1, 1, 1};
+    }
+    return glyphs_[i];
+  }
+
+  /// Display width of glyphs [first, last)
+  std::size_t width(std::size_t first, std::size_t last) const {
+    if (ascii_) {
+      return last - first;
+    }
+    std::size_t result{0};
+    for (std::size_t i = first; i < last; ++i) {
+      result += glyphs_[i].width;
+    }
+    return result;
+  }
+
+  bool is_space(std::size_t i) const {
+    const auto g = at(i);
+    return g.size == 1 && text_[g.offset] == ' ';
+  }
+
+  /// Does a typed keystroke match glyph i?
+  /// A glyph carrying combining marks also accepts its bare base character
+  bool matches(std::size_t i, const char* bytes, std::size_t size) const {
+    const auto g = at(i);
+    const auto data = text_.data() + g.offset;
+    if (size == g.size && std::memcmp(data, bytes, size) == 0) {
+      return true;
+    }
+    return size == g.base_size && std::memcmp(data, bytes, size) == 0;
+  }
+
+  template <typename Stream>
+  void print(Stream& stream, std::size_t i) const {
+    const auto g = at(i);
+    stream.write(text_.data() + g.offset, g.size);
+  }
+
+private:
+  std::string text_;
+  std::vector<glyph> glyphs_;
+  bool ascii_{true};
+};
+
+}
+
+#endif // TTT_UTF8_HPP_
@@ -0,0 +1,534 @@
+#ifndef TTT_VT_HPP_
+#define TTT_VT_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "utf8.hpp"
+
+/// Colours and attributes of a cell, as set by SGR
+///
+/// A colour is 0 for the default, 1 + n for palette entry n, or
+/// vt_rgb | 0xRRGGBB for truecolor.
+struct vt_style {
+  enum : std::uint8_t { bold = 1, dim = 2, italic = 4, underline = 8, blink = 16, reverse = 32, concealed = 64 };
+
+  std::uint32_t fg{0};
+  std::uint32_t bg{0};
+  std::uint8_t attributes{0};
+
+  bool operator==(const vt_style& other) const {
+    return fg == other.fg && bg == other.bg && attributes == other.attributes;
+  }
+  bool operator!=(const vt_style& other) const { return !(*this == other); }
+};
+
+constexpr std::uint32_t vt_rgb = 1u << 24;
+
+/// One cell of the emulated screen
+struct vt_cell {
+  char bytes[15];
+  std::uint8_t size;    // 0 marks the right half of a wide glyph
+  std::uint8_t width;
+  vt_style style;
+
+  bool operator==(const vt_cell& other) const {
+    return size == other.size && width == other.width && style == other.style
+      && std::memcmp(bytes, other.bytes, size) == 0;
+  }
+  bool operator!=(const vt_cell& other) const { return !(*this == other); }
+};
+
+/// What one write did to the screen
+struct vt_frame {
+  std::size_t bytes{0};
+  std::size_t sequences{0};       // escape sequences, of any kind
+  std::size_t cells_changed{0};   // cells that look different afterwards
+};
+
+/// A minimal VT100/xterm screen, for measuring and checking what ttt
+/// draws without a terminal
+///
+/// It understands what ttt and termcolor emit: printable UTF-8 with
+/// wide and combining glyphs, CR, LF, BS and TAB, cursor motion (CUU,
+/// CUD, CUF, CUB, CHA, CUP), ED, EL, SGR in 16, 256 and 24-bit colour,
+/// DECSC/DECRC and the alternate screen. Other sequences are parsed
+/// and ignored. Every feed() is taken to be one frame.
+///
+/// LF also returns the carriage, as it does on a tty that keeps its
+/// default ONLCR output processing.
+class vt_emulator {
+public:
+  vt_emulator(std::size_t rows, std::size_t cols)
+    : rows_(rows), cols_(cols), main_(rows * cols, blank()), alternate_(rows * cols, blank()),
+      stamps_(rows * cols, 0) {
+    /// So that feeding frames allocates nothing
+    params_.reserve(64);
+    originals_.reserve(rows * cols);
+    before_.reserve(rows * cols);
+  }
+
+  /// Make room for the stats of this many frames
+  void reserve(std::size_t frames) {
+    frames_.reserve(frames);
+  }
+
+  void feed(const char* data, std::size_t size) {
+    frame_ = vt_frame{};
+    frame_.bytes = size;
+    generation_++;
+    originals_.clear();
+    switched_ = false;
+
+    for (std::size_t k = 0; k < size; ++k) {
+      consume(static_cast<unsigned char>(data[k]));
+    }
+
+    if (switched_) {
+      for (std::size_t k = 0; k < before_.size(); ++k) {
+        frame_.cells_changed += before_[k] != grid()[k];
+      }
+    }
+    else {
+      for (const auto& original : originals_) {
+        frame_.cells_changed += original.second != grid()[original.first];
+      }
+    }
+    frames_.push_back(frame_);
+  }
+
+  void feed(const std::string& data) { feed(data.data(), data.size()); }
+
+  const std::vector<vt_frame>& frames() const { return frames_; }
+
+  std::size_t rows() const { return rows_; }
+  std::size_t cols() const { return cols_; }
+  std::size_t cursor_row() const { return row_; }
+  std::size_t cursor_col() const { return col_; }
+  bool on_alternate_screen() const { return on_alternate_; }
+  bool used_alternate_screen() const { return used_alternate_; }
+
+  /// A cell of the screen shown now, or with `alternate` of the
+  /// alternate screen as it was last shown
+  const vt_cell& at(std::size_t row, std::size_t col, bool alternate = false) const {
+    return (alternate ? alternate_ : grid())[row * cols_ + col];
+  }
+
+  /// The glyphs of a row, trailing blanks left out
+  std::string row_text(std::size_t row, bool alternate = false) const {
+    std::string result;
+    std::size_t kept = 0;
+    for (std::size_t col = 0; col < cols_; ++col) {
+      const auto& c = at(row, col, alternate);
+      result.append(c.bytes, c.size);
+      if (!(c.size == 1 && c.bytes[0] == ' ')) {
+        kept = result.size();
+      }
+    }
+    result.resize(kept);
+    return result;
+  }
+
+  /// The style a string of SGR sequences leaves, from the default
+  static vt_style parse_style(const std::string& sgr) {
+    vt_emulator probe(1, 2);
+    probe.feed(sgr + "x");
+    return probe.at(0, 0).style;
+  }
+
+private:
+  enum class state { ground, escape, csi, string, string_escape };
+
+  static vt_cell blank(const vt_style& style = vt_style{}) {
+    vt_cell c{};
+    c.bytes[0] = ' ';
+    c.size = 1;
+    c.width = 1;
+    c.style.bg = style.bg;
+    return c;
+  }
+
+  std::vector<vt_cell>& grid() { return on_alternate_ ? alternate_ : main_; }
+  const std::vector<vt_cell>& grid() const { return on_alternate_ ? alternate_ : main_; }
+
+  /// Remember what a cell looked like when the frame began
+  vt_cell& cell(std::size_t row, std::size_t col) {
+    const auto index = row * cols_ + col;
+    if (stamps_[index] != generation_) {
+      stamps_[index] = generation_;
+      originals_.emplace_back(index, grid()[index]);
+    }
+    return grid()[index];
+  }
+
+  void consume(unsigned char byte) {
+    switch (state_) {
+      case state::ground:
+        ground(byte);
+        break;
+
+      case state::escape:
+        if (byte == '[') {
+          params_.clear();
+          private_ = false;
+          state_ = state::csi;
+          return;
+        }
+        if (byte == ']' || byte == 'P' || byte == '^' || byte == '_') {
+          /// OSC, DCS, PM, APC: skipped up to BEL or ST
+          state_ = state::string;
+          return;
+        }
+        if (byte == '7') {
+          saved_row_ = row_;
+          saved_col_ = col_;
+        }
+        else if (byte == '8') {
+          move_to(saved_row_, saved_col_);
+        }
+        frame_.sequences++;
+        state_ = state::ground;
+        break;
+
+      case state::csi:
+        if (byte >= 0x40 && byte <= 0x7E) {
+          frame_.sequences++;
+          state_ = state::ground;
+          dispatch(static_cast<char>(byte));
+        }
+        else if (byte == '?') {
+          private_ = true;
+        }
+        else if (byte >= 0x20 && byte < 0x40) {
+          params_ += static_cast<char>(byte);
+        }
+        else {
+          state_ = state::ground;
+        }
+        break;
+
+      case state::string:
+        if (byte == 0x07) {
+          frame_.sequences++;
+          state_ = state::ground;
+        }
+        else if (byte == 0x1B) {
+          state_ = state::string_escape;
+        }
+        break;
+
+      case state::string_escape:
+        frame_.sequences++;
+        state_ = state::ground;
+        break;
+    }
+  }
+
+  void ground(unsigned char byte) {
+    if (pending_size_ > 0) {
+      if (utf8::is_continuation(byte)) {
+        glyph_[pending_size_++] = static_cast<char>(byte);
+        if (pending_size_ == pending_length_) {
+          print(glyph_, pending_size_);
+          pending_size_ = 0;
+        }
+        return;
+      }
+      /// Malformed sequence, drop it
+      pending_size_ = 0;
+    }
+
+    switch (byte) {
+      case 0x1B: state_ = state::escape; return;
+      case '\r': col_ = 0; wrap_pending_ = false; return;
+      case '\n': col_ = 0; line_feed(); return;
+      case '\b':
+        if (col_ > 0) {
+          col_--;
+        }
+        wrap_pending_ = false;
+        return;
+      case '\t': col_ = std::min(cols_ - 1, (col_ / 8 + 1) * 8); return;
+      default: break;
+    }
+    if (byte < 0x20 || byte == 0x7F) {
+      return;
+    }
+
+    const auto length = utf8::sequence_length(byte);
+    glyph_[0] = static_cast<char>(byte);
+    if (length <= 1) {
+      print(glyph_, 1);
+      return;
+    }
+    pending_size_ = 1;
+    pending_length_ = length;
+  }
+
+  void print(const char* bytes, std::size_t size) {
+    std::size_t pos = 0;
+    const auto width = utf8::width(utf8::decode(bytes, size, pos));
+
+    if (width == 0) {
+      /// Combining mark: joins the glyph before the cursor
+      if (col_ > 0 || wrap_pending_) {
+        auto c = wrap_pending_ ? col_ : col_ - 1;
+        while (c > 0 && grid()[row_ * cols_ + c].size == 0) {
+          c--;
+        }
+        auto& base = cell(row_, c);
+        if (base.size + size <= sizeof(base.bytes)) {
+          std::memcpy(base.bytes + base.size, bytes, size);
+          base.size = static_cast<std::uint8_t>(base.size + size);
+        }
+      }
+      return;
+    }
+
+    if (wrap_pending_ || col_ + width > cols_) {
+      col_ = 0;
+      line_feed();
+    }
+
+    auto& c = cell(row_, col_);
+    std::memcpy(c.bytes, bytes, size);
+    c.size = static_cast<std::uint8_t>(size);
+    c.width = static_cast<std::uint8_t>(width);
+    c.style = style_;
+    for (std::size_t k = 1; k < width; ++k) {
+      auto& right = cell(row_, col_ + k);
+      right.size = 0;
+      right.width = 0;
+      right.style = style_;
+    }
+
+    col_ += width;
+    if (col_ >= cols_) {
+      col_ = cols_ - 1;
+      wrap_pending_ = true;
+    }
+  }
+
+  void line_feed() {
+    wrap_pending_ = false;
+    if (row_ + 1 < rows_) {
+      row_++;
+      return;
+    }
+    /// Scroll the whole screen up a row
+    for (std::size_t r = 0; r + 1 < rows_; ++r) {
+      for (std::size_t c = 0; c < cols_; ++c) {
+        cell(r, c) = grid()[(r + 1) * cols_ + c];
+      }
+    }
+    for (std::size_t c = 0; c < cols_; ++c) {
+      cell(rows_ - 1, c) = blank(style_);
+    }
+  }
+
+  void move_to(std::size_t row, std::size_t col) {
+    row_ = std::min(row, rows_ - 1);
+    col_ = std::min(col, cols_ - 1);
+    wrap_pending_ = false;
+  }
+
+  /// Numeric parameters of a CSI sequence, missing ones as 0
+  struct parameters {
+    enum : std::size_t { capacity = 16 };
+
+    std::size_t values[capacity];
+    std::size_t count;
+
+    std::size_t size() const { return count; }
+    std::size_t operator[](std::size_t k) const { return values[k]; }
+  };
+
+  parameters numbers() const {
+    parameters result{};
+    result.count = 1;
+    for (auto c : params_) {
+      if (c == ';' || c == ':') {
+        if (result.count < parameters::capacity) {
+          result.count++;
+        }
+      }
+      else if (c >= '0' && c <= '9') {
+        auto& value = result.values[result.count - 1];
+        value = value * 10 + static_cast<std::size_t>(c - '0');
+      }
+    }
+    return result;
+  }
+
+  void erase(std::size_t row, std::size_t from, std::size_t to) {
+    for (auto c = from; c < to; ++c) {
+      cell(row, c) = blank(style_);
+    }
+  }
+
+  void dispatch(char final) {
+    const auto args = numbers();
+    const auto n = std::max<std::size_t>(args[0], 1);
+
+    if (private_) {
+      if ((final == 'h' || final == 'l') && args[0] == 1049) {
+        switch_screen(final == 'h');
+      }
+      return;
+    }
+
+    switch (final) {
+      case 'A': move_to(row_ > n ? row_ - n : 0, col_); break;
+      case 'B': move_to(row_ + n, col_); break;
+      case 'C': move_to(row_, col_ + n); break;
+      case 'D': move_to(row_, col_ > n ? col_ - n : 0); break;
+      case 'G': move_to(row_, n - 1); break;
+      case 'H':
+      case 'f': move_to(n - 1, args.size() > 1 && args[1] > 0 ? args[1] - 1 : 0); break;
+      case 'J':
+        if (args[0] == 0) {
+          erase(row_, col_, cols_);
+          for (auto r = row_ + 1; r < rows_; ++r) {
+            erase(r, 0, cols_);
+          }
+        }
+        else if (args[0] == 1) {
+          for (std::size_t r = 0; r < row_; ++r) {
+            erase(r, 0, cols_);
+          }
+          erase(row_, 0, col_ + 1);
+        }
+        else {
+          for (std::size_t r = 0; r < rows_; ++r) {
+            erase(r, 0, cols_);
+          }
+        }
+        break;
+      case 'K':
+        if (args[0] == 0) {
+          erase(row_, col_, cols_);
+        }
+        else if (args[0] == 1) {
+          erase(row_, 0, col_ + 1);
+        }
+        else {
+          erase(row_, 0, cols_);
+        }
+        break;
+      case 'm': select_graphic_rendition(args); break;
+      case 's':
+        saved_row_ = row_;
+        saved_col_ = col_;
+        break;
+      case 'u': move_to(saved_row_, saved_col_); break;
+      default: break;
+    }
+  }
+
+  void select_graphic_rendition(const parameters& args) {
+    auto extended = [&](std::size_t& k) -> std::uint32_t {
+      if (k + 2 < args.size() && args[k + 1] == 5) {
+        k += 2;
+        return 1 + static_cast<std::uint32_t>(args[k] & 0xFF);
+      }
+      if (k + 4 < args.size() && args[k + 1] == 2) {
+        const auto rgb = static_cast<std::uint32_t>(((args[k + 2] & 0xFF) << 16) | ((args[k + 3] & 0xFF) << 8)
+                                                    | (args[k + 4] & 0xFF));
+        k += 4;
+        return vt_rgb | rgb;
+      }
+      k = args.size();
+      return 0;
+    };
+
+    for (std::size_t k = 0; k < args.size(); ++k) {
+      const auto a = args[k];
+      if (a == 0) {
+        style_ = vt_style{};
+      }
+      else if (a == 1) style_.attributes |= vt_style::bold;
+      else if (a == 2) style_.attributes |= vt_style::dim;
+      else if (a == 3) style_.attributes |= vt_style::italic;
+      else if (a == 4) style_.attributes |= vt_style::underline;
+      else if (a == 5) style_.attributes |= vt_style::blink;
+      else if (a == 7) style_.attributes |= vt_style::reverse;
+      else if (a == 8) style_.attributes |= vt_style::concealed;
+      else if (a == 22) style_.attributes &= ~(vt_style::bold | vt_style::dim);
+      else if (a == 23) style_.attributes &= ~vt_style::italic;
+      else if (a == 24) style_.attributes &= ~vt_style::underline;
+      else if (a == 25) style_.attributes &= ~vt_style::blink;
+      else if (a == 27) style_.attributes &= ~vt_style::reverse;
+      else if (a == 28) style_.attributes &= ~vt_style::concealed;
+      else if (a >= 30 && a <= 37) style_.fg = 1 + static_cast<std::uint32_t>(a - 30);
+      else if (a == 38) style_.fg = extended(k);
+      else if (a == 39) style_.fg = 0;
+      else if (a >= 40 && a <= 47) style_.bg = 1 + static_cast<std::uint32_t>(a - 40);
+      else if (a == 48) style_.bg = extended(k);
+      else if (a == 49) style_.bg = 0;
+      else if (a >= 90 && a <= 97) style_.fg = 1 + static_cast<std::uint32_t>(a - 90 + 8);
+      else if (a >= 100 && a <= 107) style_.bg = 1 + static_cast<std::uint32_t>(a - 100 + 8);
+    }
+  }
+
+  /// xterm's 1049: save the cursor and switch to a cleared alternate
+  /// screen, or switch back and restore it. The alternate screen's
+  /// last contents are kept for at(..., true).
+  void switch_screen(bool alternate) {
+    if (alternate == on_alternate_) {
+      return;
+    }
+    if (!switched_) {
+      before_ = grid();
+      switched_ = true;
+    }
+    if (alternate) {
+      main_row_ = row_;
+      main_col_ = col_;
+      on_alternate_ = true;
+      used_alternate_ = true;
+      std::fill(alternate_.begin(), alternate_.end(), blank());
+      move_to(0, 0);
+    }
+    else {
+      on_alternate_ = false;
+      move_to(main_row_, main_col_);
+    }
+  }
+
+  std::size_t rows_;
+  std::size_t cols_;
+  std::vector<vt_cell> main_;
+  std::vector<vt_cell> alternate_;
+  bool on_alternate_{false};
+  bool used_alternate_{false};
+
+  std::size_t row_{0};
+  std::size_t col_{0};
+  bool wrap_pending_{false};
+  vt_style style_;
+  std::size_t saved_row_{0};
+  std::size_t saved_col_{0};
+  std::size_t main_row_{0};
+  std::size_t main_col_{0};
+
+  state state_{state::ground};
+  std::string params_;
+  bool private_{false};
+  char glyph_[4];
+  std::size_t pending_size_{0};
+  std::size_t pending_length_{0};
+
+  /// Per-frame accounting: each cell's state when the frame began
+  vt_frame frame_;
+  std::uint64_t generation_{0};
+  std::vector<std::uint64_t> stamps_;
+  std::vector<std::pair<std::size_t, vt_cell>> originals_;
+  bool switched_{false};
+  std::vector<vt_cell> before_;
+  std::vector<vt_frame> frames_;
+};
+
+#endif // TTT_VT_HPP_
@@ -0,0 +1,86 @@
+#ifndef TTT_WORD_TABLE_HPP_
+#define TTT_WORD_TABLE_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "utf8.hpp"
+
+/// Every distinct word seen, each stored once and known by its index
+///
+/// Words live back to back in one buffer. Lookups go through an open
+/// addressing table of ids, hashed on the bytes, so interning a word
+/// that is already known allocates nothing.
+class word_table {
+public:
+  word_table() : slots_(64, empty) {}
+
+  std::uint32_t intern(const char* data, std::size_t size, std::size_t width) {
+    const auto hash = fnv1a(data, size);
+    auto slot = hash & (slots_.size() - 1);
+    while (slots_[slot] != empty) {
+      const auto id = slots_[slot];
+      if (hashes_[id] == hash && this->size(id) == size && std::memcmp(this->data(id), data, size) == 0) {
+        return id;
+      }
+      slot = (slot + 1) & (slots_.size() - 1);
+    }
+
+    const auto id = static_cast<std::uint32_t>(widths_.size());
+    text_.append(data, size);
+    offsets_.push_back(static_cast<std::uint32_t>(text_.size()));
+    widths_.push_back(static_cast<std::uint16_t>(width));
+    hashes_.push_back(hash);
+    slots_[slot] = id;
+
+    /// Keep the load factor under a half
+    if (2 * widths_.size() > slots_.size()) {
+      grow();
+    }
+    return id;
+  }
+
+  std::uint32_t intern(const std::string& word) {
+    return intern(word.data(), word.size(), utf8::display_width(word));
+  }
+
+  /// Number of distinct words
+  std::size_t size() const { return widths_.size(); }
+
+  const char* data(std::uint32_t id) const { return text_.data() + offsets_[id]; }
+  std::size_t size(std::uint32_t id) const { return offsets_[id + 1] - offsets_[id]; }
+  std::size_t width(std::uint32_t id) const { return widths_[id]; }
+  std::string word(std::uint32_t id) const { return std::string(data(id), size(id)); }
+
+private:
+  enum : std::uint32_t { empty = 0xFFFFFFFFu };
+
+  static std::uint32_t fnv1a(const char* data, std::size_t size) {
+    std::uint32_t hash = 2166136261u;
+    for (std::size_t k = 0; k < size; ++k) {
+      hash = (hash ^ static_cast<unsigned char>(data[k])) * 16777619u;
+    }
+    return hash;
+  }
+
+  void grow() {
+    slots_.assign(slots_.size() * 2, empty);
+    for (std::uint32_t id = 0; id < widths_.size(); ++id) {
+      auto slot = hashes_[id] & (slots_.size() - 1);
+      while (slots_[slot] != empty) {
+        slot = (slot + 1) & (slots_.size() - 1);
+      }
+      slots_[slot] = id;
+    }
+  }
+
+  std::string text_;
+  std::vector<std::uint32_t> offsets_{0};
+  std::vector<std::uint16_t> widths_;
+  std::vector<std::uint32_t> hashes_;
+  std::vector<std::uint32_t> slots_;
+};
+
+#endif // TTT_WORD_TABLE_HPP_
@@ -0,0 +1,103 @@
+#ifndef TTT_WORDS_HPP_
+#define TTT_WORDS_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "passage.hpp"
+#include "score.hpp"
+#include "utf8.hpp"
+#include "word_table.hpp"
+
+/// Fill in `word_ids` for a passage that was not built from interned
+/// words (quotes, code, replays), trailing whitespace left out
+inline void intern_words(passage& p, word_table& table) {
+  if (p.stored_as_words()) {
+    return;
+  }
+  if (p.word_offsets.empty()) {
+    p.index_words();
+  }
+  p.word_ids.clear();
+  for (std::size_t w = 0; w + 1 < p.word_offsets.size(); ++w) {
+    auto begin = p.word_offsets[w];
+    auto end = p.word_offsets[w + 1];
+    while (end > begin && (p.text[end - 1] == ' ' || p.text[end - 1] == '\n')) {
+      end--;
+    }
+    while (begin < end && p.text[begin] == ' ') {
+      begin++;
+    }
+    const std::string word(p.text, begin, end - begin);
+    p.word_ids.push_back(table.intern(word));
+  }
+}
+
+/// How one distinct word went in a test
+struct word_result {
+  std::uint32_t id;
+  std::uint32_t count;      // times it came up
+  std::uint32_t glyphs;     // glyphs typed for it, its trailing space included
+  std::uint32_t mistakes;
+  std::uint64_t time_us;    // time spent on it
+};
+
+/// Per-word time and mistakes of a finished test, by interned id
+///
+/// Each keystroke's interval since the one before is charged to the
+/// word it lands in, so a word's time includes the pause before it
+/// and any backspacing within it.
+inline std::vector<word_result> word_results(const passage& p, const std::vector<keystroke>& keys) {
+  const auto num_words = p.word_ids.size();
+  if (num_words == 0 || (!p.stored_as_words() && p.word_offsets.size() != num_words + 1)) {
+    return {};
+  }
+
+  /// First glyph of every word
+  std::vector<std::uint32_t> starts(num_words + 1, 0);
+  for (std::size_t w = 0; w < num_words; ++w) {
+    if (p.stored_as_words()) {
+      starts[w + 1] = starts[w] + static_cast<std::uint32_t>(p.word_glyphs(w));
+      continue;
+    }
+    const auto size = p.word_offsets[w + 1] - p.word_offsets[w];
+    starts[w + 1] = starts[w] + static_cast<std::uint32_t>(
+      p.ascii ? size : utf8::glyph_count(p.text.data() + p.word_offsets[w], size));
+  }
+
+  std::vector<word_result> per_word(num_words, word_result{});
+  std::uint64_t previous = 0;
+  for (const auto& key : keys) {
+    const auto w = static_cast<std::size_t>(std::upper_bound(starts.begin(), starts.end() - 1, key.position)
+                                            - starts.begin()) - 1;
+    per_word[w].time_us += key.time_us - previous;
+    previous = key.time_us;
+    if (key.kind == keystroke::mistake) {
+      per_word[w].mistakes++;
+    }
+  }
+
+  /// Fold repeats of the same word together
+  std::vector<word_result> by_id;
+  std::vector<std::uint32_t> slot;
+  for (std::size_t w = 0; w < num_words; ++w) {
+    const auto id = p.word_ids[w];
+    if (id >= slot.size()) {
+      slot.resize(id + 1, ~std::uint32_t(0));
+    }
+    if (slot[id] == ~std::uint32_t(0)) {
+      slot[id] = static_cast<std::uint32_t>(by_id.size());
+      by_id.push_back(word_result{id, 0, 0, 0, 0});
+    }
+    auto& r = by_id[slot[id]];
+    r.count++;
+    r.glyphs += starts[w + 1] - starts[w];
+    r.mistakes += per_word[w].mistakes;
+    r.time_us += per_word[w].time_us;
+  }
+  return by_id;
+}
+
+#endif // TTT_WORDS_HPP_